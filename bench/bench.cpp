@@ -0,0 +1,348 @@
+// Benchmarks of the pair potentials, full steps and trajectory output.
+// Every measurement is the best of several batches, so a busy machine inflates it as little as possible.
+// Results go to stdout and, with --json, to a file that bench/compare.py compares between versions.
+#include "../impl/config.hpp"
+#include "../impl/interaction_table.hpp"
+#include "../impl/neighbor_list.hpp"
+#include "../impl/pair_kernel.hpp"
+#include "../impl/particle.hpp"
+#include "../impl/particle_store.hpp"
+#include "../impl/step_calculator.hpp"
+#include "../impl/thread_pool.hpp"
+#include "../impl/trajectory.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef SMD_GIT_REVISION
+#define SMD_GIT_REVISION "unknown"
+#endif
+
+namespace {
+using namespace smd;
+
+struct Options {
+    std::vector<int> sizes = {500, 5000, 50000, 500000, 1000000};
+    int thread_num = simulator::THREAD_NUM;
+    double min_time = 0.5;
+    double tau_ps = 0.0;
+    std::string sequence = soap::SEQUENCE;
+    std::string json_path;
+    std::string filter;
+};
+
+// one result line: name plus (key, value) metrics
+struct Result {
+    std::string name;
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+std::vector<Result> results;
+
+void report(const std::string& name, const std::vector<std::pair<std::string, double>>& metrics) {
+    std::cout << name;
+    for (const auto& metric : metrics) {
+        std::cout << "  " << metric.first << "=" << metric.second;
+    }
+    std::cout << std::endl;
+    results.push_back({name, metrics});
+}
+
+// seconds per call of fn(), best of 5 batches of at least min_time/5 each
+double time_per_call(const std::function<void()>& fn, const double min_time) {
+    using clock = std::chrono::steady_clock;
+    const auto elapsed = [](const clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+    long batch = 1;
+    while (true) {
+        const auto start = clock::now();
+        for (long call = 0; call < batch; ++call) fn();
+        if (elapsed(start) >= min_time/5.0) break;
+        batch *= 2;
+    }
+    double best = 1e300;
+    for (int batch_idx = 0; batch_idx < 5; ++batch_idx) {
+        const auto start = clock::now();
+        for (long call = 0; call < batch; ++call) fn();
+        best = std::min(best, elapsed(start)/batch);
+    }
+    return best;
+}
+
+bool selected(const Options& options, const std::string& name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+// a sink the optimizer cannot see through
+volatile double sink;
+
+void bench_potentials(const Options& options) {
+    const Config config;
+    const int pair_num = 1 << 14;
+    std::mt19937 engine(1);
+    std::uniform_real_distribution<double> coord_dist(-1.7, 1.7);
+    std::vector<Particle> a;
+    std::vector<Particle> b;
+    for (int pair_idx = 0; pair_idx < pair_num; ++pair_idx) {
+        a.emplace_back(coord_dist(engine), coord_dist(engine), coord_dist(engine), 1.0, 0.0, 0.0, 0.0);
+        b.emplace_back(coord_dist(engine), coord_dist(engine), coord_dist(engine), 1.0, 0.0, 0.0, 0.0);
+    }
+    const auto& sc = config.step_calculator;
+    const auto& pc = config.particle;
+    const std::vector<std::pair<std::string, std::function<std::array<double,3>(const Particle&, const Particle&)>>> potentials = {
+        {"spring", [&](const Particle& p, const Particle& q) { return p.calc_spring(q, config.soap.spring_k, config.soap.spring_r0, pc.fmax); }},
+        {"LennardJones", [&](const Particle& p, const Particle& q) { return p.calc_LennardJones(q, sc.water_epsilon, sc.water_sigma, pc.lj_cutoff, pc.fmax); }},
+        {"repulsive", [&](const Particle& p, const Particle& q) { return p.calc_repulsive(q, sc.head_tail_coef, pc.repulsive_d, pc.fmax); }},
+        {"soft_repulsive", [&](const Particle& p, const Particle& q) { return p.calc_soft_repulsive(q, sc.soft_repulsive_d, pc.soft_repulsive_a, pc.fmax); }},
+        {"excluded", [&](const Particle& p, const Particle& q) { return p.calc_excluded(q, sc.excluded_d, pc.fmax); }},
+        {"sphere", [&](const Particle& p, const Particle&) { return p.calc_sphere(1.0); }},
+    };
+    for (const auto& potential : potentials) {
+        const std::string name = "potential/" + potential.first;
+        if (!selected(options, name)) continue;
+        const double seconds = time_per_call([&] {
+            double sum = 0.0;
+            for (int pair_idx = 0; pair_idx < pair_num; ++pair_idx) {
+                sum += potential.second(a[pair_idx], b[pair_idx])[0];
+            }
+            sink = sum;
+        }, options.min_time);
+        report(name, {{"ns_per_pair", seconds/pair_num*1e9}});
+    }
+
+    // the tabulated sum of the terms above, which is what a step evaluates
+    const InteractionTable table(interaction_table::DR, config);
+    const std::string name = "potential/table";
+    if (selected(options, name)) {
+        const int pair = table.pair_index(WATER, HEAD);
+        const double seconds = time_per_call([&] {
+            double sum = 0.0;
+            for (int pair_idx = 0; pair_idx < pair_num; ++pair_idx) {
+                const auto v_12 = a[pair_idx].coord - b[pair_idx].coord;
+                sum += table.force_coef(pair, norm(v_12))*v_12[0];
+            }
+            sink = sum;
+        }, options.min_time);
+        report(name, {{"ns_per_pair", seconds/pair_num*1e9}});
+    }
+}
+
+// waters and soaps 3:2 as in the default system; the sphere grows with N so that the density stays the default one
+Config system_config(const Options& options, const int molecule_num) {
+    Config config;
+    config.simulator.water_num = molecule_num*3/5;
+    config.simulator.soap_num = molecule_num - config.simulator.water_num;
+    config.simulator.sphere_size = simulator::SPHERE_SIZE*std::cbrt(molecule_num/500.0);
+    config.simulator.thread_num = options.thread_num;
+    config.soap.sequence = options.sequence;
+    return config;
+}
+
+void init_store(const Config& config, ParticleStore& store) {
+    std::mt19937 engine(config.simulator.seed);
+    std::uniform_real_distribution<double> coord_dist(-(config.simulator.sphere_size-10.0), config.simulator.sphere_size-10.0);
+    for (int water_idx = 0; water_idx < store.get_water_num(); ++water_idx) {
+        store.set_coord(store.water_index(water_idx), {coord_dist(engine), coord_dist(engine), coord_dist(engine)});
+    }
+    const int bead_num = store.get_topology().bead_num();
+    for (int soap_idx = 0; soap_idx < store.get_soap_num(); ++soap_idx) {
+        const double x = coord_dist(engine);
+        const double y = coord_dist(engine);
+        const double z = coord_dist(engine);
+        // a straight chain along x, centered on (x, y, z)
+        for (int bead_idx = 0; bead_idx < bead_num; ++bead_idx) {
+            store.set_coord(store.bead_index(soap_idx, bead_idx), {x + (bead_idx - 0.5*(bead_num - 1))*config.soap.spring_r0, y, z});
+        }
+    }
+}
+
+void bench_pair_kernels(const Options& options, ThreadPool& pool) {
+    // relaxed default-density systems hold very few pairs per row, so the kernels are timed on a dense random one
+    Config config = system_config(options, 20000);
+    config.simulator.sphere_size = 25.0;
+    ParticleStore store(config.simulator.water_num, config.simulator.soap_num, config.topology(), {water::WEIGHT, config.soap.head_weight, config.soap.tail_weight});
+    init_store(config, store);
+    const InteractionTable table(interaction_table::DR, config);
+    NeighborList neighbor_list(config.neighbor_cutoff(), config.step_calculator.neighbor_skin, config.simulator.sphere_size + config.neighbor_cutoff());
+    neighbor_list.build(store, pool);
+    long pair_num = 0;
+    for (int idx = 0; idx < store.size(); ++idx) {
+        pair_num += neighbor_list.end(idx) - neighbor_list.begin(idx);
+    }
+    std::vector<double> fx(store.size()), fy(store.size()), fz(store.size());
+
+    std::vector<SimdLevel> levels = {SimdLevel::SCALAR};
+    if (detect_simd_level() != SimdLevel::SCALAR) levels.push_back(SimdLevel::AVX2);
+    if (detect_simd_level() == SimdLevel::AVX512) levels.push_back(SimdLevel::AVX512);
+    for (const auto level : levels) {
+        const std::string name = std::string("pair_kernel/") + simd_level_name(level);
+        if (!selected(options, name)) continue;
+        const PairKernel kernel = select_pair_kernel(level);
+        const double seconds = time_per_call([&] {
+            if (kernel) {
+                kernel(store, table, neighbor_list, 0, store.size(), fx.data(), fy.data(), fz.data(), 0);
+                return;
+            }
+            // the scalar path of StepCalculator::calc_pair_force
+            for (int idx = 0; idx < store.size(); ++idx) {
+                for (auto it = neighbor_list.begin(idx); it != neighbor_list.end(idx); ++it) {
+                    const int other_idx = *it;
+                    const std::array<double,3> v_12 = {store.x[idx] - store.x[other_idx], store.y[idx] - store.y[other_idx], store.z[idx] - store.z[other_idx]};
+                    const auto f = table.force_coef(table.pair_index(store.species[idx], store.species[other_idx]), norm(v_12))*v_12;
+                    fx[idx] += f[0];
+                    fy[idx] += f[1];
+                    fz[idx] += f[2];
+                    fx[other_idx] -= f[0];
+                    fy[other_idx] -= f[1];
+                    fz[other_idx] -= f[2];
+                }
+            }
+        }, options.min_time);
+        report(name, {{"particles", static_cast<double>(store.size())}, {"pairs", static_cast<double>(pair_num)}, {"ns_per_pair", seconds/pair_num*1e9}});
+    }
+}
+
+void bench_steps(const Options& options, ThreadPool& pool) {
+    for (const int molecule_num : options.sizes) {
+        const std::string minimize_name = "step/minimize/" + std::to_string(molecule_num);
+        const std::string calc_name = "step/calc/" + std::to_string(molecule_num);
+        if (!selected(options, minimize_name) && !selected(options, calc_name)) continue;
+        const Config config = system_config(options, molecule_num);
+        ParticleStore store(config.simulator.water_num, config.simulator.soap_num, config.topology(), {water::WEIGHT, config.soap.head_weight, config.soap.tail_weight});
+        init_store(config, store);
+        StepCalculator step_calculator(pool, config);
+        const double particle_num = store.size();
+
+        // minimize first in any case, so that calc starts from separated particles; it is a one-off from the random
+        // initial state, so it is timed once rather than in batches
+        const auto start = std::chrono::steady_clock::now();
+        const MinimizeResult result = step_calculator.minimize(store, config.simulator.relax_step_num);
+        const double minimize_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (selected(options, minimize_name)) {
+            report(minimize_name, {{"particles", particle_num}, {"seconds", minimize_seconds}, {"iterations", static_cast<double>(result.iteration_num)},
+                {"ns_per_particle_iteration", minimize_seconds/particle_num/std::max(1, result.iteration_num)*1e9}, {"max_force", result.max_force}});
+        }
+        if (selected(options, calc_name)) {
+            const double seconds = time_per_call([&] { step_calculator.calc(store); }, options.min_time);
+            const double tau_per_day = 86400.0/seconds*config.step_dt();
+            std::vector<std::pair<std::string, double>> metrics = {
+                {"particles", particle_num}, {"steps_per_s", 1.0/seconds}, {"ns_per_particle_step", seconds/particle_num*1e9}, {"tau_per_day", tau_per_day}
+            };
+            if (options.tau_ps > 0.0) metrics.push_back({"ns_per_day", tau_per_day*options.tau_ps/1000.0});
+            report(calc_name, metrics);
+        }
+    }
+}
+
+void bench_trajectory(const Options& options) {
+    const Config config = system_config(options, 50000);
+    ParticleStore store(config.simulator.water_num, config.simulator.soap_num, config.topology(), {water::WEIGHT, config.soap.head_weight, config.soap.tail_weight});
+    init_store(config, store);
+    const char* encoding_names[] = {"float64", "float32", "int16"};
+    const std::string path = "smd_bench.traj";
+    for (const auto encoding : {FLOAT64, FLOAT32, INT16}) {
+        const std::string name = std::string("trajectory/") + encoding_names[encoding];
+        if (!selected(options, name)) continue;
+        double frame_bytes;
+        long step = 0;
+        // the writer is created and closed inside each call, so a time includes draining its queue to disk
+        const double seconds = time_per_call([&] {
+            TrajectoryWriter writer(path, store.get_water_num(), store.get_soap_num(), store.get_topology().bead_num(), encoding, trajectory::QUANTUM, trajectory::QUEUE_CAPACITY);
+            for (int frame_idx = 0; frame_idx < 16; ++frame_idx) {
+                writer.write(store, step++);
+            }
+        }, options.min_time)/16.0;
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        frame_bytes = (static_cast<double>(file.tellg()) - TrajectoryWriter::HEADER_SIZE)/16.0;
+        report(name, {{"particles", static_cast<double>(store.size())}, {"us_per_frame", seconds*1e6}, {"mb_per_s", frame_bytes/seconds/1e6}});
+    }
+    std::remove(path.c_str());
+}
+
+void write_json(const Options& options, const ThreadPool& pool) {
+    std::ofstream out(options.json_path);
+    if (!out) {
+        std::cerr << "cannot create: " << options.json_path << std::endl;
+        std::exit(1);
+    }
+    out.precision(6);
+    out << "{\n";
+    out << "  \"schema\": 1,\n";
+    out << "  \"revision\": \"" << SMD_GIT_REVISION << "\",\n";
+    out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+    out << "  \"simd\": \"" << simd_level_name(detect_simd_level()) << "\",\n";
+    out << "  \"precision\": \"" << (sizeof(real) == sizeof(float) ? "mixed" : "double") << "\",\n";
+    out << "  \"threads\": " << pool.get_thread_num() << ",\n";
+    out << "  \"sequence\": \"" << options.sequence << "\",\n";
+    out << "  \"results\": [";
+    for (std::size_t result_idx = 0; result_idx < results.size(); ++result_idx) {
+        out << (result_idx == 0 ? "\n" : ",\n") << "    {\"name\": \"" << results[result_idx].name << "\"";
+        for (const auto& metric : results[result_idx].metrics) {
+            out << ", \"" << metric.first << "\": " << metric.second;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void usage(const char* program) {
+    std::cerr << "usage: " << program << " [--json FILE] [--sizes N1,N2,...] [--threads N] [--min-time SECONDS] [--tau-ps PS] [--sequence HT...] [--filter TEXT]\n"
+              << "  sizes count molecules (waters + soaps) at the default density\n"
+              << "  --sequence: soap.SEQUENCE of the systems, for the cost of longer chains\n"
+              << "  --tau-ps: picoseconds per reduced time unit; adds ns_per_day next to tau_per_day" << std::endl;
+    std::exit(1);
+}
+
+Options parse_options(int argc, char** argv) {
+    Options options;
+    for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+        const std::string arg = argv[arg_idx];
+        if (arg_idx + 1 >= argc) usage(argv[0]);
+        const std::string value = argv[++arg_idx];
+        if (arg == "--json") {
+            options.json_path = value;
+        } else if (arg == "--sizes") {
+            options.sizes.clear();
+            std::istringstream list(value);
+            std::string size;
+            while (std::getline(list, size, ',')) options.sizes.push_back(std::atoi(size.c_str()));
+        } else if (arg == "--threads") {
+            options.thread_num = std::atoi(value.c_str());
+        } else if (arg == "--min-time") {
+            options.min_time = std::atof(value.c_str());
+        } else if (arg == "--tau-ps") {
+            options.tau_ps = std::atof(value.c_str());
+        } else if (arg == "--sequence") {
+            if (!Topology::is_valid(value)) usage(argv[0]);
+            options.sequence = value;
+        } else if (arg == "--filter") {
+            options.filter = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    return options;
+}
+}
+
+int main(int argc, char** argv) {
+    const Options options = parse_options(argc, argv);
+    smd::ThreadPool pool(options.thread_num);
+    std::cout << "revision: " << SMD_GIT_REVISION << " simd: " << smd::simd_level_name(smd::detect_simd_level())
+              << " precision: " << (sizeof(smd::real) == sizeof(float) ? "mixed" : "double")
+              << " threads: " << pool.get_thread_num() << std::endl;
+    bench_potentials(options);
+    bench_pair_kernels(options, pool);
+    bench_steps(options, pool);
+    bench_trajectory(options);
+    if (!options.json_path.empty()) write_json(options, pool);
+}
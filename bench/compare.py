@@ -0,0 +1,49 @@
+"""Compare two smd_bench JSON files: python bench/compare.py base.json new.json [--threshold 0.1]
+
+Prints every shared metric as new/base and exits with 1 if any got worse by more than the threshold.
+"""
+import json
+import sys
+
+# metrics where a smaller value is better; the others (rates) are better when larger
+LOWER_IS_BETTER = ("ns_per_pair", "ns_per_particle_step", "us_per_frame", "seconds", "iterations", "ns_per_particle_iteration")
+# sizes and residuals rather than timings
+IGNORED = ("particles", "pairs", "max_force")
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data, {r["name"]: r for r in data["results"]}
+
+
+def main():
+    args = [a for a in sys.argv[1:] if not a.startswith("--")]
+    threshold = 0.1
+    if "--threshold" in sys.argv:
+        threshold = float(sys.argv[sys.argv.index("--threshold") + 1])
+        args.remove(sys.argv[sys.argv.index("--threshold") + 1])
+    if len(args) != 2:
+        print(__doc__)
+        sys.exit(2)
+    base_data, base = load(args[0])
+    new_data, new = load(args[1])
+    print(f"base: {base_data['revision']} ({base_data['simd']}, {base_data.get('precision', 'double')}, {base_data['threads']} threads)")
+    print(f"new:  {new_data['revision']} ({new_data['simd']}, {new_data.get('precision', 'double')}, {new_data['threads']} threads)")
+
+    regressions = 0
+    for name, result in new.items():
+        if name not in base:
+            continue
+        for metric, value in result.items():
+            if metric == "name" or metric in IGNORED or metric not in base[name]:
+                continue
+            ratio = value / base[name][metric]
+            worse = ratio > 1 + threshold if metric in LOWER_IS_BETTER else ratio < 1 / (1 + threshold)
+            regressions += worse
+            print(f"{'REGRESSION' if worse else '':10s} {name:28s} {metric:22s} {base[name][metric]:12.4g} -> {value:12.4g}  x{ratio:.3f}")
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,46 @@
+# ctest check of the domain decomposition (impl/domain.hpp): runs simple_md once as the reference and once with
+# --ranks RANKS, in their own directories under WORK_DIR, and requires byte-identical trajectories.
+#   cmake -DSIMPLE_MD=<path> -DRANKS=<n> -DWORK_DIR=<dir> [-DREFERENCE=single|ranks1] [-DLAUNCHER=<cmd;args>]
+#         [-DSETTINGS=<KEY=VALUE;...>] -P domain_check.cmake
+# REFERENCE single (default) is the plain single-process run; ranks1 is --ranks 1, for builds whose single-process
+# engine stores positions in another precision than the domain code. LAUNCHER prefixes the --ranks run (mpirun -n N
+# for SMD_MPI builds). The settings should keep the system sparse: denser ones diverge in the last bits through the
+# order of the force sums.
+foreach(var SIMPLE_MD RANKS WORK_DIR)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "domain_check: ${var} is not set")
+    endif()
+endforeach()
+if(NOT DEFINED REFERENCE)
+    set(REFERENCE single)
+endif()
+
+function(run_simple_md dir)
+    file(REMOVE_RECURSE ${dir})
+    file(MAKE_DIRECTORY ${dir})
+    execute_process(COMMAND ${ARGN}
+        WORKING_DIRECTORY ${dir}
+        RESULT_VARIABLE result
+        OUTPUT_FILE ${dir}/log
+        ERROR_FILE ${dir}/log)
+    if(NOT result EQUAL 0)
+        file(READ ${dir}/log log)
+        message(FATAL_ERROR "domain_check: ${ARGN} failed (${result}):\n${log}")
+    endif()
+endfunction()
+
+if(REFERENCE STREQUAL "single")
+    run_simple_md(${WORK_DIR}/reference ${SIMPLE_MD} ${SETTINGS})
+elseif(REFERENCE STREQUAL "ranks1")
+    run_simple_md(${WORK_DIR}/reference ${SIMPLE_MD} ${SETTINGS} --ranks 1)
+else()
+    message(FATAL_ERROR "domain_check: unknown REFERENCE ${REFERENCE}")
+endif()
+run_simple_md(${WORK_DIR}/ranks ${LAUNCHER} ${SIMPLE_MD} ${SETTINGS} --ranks ${RANKS})
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/reference/exe.traj ${WORK_DIR}/ranks/exe.traj
+    RESULT_VARIABLE differ)
+if(NOT differ EQUAL 0)
+    message(FATAL_ERROR "domain_check: --ranks ${RANKS} and the ${REFERENCE} run wrote different trajectories")
+endif()
+message(STATUS "domain_check: --ranks ${RANKS} matches the ${REFERENCE} run")
@@ -0,0 +1,202 @@
+// Equilibrium observables of a soap and water system over several seeds, for validating a build variant or a model
+// variant against another. CMake builds it twice, smd_observables (double) and smd_observables_mixed
+// (SMD_MIXED_PRECISION); two JSON files, e.g. of step_calculator.SOLVENT=0 and 1, are compared by
+// bench/precision_report.py. Each seed starts like Simulator (lattice, minimize) and then samples every --interval
+// steps after an equilibration phase; time_to_micelle, the simulated time until the first micelle (MicelleAnalyzer),
+// is checked every --interval steps from the start, and is the whole run if none forms. Config keys can be overridden
+// as in simple_md.
+#include "../impl/config.hpp"
+#include "../impl/interaction_table.hpp"
+#include "../impl/lattice.hpp"
+#include "../impl/micelle.hpp"
+#include "../impl/particle_store.hpp"
+#include "../impl/step_calculator.hpp"
+#include "../impl/thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+using namespace smd;
+
+struct Options {
+    int seed_num = 8;
+    int equilibration_step_num = 2000;
+    int sample_step_num = 10000;
+    int sample_interval = 100;
+    std::string json_path;
+    Config config;
+};
+
+const std::vector<std::string> OBSERVABLE_NAMES = {"bond_mean", "bond_sd", "kinetic_kbt", "pair_energy", "tail_contacts", "water_msd",
+                                                   "micelles", "free_fraction", "mean_aggregation", "time_to_micelle"};
+
+// one value per observable, averaged over the samples of a run
+std::vector<double> run_seed(const Options& options, const std::uint32_t seed, ThreadPool& pool) {
+    Config config = options.config;
+    config.simulator.seed = seed;
+    ParticleStore store(config.water_bead_num(), config.simulator.soap_num, config.topology(), {water::WEIGHT, config.soap.head_weight, config.soap.tail_weight});
+    std::mt19937 engine(config.simulator.seed);
+    init_configuration(config, store, engine);
+    StepCalculator step_calculator(pool, config);
+    const InteractionTable table(interaction_table::DR, config);
+    step_calculator.minimize(store, config.simulator.relax_step_num);
+    MicelleAnalyzer micelle_analyzer(config.simulator.micelle_cutoff, config.simulator.micelle_min_size);
+    const int total_step_num = options.equilibration_step_num + options.sample_step_num;
+    int first_micelle_step = total_step_num;
+    const auto find_first_micelle = [&](const int step) {
+        if (first_micelle_step == total_step_num && micelle_analyzer.analyze(store, step_calculator.neighbors(store)).micelle_num > 0) {
+            first_micelle_step = step;
+        }
+    };
+    for (int step_idx = 1; step_idx <= options.equilibration_step_num; ++step_idx) {
+        step_calculator.calc(store);
+        if (step_idx % options.sample_interval == 0) find_first_micelle(step_idx);
+    }
+
+    std::vector<std::array<double,3>> water_start;
+    for (int water_idx = 0; water_idx < store.get_water_num(); ++water_idx) {
+        water_start.push_back(store.coord(store.water_index(water_idx)));
+    }
+    const double r_max = table.get_r_max();
+    const double contact_r = 1.5*config.step_calculator.tail_tail_sigma;
+    std::vector<double> sums(OBSERVABLE_NAMES.size(), 0.0);
+    int sample_num = 0;
+    for (int step_idx = 1; step_idx <= options.sample_step_num; ++step_idx) {
+        step_calculator.calc(store);
+        if (step_idx % options.sample_interval != 0) continue;
+        find_first_micelle(options.equilibration_step_num + step_idx);
+        const MicelleStats& micelles = micelle_analyzer.analyze(store, step_calculator.neighbors(store));
+        double bond = 0.0;
+        double bond2 = 0.0;
+        int tail_contact_num = 0;
+        for (std::size_t bond_idx = 0; bond_idx < store.bond_a.size(); ++bond_idx) {
+            const double r = norm(store.coord(store.bond_a[bond_idx]) - store.coord(store.bond_b[bond_idx]));
+            bond += r;
+            bond2 += r*r;
+        }
+        // Brownian runs have no velocities; their kinetic temperature stays 0
+        double kinetic = 0.0;
+        if (!store.vx.empty()) {
+            for (int idx = 0; idx < store.size(); ++idx) {
+                const auto v = store.velo(idx);
+                kinetic += store.weight(idx)*(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+            }
+        }
+        // all pairs, so that the sum does not depend on the neighbor list of either build
+        double energy = 0.0;
+        for (int idx = 0; idx < store.size(); ++idx) {
+            const auto c = store.coord(idx);
+            for (int other_idx = idx + 1; other_idx < store.size(); ++other_idx) {
+                if (std::find(store.exclusions_begin(idx), store.exclusions_end(idx), other_idx) != store.exclusions_end(idx)) continue;
+                const double r = norm(c - store.coord(other_idx));
+                if (r >= r_max) continue;
+                energy += table.energy(table.pair_index(store.species[idx], store.species[other_idx]), r);
+                tail_contact_num += store.species[idx] == TAIL && store.species[other_idx] == TAIL && r < contact_r;
+            }
+        }
+        double msd = 0.0;
+        for (int water_idx = 0; water_idx < store.get_water_num(); ++water_idx) {
+            const auto d = store.coord(store.water_index(water_idx)) - water_start[water_idx];
+            msd += d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+        }
+        const int soap_num = std::max(1, store.get_soap_num());
+        const int bond_num = std::max<int>(1, store.bond_a.size());
+        const double bond_mean = bond/bond_num;
+        sums[0] += bond_mean;
+        sums[1] += std::sqrt(std::max(0.0, bond2/bond_num - bond_mean*bond_mean));
+        sums[2] += kinetic/(3.0*store.size());
+        sums[3] += energy/store.size();
+        sums[4] += 2.0*tail_contact_num/soap_num;
+        sums[5] += msd/std::max(1, store.get_water_num());
+        sums[6] += micelles.micelle_num;
+        sums[7] += micelles.free_fraction;
+        sums[8] += micelles.mean_aggregation;
+        ++sample_num;
+    }
+    for (auto& sum : sums) sum /= std::max(1, sample_num);
+    sums[9] = first_micelle_step*config.step_dt();
+    return sums;
+}
+
+void usage(const char* program) {
+    std::cerr << "usage: " << program << " [--json FILE] [--seeds N] [--equilibration STEPS] [--steps STEPS] [--interval STEPS] [KEY=VALUE ...]" << std::endl;
+    std::exit(1);
+}
+
+Options parse_options(int argc, char** argv) {
+    Options options;
+    // 16 times the default density: at the default one the molecules hardly meet, and the pair forces would go untested
+    options.config.simulator.sphere_size = 20.0;
+    for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+        const std::string arg = argv[arg_idx];
+        if (arg.rfind("--", 0) != 0) {
+            options.config.set_assignment(arg);
+            continue;
+        }
+        if (arg_idx + 1 >= argc) usage(argv[0]);
+        const std::string value = argv[++arg_idx];
+        if (arg == "--json") {
+            options.json_path = value;
+        } else if (arg == "--seeds") {
+            options.seed_num = std::atoi(value.c_str());
+        } else if (arg == "--equilibration") {
+            options.equilibration_step_num = std::atoi(value.c_str());
+        } else if (arg == "--steps") {
+            options.sample_step_num = std::atoi(value.c_str());
+        } else if (arg == "--interval") {
+            options.sample_interval = std::atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (options.seed_num < 1 || options.sample_interval < 1 || options.sample_step_num < options.sample_interval) usage(argv[0]);
+    options.config.validate();
+    return options;
+}
+
+void write_json(const Options& options, const std::vector<std::vector<double>>& values) {
+    std::ofstream out(options.json_path);
+    if (!out) {
+        std::cerr << "cannot create: " << options.json_path << std::endl;
+        std::exit(1);
+    }
+    out.precision(10);
+    out << "{\n";
+    out << "  \"precision\": \"" << (sizeof(real) == sizeof(float) ? "mixed" : "double") << "\",\n";
+    out << "  \"solvent\": \"" << (options.config.step_calculator.solvent == 1 ? "implicit" : "explicit") << "\",\n";
+    out << "  \"steps\": " << options.sample_step_num << ",\n";
+    out << "  \"seeds\": [";
+    for (std::size_t seed_idx = 0; seed_idx < values.size(); ++seed_idx) {
+        out << (seed_idx == 0 ? "\n" : ",\n") << "    {";
+        for (std::size_t name_idx = 0; name_idx < OBSERVABLE_NAMES.size(); ++name_idx) {
+            out << (name_idx == 0 ? "" : ", ") << "\"" << OBSERVABLE_NAMES[name_idx] << "\": " << values[seed_idx][name_idx];
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+}
+
+int main(int argc, char** argv) {
+    const Options options = parse_options(argc, argv);
+    smd::ThreadPool pool(options.config.simulator.thread_num);
+    std::cout << "precision: " << (sizeof(smd::real) == sizeof(float) ? "mixed" : "double") << " threads: " << pool.get_thread_num() << std::endl;
+    std::vector<std::vector<double>> values;
+    for (int seed_idx = 0; seed_idx < options.seed_num; ++seed_idx) {
+        const std::uint32_t seed = options.config.simulator.seed + seed_idx;
+        values.push_back(run_seed(options, seed, pool));
+        std::cout << "seed " << seed;
+        for (std::size_t name_idx = 0; name_idx < OBSERVABLE_NAMES.size(); ++name_idx) {
+            std::cout << "  " << OBSERVABLE_NAMES[name_idx] << "=" << values.back()[name_idx];
+        }
+        std::cout << std::endl;
+    }
+    if (!options.json_path.empty()) write_json(options, values);
+}
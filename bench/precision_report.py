@@ -0,0 +1,61 @@
+"""Compare two smd_observables JSON files: python bench/precision_report.py base.json new.json [--sigma 3] [--only a,b]
+
+Prints every observable (or those named by --only) as mean +- standard error over the seeds of each file, their
+difference in units of the combined standard error, and exits with 1 if any differs by more than --sigma of them.
+Used for double vs mixed-precision builds, and with --only for explicit vs implicit solvent, where only the soap
+observables are comparable.
+"""
+import json
+import math
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def mean_error(values):
+    mean = sum(values) / len(values)
+    if len(values) < 2:
+        return mean, 0.0
+    variance = sum((v - mean) ** 2 for v in values) / (len(values) - 1)
+    return mean, math.sqrt(variance / len(values))
+
+
+def main():
+    args = [a for a in sys.argv[1:] if not a.startswith("--")]
+    sigma = 3.0
+    if "--sigma" in sys.argv:
+        sigma = float(sys.argv[sys.argv.index("--sigma") + 1])
+        args.remove(sys.argv[sys.argv.index("--sigma") + 1])
+    only = None
+    if "--only" in sys.argv:
+        only = sys.argv[sys.argv.index("--only") + 1].split(",")
+        args.remove(sys.argv[sys.argv.index("--only") + 1])
+    if len(args) != 2:
+        print(__doc__)
+        sys.exit(2)
+    base = load(args[0])
+    new = load(args[1])
+    for label, data in (("base", base), ("new", new)):
+        solvent = data.get("solvent", "explicit")
+        print(f"{label + ':':5s} {data['precision']}, {solvent} solvent ({len(data['seeds'])} seeds, {data['steps']} steps)")
+
+    deviations = 0
+    for name in base["seeds"][0]:
+        if name not in new["seeds"][0] or (only is not None and name not in only):
+            continue
+        base_mean, base_error = mean_error([seed[name] for seed in base["seeds"]])
+        new_mean, new_error = mean_error([seed[name] for seed in new["seeds"]])
+        error = math.hypot(base_error, new_error)
+        z = (new_mean - base_mean) / error if error > 0 else 0.0
+        deviates = abs(z) > sigma
+        deviations += deviates
+        print(f"{'DEVIATION' if deviates else '':10s} {name:14s} {base_mean:12.5g} +- {base_error:<10.2g} "
+              f"{new_mean:12.5g} +- {new_error:<10.2g} z={z:+.2f}")
+    sys.exit(1 if deviations else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,26 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+
+#include <algorithm>
+#include <vector>
+
+namespace smd {
+// Refills a persistent buffer; capacity is kept between calls, so only growth allocates, and growth at least doubles
+// it, so a size creeping up (a pair count reaching a new high) settles after a few allocations.
+template <typename T>
+void fit_buffer(std::vector<T>& buffer, const std::size_t size, const T& value, long& allocation_num) {
+    if (size > buffer.capacity()) {
+        ++allocation_num;
+        buffer.reserve(std::max(size, 2*buffer.capacity()));
+    }
+    buffer.assign(size, value);
+}
+
+template <typename T>
+void push_buffer(std::vector<T>& buffer, const T& value, long& allocation_num) {
+    if (buffer.size() == buffer.capacity()) ++allocation_num;
+    buffer.push_back(value);
+}
+} // smd
+
+#endif
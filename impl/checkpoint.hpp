@@ -0,0 +1,55 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace smd {
+// Raw field I/O for checkpoints, in host byte order: a checkpoint is only read back on the machine type that wrote it.
+// A short read means a truncated or foreign file, which is fatal.
+template <typename T>
+void write_field(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+void read_field(std::istream& in, T& value) {
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) {
+        std::cerr << "checkpoint: unexpected end of file" << std::endl;
+        std::exit(1);
+    }
+}
+
+// u64 element count, then the elements
+template <typename T>
+void write_vector(std::ostream& out, const std::vector<T>& values) {
+    write_field(out, static_cast<std::uint64_t>(values.size()));
+    out.write(reinterpret_cast<const char*>(values.data()), values.size()*sizeof(T));
+}
+
+template <typename T>
+void read_vector(std::istream& in, std::vector<T>& values) {
+    std::uint64_t size;
+    read_field(in, size);
+    values.resize(size);
+    if (!in.read(reinterpret_cast<char*>(values.data()), size*sizeof(T))) {
+        std::cerr << "checkpoint: unexpected end of file" << std::endl;
+        std::exit(1);
+    }
+}
+
+inline void write_string(std::ostream& out, const std::string& value) {
+    write_vector(out, std::vector<char>(value.begin(), value.end()));
+}
+
+inline void read_string(std::istream& in, std::string& value) {
+    std::vector<char> chars;
+    read_vector(in, chars);
+    value.assign(chars.begin(), chars.end());
+}
+} // smd
+
+#endif
@@ -0,0 +1,436 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include "./topology.hpp"
+#include "constants.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace smd {
+// Runtime copies of the simulator, step_calculator, soap and particle constants; constants.hpp holds the defaults.
+struct SimulatorConfig {
+    double sphere_size = simulator::SPHERE_SIZE;
+    int relax_step_num = simulator::RELAX_STEP_NUM;
+    int water_num = simulator::WATER_NUM;
+    int soap_num = simulator::SOAP_NUM;
+    std::uint32_t seed = simulator::SEED;
+    int loop_num = simulator::LOOP_NUM;
+    int save_step_num = simulator::SAVE_STEP_NUM;
+    std::string out_path = simulator::OUT_PATH;
+    bool ascii_log = simulator::ASCII_LOG;
+    std::string trajectory_path = simulator::TRAJECTORY_PATH;
+    int thread_num = simulator::THREAD_NUM;
+    std::string checkpoint_path = simulator::CHECKPOINT_PATH;
+    int checkpoint_step_num = simulator::CHECKPOINT_STEP_NUM;
+    std::string telemetry_path = simulator::TELEMETRY_PATH;
+    int telemetry_step_num = simulator::TELEMETRY_STEP_NUM;
+    std::string micelle_path = simulator::MICELLE_PATH;
+    int micelle_step_num = simulator::MICELLE_STEP_NUM;
+    double micelle_cutoff = simulator::MICELLE_CUTOFF;
+    int micelle_min_size = simulator::MICELLE_MIN_SIZE;
+    int exchange_step_num = simulator::EXCHANGE_STEP_NUM;
+};
+
+struct StepCalculatorConfig {
+    double soft_repulsive_d = step_calculator::SOFT_REPULSIVE_D;
+    double fire_dt = step_calculator::FIRE_DT;
+    double fire_dt_max = step_calculator::FIRE_DT_MAX;
+    double fire_max_move = step_calculator::FIRE_MAX_MOVE;
+    double minimize_ftol = step_calculator::MINIMIZE_FTOL;
+    double minimize_etol = step_calculator::MINIMIZE_ETOL;
+    double gamma = step_calculator::GAMMA;
+    double kbt = step_calculator::KBT;
+    double bath_kbt = step_calculator::BATH_KBT;
+    double dt = step_calculator::DT;
+    int integrator = step_calculator::INTEGRATOR;
+    double brownian_max_move = step_calculator::BROWNIAN_MAX_MOVE;
+    int respa_step_num = step_calculator::RESPA_STEP_NUM;
+    double excluded_d = step_calculator::EXCLUDED_D;
+
+    double water_epsilon = step_calculator::WATER_EPSILON;
+    double water_sigma = step_calculator::WATER_SIGMA;
+    double water_head_epsilon = step_calculator::WATER_HEAD_EPSILON;
+    double water_head_sigma = step_calculator::WATER_HEAD_SIGMA;
+    double head_head_epsilon = step_calculator::HEAD_HEAD_EPSILON;
+    double head_head_sigma = step_calculator::HEAD_HEAD_SIGMA;
+    double tail_tail_epsilon = step_calculator::TAIL_TAIL_EPSILON;
+    double tail_tail_sigma = step_calculator::TAIL_TAIL_SIGMA;
+    double head_tail_coef = step_calculator::HEAD_TAIL_COEF;
+    double water_tail_coef = step_calculator::WATER_TAIL_COEF;
+    int solvent = step_calculator::SOLVENT;
+    double implicit_head_head_epsilon = step_calculator::IMPLICIT_HEAD_HEAD_EPSILON;
+    double implicit_head_head_coef = step_calculator::IMPLICIT_HEAD_HEAD_COEF;
+    double implicit_tail_tail_epsilon = step_calculator::IMPLICIT_TAIL_TAIL_EPSILON;
+    double implicit_gamma = step_calculator::IMPLICIT_GAMMA;
+    double implicit_bath_kbt = step_calculator::IMPLICIT_BATH_KBT;
+
+    double sphere_coef = step_calculator::SPHERE_COEF;
+    double neighbor_skin = step_calculator::NEIGHBOR_SKIN;
+    int reorder_step_num = step_calculator::REORDER_STEP_NUM;
+    bool simd_kernel = step_calculator::SIMD_KERNEL;
+};
+
+struct SoapConfig {
+    double spring_k = soap::SPRING_K;
+    double spring_r0 = soap::SPRING_R0;
+    std::string sequence = soap::SEQUENCE;
+    double angle_k = soap::ANGLE_K;
+    double angle_theta0 = soap::ANGLE_THETA0;
+    double head_weight = soap::HEAD_WEIGHT;
+    double tail_weight = soap::TAIL_WEIGHT;
+};
+
+struct ParticleConfig {
+    double soft_repulsive_a = particle::SOFT_REPULSIVE_A;
+    double repulsive_d = particle::REPULSIVE_D;
+    double fmax = particle::FMAX;
+    double lj_cutoff = particle::LJ_CUTOFF;
+};
+
+// Keys are "<namespace>.<CONSTANT>", e.g. step_calculator.KBT.
+// A config file holds one "key = value" per line; '#' starts a comment. write() emits the same format.
+struct Config {
+    SimulatorConfig simulator;
+    StepCalculatorConfig step_calculator;
+    SoapConfig soap;
+    ParticleConfig particle;
+
+    // false for an unknown key; a malformed value is fatal
+    bool set(const std::string& key, const std::string& value);
+    // "key=value"
+    void set_assignment(const std::string& assignment);
+    void load(const std::string& path);
+    void write(std::ostream& out) const;
+    void validate() const;
+
+    // derived values
+    double water_std() const;
+    double soap_head_std() const;
+    double soap_tail_std() const;
+    double neighbor_cutoff() const;
+    // Langevin friction: GAMMA, or IMPLICIT_GAMMA with implicit solvent
+    double friction() const;
+    // Water beads in the store: WATER_NUM, or none with implicit solvent
+    int water_bead_num() const;
+    // the soap molecule of soap.SEQUENCE
+    Topology topology() const;
+    // temperature the Langevin noise holds the beads at, averaged over them. The noise of a bead of mass m has the
+    // standard deviation s of water_std() etc., which balances the friction g = friction() at s^2*m*DT/(2*g): BATH_KBT
+    // when it is set (IMPLICIT_BATH_KBT with implicit solvent), else 2*g*KBT^2*DT^3/m rather than KBT.
+    double bath_kbt() const;
+    // simulated time per StepCalculator::calc
+    double step_dt() const;
+private:
+    template <typename C, typename Visit>
+    static void for_each_field(C& config, const Visit& visit);
+    // noise standard deviation of a bead of mass weight
+    double noise_std(const double weight) const;
+    // BATH_KBT, else IMPLICIT_BATH_KBT with implicit solvent; 0: the legacy noise amplitude from KBT
+    double fixed_bath_kbt() const;
+    static bool parse(const std::string& text, double& value);
+    static bool parse(const std::string& text, int& value);
+    static bool parse(const std::string& text, std::uint32_t& value);
+    static bool parse(const std::string& text, bool& value);
+    static bool parse(const std::string& text, std::string& value);
+    template <typename T>
+    static std::string format(const T& value);
+    static std::string format(const double value);
+    static std::string trim(const std::string& text);
+};
+
+template <typename C, typename Visit>
+void Config::for_each_field(C& config, const Visit& visit) {
+    visit("simulator.SPHERE_SIZE", config.simulator.sphere_size);
+    visit("simulator.RELAX_STEP_NUM", config.simulator.relax_step_num);
+    visit("simulator.WATER_NUM", config.simulator.water_num);
+    visit("simulator.SOAP_NUM", config.simulator.soap_num);
+    visit("simulator.SEED", config.simulator.seed);
+    visit("simulator.LOOP_NUM", config.simulator.loop_num);
+    visit("simulator.SAVE_STEP_NUM", config.simulator.save_step_num);
+    visit("simulator.OUT_PATH", config.simulator.out_path);
+    visit("simulator.ASCII_LOG", config.simulator.ascii_log);
+    visit("simulator.TRAJECTORY_PATH", config.simulator.trajectory_path);
+    visit("simulator.THREAD_NUM", config.simulator.thread_num);
+    visit("simulator.CHECKPOINT_PATH", config.simulator.checkpoint_path);
+    visit("simulator.CHECKPOINT_STEP_NUM", config.simulator.checkpoint_step_num);
+    visit("simulator.TELEMETRY_PATH", config.simulator.telemetry_path);
+    visit("simulator.TELEMETRY_STEP_NUM", config.simulator.telemetry_step_num);
+    visit("simulator.MICELLE_PATH", config.simulator.micelle_path);
+    visit("simulator.MICELLE_STEP_NUM", config.simulator.micelle_step_num);
+    visit("simulator.MICELLE_CUTOFF", config.simulator.micelle_cutoff);
+    visit("simulator.MICELLE_MIN_SIZE", config.simulator.micelle_min_size);
+    visit("simulator.EXCHANGE_STEP_NUM", config.simulator.exchange_step_num);
+
+    visit("step_calculator.SOFT_REPULSIVE_D", config.step_calculator.soft_repulsive_d);
+    visit("step_calculator.FIRE_DT", config.step_calculator.fire_dt);
+    visit("step_calculator.FIRE_DT_MAX", config.step_calculator.fire_dt_max);
+    visit("step_calculator.FIRE_MAX_MOVE", config.step_calculator.fire_max_move);
+    visit("step_calculator.MINIMIZE_FTOL", config.step_calculator.minimize_ftol);
+    visit("step_calculator.MINIMIZE_ETOL", config.step_calculator.minimize_etol);
+    visit("step_calculator.GAMMA", config.step_calculator.gamma);
+    visit("step_calculator.KBT", config.step_calculator.kbt);
+    visit("step_calculator.BATH_KBT", config.step_calculator.bath_kbt);
+    visit("step_calculator.DT", config.step_calculator.dt);
+    visit("step_calculator.INTEGRATOR", config.step_calculator.integrator);
+    visit("step_calculator.BROWNIAN_MAX_MOVE", config.step_calculator.brownian_max_move);
+    visit("step_calculator.RESPA_STEP_NUM", config.step_calculator.respa_step_num);
+    visit("step_calculator.EXCLUDED_D", config.step_calculator.excluded_d);
+    visit("step_calculator.WATER_EPSILON", config.step_calculator.water_epsilon);
+    visit("step_calculator.WATER_SIGMA", config.step_calculator.water_sigma);
+    visit("step_calculator.WATER_HEAD_EPSILON", config.step_calculator.water_head_epsilon);
+    visit("step_calculator.WATER_HEAD_SIGMA", config.step_calculator.water_head_sigma);
+    visit("step_calculator.HEAD_HEAD_EPSILON", config.step_calculator.head_head_epsilon);
+    visit("step_calculator.HEAD_HEAD_SIGMA", config.step_calculator.head_head_sigma);
+    visit("step_calculator.TAIL_TAIL_EPSILON", config.step_calculator.tail_tail_epsilon);
+    visit("step_calculator.TAIL_TAIL_SIGMA", config.step_calculator.tail_tail_sigma);
+    visit("step_calculator.HEAD_TAIL_COEF", config.step_calculator.head_tail_coef);
+    visit("step_calculator.WATER_TAIL_COEF", config.step_calculator.water_tail_coef);
+    visit("step_calculator.SOLVENT", config.step_calculator.solvent);
+    visit("step_calculator.IMPLICIT_HEAD_HEAD_EPSILON", config.step_calculator.implicit_head_head_epsilon);
+    visit("step_calculator.IMPLICIT_HEAD_HEAD_COEF", config.step_calculator.implicit_head_head_coef);
+    visit("step_calculator.IMPLICIT_TAIL_TAIL_EPSILON", config.step_calculator.implicit_tail_tail_epsilon);
+    visit("step_calculator.IMPLICIT_GAMMA", config.step_calculator.implicit_gamma);
+    visit("step_calculator.IMPLICIT_BATH_KBT", config.step_calculator.implicit_bath_kbt);
+    visit("step_calculator.SPHERE_COEF", config.step_calculator.sphere_coef);
+    visit("step_calculator.NEIGHBOR_SKIN", config.step_calculator.neighbor_skin);
+    visit("step_calculator.REORDER_STEP_NUM", config.step_calculator.reorder_step_num);
+    visit("step_calculator.SIMD_KERNEL", config.step_calculator.simd_kernel);
+
+    visit("soap.SPRING_K", config.soap.spring_k);
+    visit("soap.SPRING_R0", config.soap.spring_r0);
+    visit("soap.SEQUENCE", config.soap.sequence);
+    visit("soap.ANGLE_K", config.soap.angle_k);
+    visit("soap.ANGLE_THETA0", config.soap.angle_theta0);
+    visit("soap.HEAD_WEIGHT", config.soap.head_weight);
+    visit("soap.TAIL_WEIGHT", config.soap.tail_weight);
+
+    visit("particle.SOFT_REPULSIVE_A", config.particle.soft_repulsive_a);
+    visit("particle.REPULSIVE_D", config.particle.repulsive_d);
+    visit("particle.FMAX", config.particle.fmax);
+    visit("particle.LJ_CUTOFF", config.particle.lj_cutoff);
+}
+
+bool Config::set(const std::string& key, const std::string& value) {
+    bool found = false;
+    for_each_field(*this, [&](const char* name, auto& field) {
+        if (found || key != name) return;
+        found = true;
+        if (!parse(value, field)) {
+            std::cerr << "invalid value for " << key << ": " << value << std::endl;
+            std::exit(1);
+        }
+    });
+    return found;
+}
+
+void Config::set_assignment(const std::string& assignment) {
+    const auto eq = assignment.find('=');
+    if (eq == std::string::npos || !set(trim(assignment.substr(0, eq)), trim(assignment.substr(eq+1)))) {
+        std::cerr << "unknown setting: " << assignment << std::endl;
+        std::exit(1);
+    }
+}
+
+void Config::load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "cannot open: " << path << std::endl;
+        std::exit(1);
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        line = trim(line.substr(0, line.find('#')));
+        if (!line.empty()) set_assignment(line);
+    }
+}
+
+void Config::write(std::ostream& out) const {
+    for_each_field(*this, [&](const char* name, const auto& field) {
+        out << name << " = " << format(field) << "\n";
+    });
+}
+
+void Config::validate() const {
+    // one key at a time, so the message names the setting to fix
+    const auto require = [](const bool valid, const char* key, const auto& value) {
+        if (valid) return;
+        std::cerr << "invalid value for " << key << ": " << format(value) << std::endl;
+        std::exit(1);
+    };
+    require(simulator.sphere_size > 0.0, "simulator.SPHERE_SIZE", simulator.sphere_size);
+    require(simulator.relax_step_num >= 0, "simulator.RELAX_STEP_NUM", simulator.relax_step_num);
+    require(simulator.water_num >= 0, "simulator.WATER_NUM", simulator.water_num);
+    require(simulator.soap_num >= 0, "simulator.SOAP_NUM", simulator.soap_num);
+    require(simulator.loop_num >= 0, "simulator.LOOP_NUM", simulator.loop_num);
+    require(simulator.save_step_num > 0, "simulator.SAVE_STEP_NUM", simulator.save_step_num);
+    require(simulator.thread_num >= 0, "simulator.THREAD_NUM", simulator.thread_num);
+    require(simulator.checkpoint_step_num >= 0, "simulator.CHECKPOINT_STEP_NUM", simulator.checkpoint_step_num);
+    require(simulator.telemetry_step_num >= 0, "simulator.TELEMETRY_STEP_NUM", simulator.telemetry_step_num);
+    require(simulator.micelle_step_num >= 0, "simulator.MICELLE_STEP_NUM", simulator.micelle_step_num);
+    // clusters are found on the neighbor list, so the cutoff cannot reach past it
+    require(simulator.micelle_cutoff > 0.0 && simulator.micelle_cutoff <= neighbor_cutoff(), "simulator.MICELLE_CUTOFF", simulator.micelle_cutoff);
+    require(simulator.micelle_min_size >= 2, "simulator.MICELLE_MIN_SIZE", simulator.micelle_min_size);
+    require(simulator.exchange_step_num >= 1, "simulator.EXCHANGE_STEP_NUM", simulator.exchange_step_num);
+
+    require(step_calculator.fire_dt > 0.0, "step_calculator.FIRE_DT", step_calculator.fire_dt);
+    require(step_calculator.fire_dt_max >= step_calculator.fire_dt, "step_calculator.FIRE_DT_MAX", step_calculator.fire_dt_max);
+    require(step_calculator.fire_max_move > 0.0, "step_calculator.FIRE_MAX_MOVE", step_calculator.fire_max_move);
+    require(step_calculator.minimize_ftol >= 0.0, "step_calculator.MINIMIZE_FTOL", step_calculator.minimize_ftol);
+    require(step_calculator.minimize_etol >= 0.0, "step_calculator.MINIMIZE_ETOL", step_calculator.minimize_etol);
+    require(step_calculator.gamma >= 0.0, "step_calculator.GAMMA", step_calculator.gamma);
+    require(step_calculator.kbt >= 0.0, "step_calculator.KBT", step_calculator.kbt);
+    require(step_calculator.bath_kbt >= 0.0, "step_calculator.BATH_KBT", step_calculator.bath_kbt);
+    require(step_calculator.dt > 0.0, "step_calculator.DT", step_calculator.dt);
+    require(step_calculator.integrator == 0 || step_calculator.integrator == 1, "step_calculator.INTEGRATOR", step_calculator.integrator);
+    require(step_calculator.respa_step_num >= 1, "step_calculator.RESPA_STEP_NUM", step_calculator.respa_step_num);
+    require(step_calculator.solvent == 0 || step_calculator.solvent == 1, "step_calculator.SOLVENT", step_calculator.solvent);
+    require(step_calculator.implicit_gamma >= 0.0, "step_calculator.IMPLICIT_GAMMA", step_calculator.implicit_gamma);
+    require(step_calculator.implicit_bath_kbt >= 0.0, "step_calculator.IMPLICIT_BATH_KBT", step_calculator.implicit_bath_kbt);
+    if (step_calculator.integrator == 1) {
+        // Brownian dynamics takes no RESPA substeps and divides by the friction
+        require(step_calculator.respa_step_num == 1, "step_calculator.RESPA_STEP_NUM", step_calculator.respa_step_num);
+        require(friction() > 0.0, step_calculator.solvent == 1 ? "step_calculator.IMPLICIT_GAMMA" : "step_calculator.GAMMA", friction());
+        require(step_calculator.brownian_max_move > 0.0, "step_calculator.BROWNIAN_MAX_MOVE", step_calculator.brownian_max_move);
+    }
+    require(step_calculator.neighbor_skin > 0.0, "step_calculator.NEIGHBOR_SKIN", step_calculator.neighbor_skin);
+    require(step_calculator.reorder_step_num >= 0, "step_calculator.REORDER_STEP_NUM", step_calculator.reorder_step_num);
+
+    require(Topology::is_valid(soap.sequence), "soap.SEQUENCE", soap.sequence);
+    require(soap.angle_k >= 0.0, "soap.ANGLE_K", soap.angle_k);
+    require(soap.head_weight > 0.0, "soap.HEAD_WEIGHT", soap.head_weight);
+    require(soap.tail_weight > 0.0, "soap.TAIL_WEIGHT", soap.tail_weight);
+
+    require(particle.fmax > 0.0, "particle.FMAX", particle.fmax);
+    // the initial lattice keeps the soap centers half a soap length inside the sphere
+    const double soap_size = (topology().bead_num() - 1)*soap.spring_r0;
+    if (simulator.sphere_size - soap_size/2.0 <= 0.0) {
+        std::cerr << "invalid configuration: simulator.SPHERE_SIZE " << simulator.sphere_size
+                  << " leaves no room for the molecules; it has to exceed half the soap length " << soap_size/2.0 << std::endl;
+        std::exit(1);
+    }
+}
+
+double Config::water_std() const {
+    return noise_std(water::WEIGHT);
+}
+
+double Config::soap_head_std() const {
+    return noise_std(soap.head_weight);
+}
+
+double Config::soap_tail_std() const {
+    return noise_std(soap.tail_weight);
+}
+
+double Config::noise_std(const double weight) const {
+    const double gamma = friction();
+    const double kbt = fixed_bath_kbt();
+    if (kbt > 0.0) return std::sqrt(2.0*gamma*kbt/(weight*step_calculator.dt));
+    return ((2.0*gamma*step_calculator.kbt)/weight)*step_calculator.dt;
+}
+
+double Config::friction() const {
+    return step_calculator.solvent == 1 ? step_calculator.implicit_gamma : step_calculator.gamma;
+}
+
+double Config::step_dt() const {
+    return step_calculator.respa_step_num*step_calculator.dt;
+}
+
+double Config::neighbor_cutoff() const {
+    return std::max({
+        particle.repulsive_d, step_calculator.soft_repulsive_d, step_calculator.excluded_d,
+        particle.lj_cutoff*std::max({step_calculator.water_sigma, step_calculator.water_head_sigma, step_calculator.head_head_sigma, step_calculator.tail_tail_sigma})
+    });
+}
+
+int Config::water_bead_num() const {
+    return step_calculator.solvent == 1 ? 0 : simulator.water_num;
+}
+
+Topology Config::topology() const {
+    return Topology(soap.sequence);
+}
+
+double Config::fixed_bath_kbt() const {
+    if (step_calculator.bath_kbt > 0.0) return step_calculator.bath_kbt;
+    return step_calculator.solvent == 1 ? step_calculator.implicit_bath_kbt : 0.0;
+}
+
+double Config::bath_kbt() const {
+    if (fixed_bath_kbt() > 0.0) return fixed_bath_kbt();
+    const double dt = step_calculator.dt;
+    const double gamma = friction();
+    const auto bead_kbt = [&](const double std, const double weight) { return std*std*weight*dt/(2.0*gamma); };
+    const int water_num = water_bead_num();
+    const Topology molecule = topology();
+    const double kbt_sum = water_num*bead_kbt(water_std(), water::WEIGHT)
+        + simulator.soap_num*(molecule.count(HEAD)*bead_kbt(soap_head_std(), soap.head_weight) + molecule.count(TAIL)*bead_kbt(soap_tail_std(), soap.tail_weight));
+    return kbt_sum/std::max(1, water_num + molecule.bead_num()*simulator.soap_num);
+}
+
+bool Config::parse(const std::string& text, double& value) {
+    char* end;
+    value = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+}
+
+bool Config::parse(const std::string& text, int& value) {
+    char* end;
+    value = static_cast<int>(std::strtol(text.c_str(), &end, 10));
+    return !text.empty() && *end == '\0';
+}
+
+bool Config::parse(const std::string& text, std::uint32_t& value) {
+    char* end;
+    value = static_cast<std::uint32_t>(std::strtoul(text.c_str(), &end, 10));
+    return !text.empty() && *end == '\0';
+}
+
+bool Config::parse(const std::string& text, bool& value) {
+    if (text == "true" || text == "1") {
+        value = true;
+    } else if (text == "false" || text == "0") {
+        value = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool Config::parse(const std::string& text, std::string& value) {
+    value = text;
+    return true;
+}
+
+template <typename T>
+std::string Config::format(const T& value) {
+    std::ostringstream text;
+    text << value;
+    return text.str();
+}
+
+std::string Config::format(const double value) {
+    // shortest form that reads back to the same double, so a written config reproduces the run
+    for (int precision = 6; ; ++precision) {
+        std::ostringstream text;
+        text.precision(precision);
+        text << value;
+        if (std::strtod(text.str().c_str(), nullptr) == value || precision == 17) return text.str();
+    }
+}
+
+std::string Config::trim(const std::string& text) {
+    const auto first = text.find_first_not_of(" \t\r");
+    if (first == std::string::npos) return "";
+    return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+}
+} // smd
+
+#endif
@@ -1,16 +1,29 @@
 #ifndef CONSTANTS_HPP
 #define CONSTANTS_HPP
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 
 namespace smd {
     namespace step_calculator {
         const double SOFT_REPULSIVE_D = 3.0;
-        const double RELAX_COEF = 1.0;
-        const double RELAX_SPRING_COEF = 0.1;
+        // FIRE start-up minimizer: initial and largest time step, largest move per step, and the tolerances
+        // on the largest force and on the relative energy change
+        const double FIRE_DT = 0.5;
+        const double FIRE_DT_MAX = 2.0;
+        const double FIRE_MAX_MOVE = 1.0;
+        const double MINIMIZE_FTOL = 1e-3;
+        const double MINIMIZE_ETOL = 1e-10;
         const double GAMMA = 1.0;
         const double KBT = 3.0;
+        // > 0: the Langevin/Brownian noise holds the beads at this temperature, sqrt(2*GAMMA*BATH_KBT/(m*DT)), and KBT
+        // is unused; 0: the legacy amplitude 2*GAMMA*KBT*DT/m, whose bath temperature is Config::bath_kbt()
+        const double BATH_KBT = 0.0;
         const double DT = 0.1;
+        const int INTEGRATOR = 0; // 0: Langevin, 1: overdamped Brownian dynamics (one force evaluation, no velocities)
+        const double BROWNIAN_MAX_MOVE = 0.1; // cap on the force-driven move of a Brownian step
+        const int RESPA_STEP_NUM = 1; // inner steps of DT per step; >1 evaluates the non-bonded forces once per RESPA_STEP_NUM*DT
         const double EXCLUDED_D = 0.9;
 
         const double WATER_EPSILON = 2.0;
@@ -23,19 +36,47 @@ namespace smd {
         const double TAIL_TAIL_SIGMA = 0.9;
         const double HEAD_TAIL_COEF = 3.0;
         const double WATER_TAIL_COEF = 1.0;
+        const int SOLVENT = 0; // 0: explicit Water beads, 1: implicit solvent (no Water beads, WATER_NUM is ignored)
+        // implicit solvent: the head-head and tail-tail terms that stand in for the water-head attraction and the
+        // water-tail repulsion
+        const double IMPLICIT_HEAD_HEAD_EPSILON = 0.3;
+        const double IMPLICIT_HEAD_HEAD_COEF = 0.5;
+        const double IMPLICIT_TAIL_TAIL_EPSILON = 0.84;
+        // implicit solvent: friction and bath temperature (unless BATH_KBT is set) that stand in for the water
+        // collisions, fitted with the terms above to the micelle observables of explicit runs at the default DT
+        const double IMPLICIT_GAMMA = 3.0;
+        const double IMPLICIT_BATH_KBT = 0.065;
 
         const double SPHERE_COEF = 1.0;
+        const double NEIGHBOR_SKIN = 0.6;
+        const int REORDER_STEP_NUM = 1000; // 0: never; else every this many steps the particles are sorted along a Morton curve and the neighbor list rebuilt
+        const bool SIMD_KERNEL = true; // false: scalar pair path
     }
 
     namespace particle {
         const double SOFT_REPULSIVE_A = 0.5;
         const double REPULSIVE_D = 3.0;
         const double FMAX = 50.0;
+        const double LJ_CUTOFF = 2.5;
+    }
+
+    namespace interaction_table {
+        const double DR = 0.005; // segment width; cutoffs should be multiples of it
+    }
+
+    namespace trajectory {
+        const int ENCODING = 1; // 0: float64, 1: float32, 2: int16 quantized by QUANTUM
+        const double QUANTUM = 0.002; // int16 covers +-65.5
+        const int QUEUE_CAPACITY = 8;
     }
 
     namespace soap {
         const double SPRING_K = 1.5;
         const double SPRING_R0 = 2.0;
+        const std::string SEQUENCE = "HT"; // bead types from the head end, 'H' head and 'T' tail; bonds join neighboring beads
+        // angle term 0.5*ANGLE_K*(cos(theta) - cos(ANGLE_THETA0))^2 of three consecutive beads, theta in degrees
+        const double ANGLE_K = 0.0;
+        const double ANGLE_THETA0 = 180.0;
         const double HEAD_WEIGHT = 1.0;
         const double TAIL_WEIGHT = 1.0;
     }
@@ -46,21 +87,29 @@ namespace smd {
 
     namespace simulator {
         const double SPHERE_SIZE = 50.0;
-        const int RELAX_STEP_NUM = 1000;
+        const int RELAX_STEP_NUM = 1000; // upper bound on the minimizer iterations
         const int WATER_NUM = 300;
         const int SOAP_NUM = 200;
         const uint32_t SEED = 12345678;
         const int LOOP_NUM = 100001;
         const int SAVE_STEP_NUM = 100;
         const std::string OUT_PATH = "exe.log";
+        const bool ASCII_LOG = false; // true: legacy text log at OUT_PATH instead of the binary trajectory
+        const std::string TRAJECTORY_PATH = "exe.traj";
+        // the pair force reduction is bit-reproducible for a given thread count only, so more threads are opt-in;
+        // 0: std::thread::hardware_concurrency()
+        const int THREAD_NUM = 1;
+        const std::string CHECKPOINT_PATH = "exe.ckpt";
+        const int CHECKPOINT_STEP_NUM = 10000; // 0: no checkpoints; a multiple of SAVE_STEP_NUM keeps the output aligned
+        const std::string TELEMETRY_PATH = "exe.telemetry.csv"; // only written by SMD_TELEMETRY builds; CSV for .csv, JSON lines otherwise
+        const int TELEMETRY_STEP_NUM = 1000; // 0: summary at the end only
+        const std::string MICELLE_PATH = "exe.micelle.jsonl"; // cluster statistics, one JSON object per analysis
+        const int MICELLE_STEP_NUM = 1000; // 0: no micelle analysis
+        const double MICELLE_CUTOFF = 1.5; // tails closer than this are in one cluster; at most the neighbor list cutoff
+        const int MICELLE_MIN_SIZE = 5; // soaps in the smallest cluster counted as a micelle
+        const int EXCHANGE_STEP_NUM = 100; // steps between replica exchange attempts of a --temperatures run
 
     }
-
-    namespace step_calculator {
-        const double WATER_STD = ((2.0*GAMMA*KBT)/water::WEIGHT)*DT;
-        const double SOAP_HEAD_STD = ((2.0*GAMMA*KBT)/soap::HEAD_WEIGHT)*DT;
-        const double SOAP_TAIL_STD = ((2.0*GAMMA*KBT)/soap::TAIL_WEIGHT)*DT;
-    }
 } // smd
 
 
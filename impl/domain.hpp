@@ -0,0 +1,648 @@
+#ifndef DOMAIN_HPP
+#define DOMAIN_HPP
+
+#include "./particle_store.hpp"
+#include "./particle.hpp"
+#include "./step_calculator.hpp"
+#include "./thread_pool.hpp"
+#include "./philox.hpp"
+#include "./interaction_table.hpp"
+#include "./trajectory.hpp"
+#include "./transport.hpp"
+#include "./config.hpp"
+#include "./lattice.hpp"
+#include "constants.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace smd {
+// A run split in space over the ranks of a Transport, one single-threaded process per subdomain.
+// The cube [-SPHERE_SIZE, SPHERE_SIZE]^3 is cut into a grid of boxes, one per rank; a rank owns the molecules whose
+// water or head lies in its box (beads pushed outside the cube count for the nearest box), and a soap of any
+// soap.SEQUENCE always moves between ranks as a whole, its beads in chain order, so its bonds and angles are computed
+// where it is owned, and the molecule extent and bonded neighbors follow from the particle ids. Each rank also keeps,
+// as ghosts, the molecules of other ranks with a bead within neighbor_cutoff + NEIGHBOR_SKIN of the bounding box of
+// its own beads. Ownership and ghosts are renewed when a bead anywhere has moved more than half the skin since the
+// last renewal, as for NeighborList; in between only the ghost positions are sent, once per step. Pairs of an owned
+// bead and a ghost are computed on both ranks.
+// The start (init_configuration and minimize, done once by rank 0, which then sends every molecule to its owner), the
+// Langevin step and the Philox noise keyed by step and particle id are those of Simulator with StepCalculator, so the
+// trajectory matches a single-process run up to the order in which forces are summed. RESPA, Brownian dynamics,
+// checkpoints, the text log and the micelle analysis are not supported in this mode. No rank holds the whole system
+// once the run has started.
+// Every rank writes its own beads, in id order, to <TRAJECTORY_PATH>.rank<k>; at the end rank 0 merges the shards
+// bead by bead into the usual trajectory file and removes them.
+class DomainSimulator {
+public:
+    DomainSimulator(const Config& init_config, Transport& init_transport);
+    void run();
+private:
+    void step();
+    // hands molecules that left this rank's box to their new owners, then collects the ghosts and rebuilds the pair list
+    void renew();
+    void migrate();
+    void collect_ghosts();
+    // sends the owned positions the other ranks hold as ghosts, in the order of the last renewal
+    void update_ghosts();
+    void build_pairs();
+    void calc_forces(std::vector<double>& out_fx, std::vector<double>& out_fy, std::vector<double>& out_fz) const;
+    double max_displacement() const;
+    int owner(const double x, const double y, const double z) const;
+    // 1 for a water, the soap length for a soap starting at its head
+    int molecule_size(const int idx) const;
+    // position of bead idx in its soap, counted from the head; -1 for a water
+    int chain_position(const int idx) const;
+    // bead record of the start and of migrate(): id, species, then position, velocity, force and noise
+    static void put_bead(std::vector<char>& buffer, const ParticleStore& store, const int idx);
+    void put_bead(std::vector<char>& buffer, const int idx) const;
+    // appends the record at offset as an owned bead
+    void get_bead(const std::vector<char>& buffer, std::size_t& offset);
+    void write_shard(std::ofstream& shard, const long step) const;
+    void merge_shards(const int frame_num) const;
+    std::string shard_path(const int shard_rank) const;
+    void print(const std::string& line) const;
+
+    Config config;
+    Transport& transport;
+    int rank;
+    int rank_num;
+    std::array<int,3> grid;
+    std::array<double,SPECIES_NUM> weights;
+    std::array<double,SPECIES_NUM> noise_std;
+    Philox philox;
+    InteractionTable interaction_table;
+    int water_num;
+    int soap_length;
+    long step_count = 0;
+
+    // owned beads in [0, owned_num), ghosts after them; a soap's beads always follow its head in chain order
+    int owned_num = 0;
+    std::vector<double> x, y, z;
+    std::vector<double> vx, vy, vz;
+    std::vector<double> fx, fy, fz;
+    std::vector<double> rx, ry, rz;
+    std::vector<std::uint8_t> species;
+    std::vector<int> id;
+    std::vector<double> new_fx, new_fy, new_fz;
+    std::vector<double> new_rx, new_ry, new_rz;
+    std::vector<double> noise_scratch;
+    // owned positions at the last renewal
+    std::vector<double> built_x, built_y, built_z;
+    // owned beads sent to each rank as ghosts, and the number of ghosts received from each, in the renewal order
+    std::vector<std::vector<int>> ghost_sends;
+    std::vector<int> ghost_receive_nums;
+    // pairs (idx, other_idx) with owned idx < other_idx within cutoff + skin, CSR by idx
+    std::vector<int> pair_begins;
+    std::vector<int> pair_others;
+    std::vector<int> cell_begins;
+    std::vector<int> cell_beads;
+    long renewal_num = 0;
+    bool forces_valid = false;
+};
+
+DomainSimulator::DomainSimulator(const Config& init_config, Transport& init_transport)
+    : config(init_config), transport(init_transport),
+      rank(init_transport.get_rank()), rank_num(init_transport.get_rank_num()),
+      weights{water::WEIGHT, init_config.soap.head_weight, init_config.soap.tail_weight},
+      noise_std{init_config.water_std(), init_config.soap_head_std(), init_config.soap_tail_std()},
+      philox(init_config.simulator.seed),
+      interaction_table(interaction_table::DR, init_config),
+      water_num(init_config.water_bead_num()), soap_length(init_config.topology().bead_num())
+{
+    if (config.step_calculator.integrator != LANGEVIN || config.step_calculator.respa_step_num != 1 || config.simulator.ascii_log) {
+        std::cerr << "domain decomposition: only Langevin runs with RESPA_STEP_NUM = 1 and the binary trajectory are supported" << std::endl;
+        std::exit(1);
+    }
+    // the most cubic grid of rank_num boxes, so the ghost layers are as thin as they can be
+    grid = {rank_num, 1, 1};
+    for (int nx = 1; nx <= rank_num; ++nx) {
+        for (int ny = 1; ny <= rank_num/nx; ++ny) {
+            if (rank_num % (nx*ny) != 0) continue;
+            const int nz = rank_num/(nx*ny);
+            if (nx + ny + nz < grid[0] + grid[1] + grid[2]) grid = {nx, ny, nz};
+        }
+    }
+
+    // rank 0 builds and relaxes the whole system the way Simulator does and sends every molecule to its owner, in the
+    // store order, so each rank starts from the beads (and the bead order) it would keep of the whole system
+    std::vector<std::vector<char>> incoming;
+    {
+        std::vector<std::vector<char>> outgoing(rank_num);
+        if (rank == 0) {
+            ParticleStore store(config.water_bead_num(), config.simulator.soap_num, config.topology(), weights);
+            std::mt19937 random_engine(config.simulator.seed);
+            init_configuration(config, store, random_engine);
+            ThreadPool pool(1);
+            StepCalculator step_calculator(pool, config);
+            const MinimizeResult result = step_calculator.minimize(store, config.simulator.relax_step_num);
+            std::ostringstream line;
+            line << "minimize: " << result.iteration_num << " iterations, max force " << result.max_force << ", energy " << result.energy;
+            if (!result.converged) line << " (not converged)";
+            print(line.str());
+            for (int water_idx = 0; water_idx < store.get_water_num(); ++water_idx) {
+                const int idx = store.water_index(water_idx);
+                put_bead(outgoing[owner(store.x[idx], store.y[idx], store.z[idx])], store, idx);
+            }
+            for (int soap_idx = 0; soap_idx < store.get_soap_num(); ++soap_idx) {
+                const int head_idx = store.head_index(soap_idx);
+                auto& buffer = outgoing[owner(store.x[head_idx], store.y[head_idx], store.z[head_idx])];
+                for (int bead_idx = 0; bead_idx < soap_length; ++bead_idx) put_bead(buffer, store, store.bead_index(soap_idx, bead_idx));
+            }
+        }
+        transport.exchange(outgoing, incoming);
+    }
+    for (std::size_t offset = 0; offset < incoming[0].size(); ) get_bead(incoming[0], offset);
+    owned_num = static_cast<int>(id.size());
+    collect_ghosts();
+}
+
+void DomainSimulator::run() {
+    std::ofstream shard(shard_path(rank), std::ios::binary | std::ios::trunc);
+    if (!shard) {
+        std::cerr << "cannot create: " << shard_path(rank) << std::endl;
+        std::exit(1);
+    }
+    std::ostringstream line;
+    line << "domain decomposition: " << rank_num << " ranks, " << grid[0] << "x" << grid[1] << "x" << grid[2] << " boxes";
+    print(line.str());
+    int frame_num = 0;
+    for (int loop_idx = 0; loop_idx < config.simulator.loop_num; ++loop_idx) {
+        if (loop_idx % config.simulator.save_step_num == 0) {
+            write_shard(shard, loop_idx);
+            ++frame_num;
+            const long ghost_num = transport.sum(static_cast<long>(id.size()) - owned_num);
+            const long largest = static_cast<long>(transport.max(owned_num));
+            const long smallest = -static_cast<long>(transport.max(-owned_num));
+            std::ostringstream report;
+            report << "step: " << loop_idx << " owned: " << smallest << ".." << largest << " ghosts: " << ghost_num << " renewals: " << renewal_num;
+            print(report.str());
+        }
+        step();
+    }
+    shard.close();
+    // every shard is complete once every rank got here
+    transport.sum(0);
+    if (rank == 0) merge_shards(frame_num);
+}
+
+void DomainSimulator::step() {
+    const double dt = config.step_calculator.dt;
+    const double gamma = config.friction();
+    const double coef = 1.0 - (gamma*dt)/2.0;
+    const double velo_coef = coef * (coef + std::pow((gamma*dt)/2.0, 2.0));
+
+    if (!forces_valid) {
+        calc_forces(fx, fy, fz);
+        forces_valid = true;
+    }
+    for (int idx = 0; idx < owned_num; ++idx) {
+        const double inv_weight = 1.0/weights[species[idx]];
+        x[idx] += (dt*coef)*vx[idx] + (0.5*dt*dt)*(inv_weight*fx[idx] + rx[idx]);
+        y[idx] += (dt*coef)*vy[idx] + (0.5*dt*dt)*(inv_weight*fy[idx] + ry[idx]);
+        z[idx] += (dt*coef)*vz[idx] + (0.5*dt*dt)*(inv_weight*fz[idx] + rz[idx]);
+    }
+    if (transport.max(max_displacement()) > config.step_calculator.neighbor_skin/2.0) {
+        renew();
+    } else {
+        update_ghosts();
+    }
+    calc_forces(new_fx, new_fy, new_fz);
+
+    new_rx.resize(owned_num);
+    new_ry.resize(owned_num);
+    new_rz.resize(owned_num);
+    noise_scratch.resize(owned_num);
+    philox.normals(step_count, 0, owned_num, id.data(), new_rx.data(), new_ry.data(), new_rz.data(), noise_scratch.data());
+    for (int idx = 0; idx < owned_num; ++idx) {
+        const double inv_weight = 1.0/weights[species[idx]];
+        const double std = noise_std[species[idx]];
+        new_rx[idx] *= std;
+        new_ry[idx] *= std;
+        new_rz[idx] *= std;
+        vx[idx] = velo_coef*vx[idx] + (dt/2.0)*(inv_weight*fx[idx] + inv_weight*new_fx[idx] + rx[idx] + new_rx[idx]);
+        vy[idx] = velo_coef*vy[idx] + (dt/2.0)*(inv_weight*fy[idx] + inv_weight*new_fy[idx] + ry[idx] + new_ry[idx]);
+        vz[idx] = velo_coef*vz[idx] + (dt/2.0)*(inv_weight*fz[idx] + inv_weight*new_fz[idx] + rz[idx] + new_rz[idx]);
+    }
+    std::swap(fx, new_fx);
+    std::swap(fy, new_fy);
+    std::swap(fz, new_fz);
+    std::swap(rx, new_rx);
+    std::swap(ry, new_ry);
+    std::swap(rz, new_rz);
+    ++step_count;
+}
+
+void DomainSimulator::renew() {
+    migrate();
+    collect_ghosts();
+    ++renewal_num;
+}
+
+void DomainSimulator::migrate() {
+    std::vector<std::vector<char>> outgoing(rank_num);
+    int kept_num = 0;
+    for (int idx = 0; idx < owned_num; ) {
+        // taken before the compaction below can overwrite id[idx]
+        const int size = molecule_size(idx);
+        const int destination = owner(x[idx], y[idx], z[idx]);
+        for (int bead_idx = idx; bead_idx < idx + size; ++bead_idx) {
+            if (destination == rank) {
+                // compacts the kept beads in place, keeping their order
+                for (auto* v : {&x, &y, &z, &vx, &vy, &vz, &fx, &fy, &fz, &rx, &ry, &rz}) (*v)[kept_num] = (*v)[bead_idx];
+                species[kept_num] = species[bead_idx];
+                id[kept_num] = id[bead_idx];
+                ++kept_num;
+                continue;
+            }
+            put_bead(outgoing[destination], bead_idx);
+        }
+        idx += size;
+    }
+    std::vector<std::vector<char>> incoming;
+    transport.exchange(outgoing, incoming);
+    owned_num = kept_num;
+    for (auto* v : {&x, &y, &z, &vx, &vy, &vz, &fx, &fy, &fz, &rx, &ry, &rz}) v->resize(owned_num);
+    species.resize(owned_num);
+    id.resize(owned_num);
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        const auto& buffer = incoming[other_rank];
+        for (std::size_t offset = 0; offset < buffer.size(); ) get_bead(buffer, offset);
+    }
+    owned_num = static_cast<int>(id.size());
+}
+
+void DomainSimulator::collect_ghosts() {
+    x.resize(owned_num);
+    y.resize(owned_num);
+    z.resize(owned_num);
+    species.resize(owned_num);
+    id.resize(owned_num);
+
+    // every rank's bounding box of its owned beads, grown by the pair list range
+    const double range = config.neighbor_cutoff() + config.step_calculator.neighbor_skin;
+    std::array<double,6> box;
+    box.fill(std::numeric_limits<double>::infinity());
+    for (int idx = 0; idx < owned_num; ++idx) {
+        box[0] = std::min(box[0], x[idx] - range);
+        box[1] = std::min(box[1], y[idx] - range);
+        box[2] = std::min(box[2], z[idx] - range);
+        box[3] = std::min(box[3], -x[idx] - range);
+        box[4] = std::min(box[4], -y[idx] - range);
+        box[5] = std::min(box[5], -z[idx] - range);
+    }
+    std::vector<std::vector<char>> outgoing(rank_num);
+    for (auto& buffer : outgoing) {
+        for (const double bound : box) put_value(buffer, bound);
+    }
+    std::vector<std::vector<char>> boxes;
+    transport.exchange(outgoing, boxes);
+
+    // whole molecules with a bead inside another rank's box; ghost record: id, species, position
+    ghost_sends.assign(rank_num, {});
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        outgoing[other_rank].clear();
+        if (other_rank == rank) continue;
+        std::size_t offset = 0;
+        std::array<double,6> other_box;
+        for (double& bound : other_box) bound = get_value<double>(boxes[other_rank], offset);
+        const auto inside = [&](const int idx) {
+            return x[idx] >= other_box[0] && y[idx] >= other_box[1] && z[idx] >= other_box[2]
+                && -x[idx] >= other_box[3] && -y[idx] >= other_box[4] && -z[idx] >= other_box[5];
+        };
+        for (int idx = 0; idx < owned_num; idx += molecule_size(idx)) {
+            bool near = false;
+            for (int bead_idx = idx; bead_idx < idx + molecule_size(idx); ++bead_idx) near = near || inside(bead_idx);
+            if (!near) continue;
+            for (int bead_idx = idx; bead_idx < idx + molecule_size(idx); ++bead_idx) {
+                ghost_sends[other_rank].push_back(bead_idx);
+                put_value(outgoing[other_rank], id[bead_idx]);
+                put_value(outgoing[other_rank], species[bead_idx]);
+                put_value(outgoing[other_rank], x[bead_idx]);
+                put_value(outgoing[other_rank], y[bead_idx]);
+                put_value(outgoing[other_rank], z[bead_idx]);
+            }
+        }
+    }
+    std::vector<std::vector<char>> incoming;
+    transport.exchange(outgoing, incoming);
+    ghost_receive_nums.assign(rank_num, 0);
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        const auto& buffer = incoming[other_rank];
+        for (std::size_t offset = 0; offset < buffer.size(); ++ghost_receive_nums[other_rank]) {
+            id.push_back(get_value<int>(buffer, offset));
+            species.push_back(get_value<std::uint8_t>(buffer, offset));
+            x.push_back(get_value<double>(buffer, offset));
+            y.push_back(get_value<double>(buffer, offset));
+            z.push_back(get_value<double>(buffer, offset));
+        }
+    }
+
+    built_x.assign(x.begin(), x.begin() + owned_num);
+    built_y.assign(y.begin(), y.begin() + owned_num);
+    built_z.assign(z.begin(), z.begin() + owned_num);
+    build_pairs();
+}
+
+void DomainSimulator::update_ghosts() {
+    std::vector<std::vector<char>> outgoing(rank_num);
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        for (const int idx : ghost_sends[other_rank]) {
+            put_value(outgoing[other_rank], x[idx]);
+            put_value(outgoing[other_rank], y[idx]);
+            put_value(outgoing[other_rank], z[idx]);
+        }
+    }
+    std::vector<std::vector<char>> incoming;
+    transport.exchange(outgoing, incoming);
+    int idx = owned_num;
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        std::size_t offset = 0;
+        for (int ghost_idx = 0; ghost_idx < ghost_receive_nums[other_rank]; ++ghost_idx, ++idx) {
+            x[idx] = get_value<double>(incoming[other_rank], offset);
+            y[idx] = get_value<double>(incoming[other_rank], offset);
+            z[idx] = get_value<double>(incoming[other_rank], offset);
+        }
+    }
+}
+
+void DomainSimulator::build_pairs() {
+    // cell list over the bounding box of every local bead, cells no smaller than the pair list range
+    const double range = config.neighbor_cutoff() + config.step_calculator.neighbor_skin;
+    const int bead_num = static_cast<int>(id.size());
+    std::array<double,3> lower = {0.0, 0.0, 0.0};
+    std::array<double,3> upper = {0.0, 0.0, 0.0};
+    if (bead_num > 0) {
+        lower = {x[0], y[0], z[0]};
+        upper = lower;
+    }
+    for (int idx = 0; idx < bead_num; ++idx) {
+        const std::array<double,3> c = {x[idx], y[idx], z[idx]};
+        for (int axis = 0; axis < 3; ++axis) {
+            lower[axis] = std::min(lower[axis], c[axis]);
+            upper[axis] = std::max(upper[axis], c[axis]);
+        }
+    }
+    std::array<int,3> cell_nums;
+    for (int axis = 0; axis < 3; ++axis) {
+        cell_nums[axis] = std::max(1, std::min(256, static_cast<int>((upper[axis] - lower[axis])/range)));
+    }
+    const auto cell_axis = [&](const double v, const int axis) {
+        return std::min(cell_nums[axis] - 1, static_cast<int>((v - lower[axis])*cell_nums[axis]/(upper[axis] - lower[axis] + 1e-12)));
+    };
+    const auto cell_of = [&](const int idx) {
+        return (cell_axis(x[idx], 0)*cell_nums[1] + cell_axis(y[idx], 1))*cell_nums[2] + cell_axis(z[idx], 2);
+    };
+    // counting sort of the beads by cell
+    cell_begins.assign(cell_nums[0]*cell_nums[1]*cell_nums[2] + 1, 0);
+    for (int idx = 0; idx < bead_num; ++idx) ++cell_begins[cell_of(idx) + 1];
+    for (std::size_t cell = 1; cell < cell_begins.size(); ++cell) cell_begins[cell] += cell_begins[cell-1];
+    cell_beads.resize(bead_num);
+    std::vector<int> fill(cell_begins.begin(), cell_begins.end() - 1);
+    for (int idx = 0; idx < bead_num; ++idx) cell_beads[fill[cell_of(idx)]++] = idx;
+
+    pair_begins.assign(owned_num + 1, 0);
+    pair_others.clear();
+    for (int idx = 0; idx < owned_num; ++idx) {
+        // the bonded neighbors are left to the springs, as in NeighborList; ghosts are whole molecules, so an owned
+        // bead's neighbors are owned and next to it
+        const int position = chain_position(idx);
+        const int next = position >= 0 && position < soap_length - 1 ? idx + 1 : -1;
+        const std::array<int,3> cell = {cell_axis(x[idx], 0), cell_axis(y[idx], 1), cell_axis(z[idx], 2)};
+        for (int cx = std::max(0, cell[0]-1); cx <= std::min(cell_nums[0]-1, cell[0]+1); ++cx) {
+            for (int cy = std::max(0, cell[1]-1); cy <= std::min(cell_nums[1]-1, cell[1]+1); ++cy) {
+                for (int cz = std::max(0, cell[2]-1); cz <= std::min(cell_nums[2]-1, cell[2]+1); ++cz) {
+                    const int other_cell = (cx*cell_nums[1] + cy)*cell_nums[2] + cz;
+                    for (int bead = cell_begins[other_cell]; bead < cell_begins[other_cell+1]; ++bead) {
+                        // ghosts come after every owned bead, so other_idx > idx keeps each owned pair once
+                        // and every owned-ghost pair
+                        const int other_idx = cell_beads[bead];
+                        if (other_idx <= idx || other_idx == next) continue;
+                        const double dx = x[idx] - x[other_idx];
+                        const double dy = y[idx] - y[other_idx];
+                        const double dz = z[idx] - z[other_idx];
+                        if (dx*dx + dy*dy + dz*dz < range*range) pair_others.push_back(other_idx);
+                    }
+                }
+            }
+        }
+        pair_begins[idx+1] = static_cast<int>(pair_others.size());
+    }
+}
+
+void DomainSimulator::calc_forces(std::vector<double>& out_fx, std::vector<double>& out_fy, std::vector<double>& out_fz) const {
+    out_fx.assign(owned_num, 0.0);
+    out_fy.assign(owned_num, 0.0);
+    out_fz.assign(owned_num, 0.0);
+    for (int idx = 0; idx < owned_num; ++idx) {
+        for (int pair = pair_begins[idx]; pair < pair_begins[idx+1]; ++pair) {
+            const int other_idx = pair_others[pair];
+            const std::array<double,3> v_12 = {x[idx] - x[other_idx], y[idx] - y[other_idx], z[idx] - z[other_idx]};
+            const double coef = interaction_table.force_coef(interaction_table.pair_index(species[idx], species[other_idx]), norm(v_12));
+            out_fx[idx] += coef*v_12[0];
+            out_fy[idx] += coef*v_12[1];
+            out_fz[idx] += coef*v_12[2];
+            if (other_idx < owned_num) {
+                out_fx[other_idx] -= coef*v_12[0];
+                out_fy[other_idx] -= coef*v_12[1];
+                out_fz[other_idx] -= coef*v_12[2];
+            }
+        }
+    }
+    // per soap, the terms of StepCalculator::calc_bonded summed in the same order, then added to the pair forces with
+    // the wall as in StepCalculator::add_local_forces
+    const double spring_k = config.soap.spring_k;
+    const double spring_r0 = config.soap.spring_r0;
+    const double fmax = config.particle.fmax;
+    const double angle_k = config.soap.angle_k;
+    const double cos0 = std::cos(config.soap.angle_theta0*3.141592653589793/180.0);
+    const double sphere_size = config.simulator.sphere_size;
+    const auto coord = [&](const int idx) { return std::array<double,3>{x[idx], y[idx], z[idx]}; };
+    // bonded forces on the beads of one soap
+    std::vector<std::array<double,3>> bonded_f(soap_length);
+    for (int idx = 0; idx < owned_num; idx += molecule_size(idx)) {
+        const int size = molecule_size(idx);
+        std::fill(bonded_f.begin(), bonded_f.begin() + size, std::array<double,3>{0.0, 0.0, 0.0});
+        for (int bond_idx = 0; bond_idx < size - 1; ++bond_idx) {
+            const auto v_12 = coord(idx + bond_idx) - coord(idx + bond_idx + 1);
+            const auto f = Particle::calc_force(v_12, Particle::spring_dUdr(norm(v_12), spring_k, spring_r0), fmax);
+            bonded_f[bond_idx] += f;
+            bonded_f[bond_idx+1] -= f;
+        }
+        for (int angle_idx = 0; angle_k > 0.0 && angle_idx < size - 2; ++angle_idx) {
+            const auto center = coord(idx + angle_idx + 1);
+            std::array<double,3> f_a;
+            std::array<double,3> f_c;
+            Particle::calc_angle(coord(idx + angle_idx) - center, coord(idx + angle_idx + 2) - center, angle_k, cos0, f_a, f_c);
+            bonded_f[angle_idx] += f_a;
+            bonded_f[angle_idx+2] += f_c;
+            bonded_f[angle_idx+1] -= f_a + f_c;
+        }
+        for (int bead_idx = 0; bead_idx < size; ++bead_idx) {
+            std::array<double,3> f = {out_fx[idx + bead_idx], out_fy[idx + bead_idx], out_fz[idx + bead_idx]};
+            f += bonded_f[bead_idx];
+            const auto c = coord(idx + bead_idx);
+            const double n = norm(c);
+            if (n > sphere_size) f += -Particle::sphere_dUdr(n, sphere_size)*(c/n);
+            out_fx[idx + bead_idx] = f[0];
+            out_fy[idx + bead_idx] = f[1];
+            out_fz[idx + bead_idx] = f[2];
+        }
+    }
+}
+
+double DomainSimulator::max_displacement() const {
+    double max_d2 = 0.0;
+    for (int idx = 0; idx < owned_num; ++idx) {
+        const double dx = x[idx] - built_x[idx];
+        const double dy = y[idx] - built_y[idx];
+        const double dz = z[idx] - built_z[idx];
+        max_d2 = std::max(max_d2, dx*dx + dy*dy + dz*dz);
+    }
+    return std::sqrt(max_d2);
+}
+
+int DomainSimulator::owner(const double x, const double y, const double z) const {
+    const double box_size = config.simulator.sphere_size;
+    const std::array<double,3> c = {x, y, z};
+    std::array<int,3> cell;
+    for (int axis = 0; axis < 3; ++axis) {
+        const double t = (c[axis] + box_size)/(2.0*box_size);
+        cell[axis] = std::min(grid[axis] - 1, std::max(0, static_cast<int>(std::floor(t*grid[axis]))));
+    }
+    return (cell[0]*grid[1] + cell[1])*grid[2] + cell[2];
+}
+
+int DomainSimulator::molecule_size(const int idx) const {
+    return id[idx] < water_num ? 1 : soap_length;
+}
+
+int DomainSimulator::chain_position(const int idx) const {
+    return id[idx] < water_num ? -1 : (id[idx] - water_num) % soap_length;
+}
+
+void DomainSimulator::put_bead(std::vector<char>& buffer, const ParticleStore& store, const int idx) {
+    put_value(buffer, store.id[idx]);
+    put_value(buffer, store.species[idx]);
+    // as doubles whatever real is; no forces yet, the first step computes them
+    const double values[] = {static_cast<double>(store.x[idx]), static_cast<double>(store.y[idx]), static_cast<double>(store.z[idx]),
+                             store.vx[idx], store.vy[idx], store.vz[idx], 0.0, 0.0, 0.0, store.rx[idx], store.ry[idx], store.rz[idx]};
+    for (const double v : values) put_value(buffer, v);
+}
+
+void DomainSimulator::put_bead(std::vector<char>& buffer, const int idx) const {
+    put_value(buffer, id[idx]);
+    put_value(buffer, species[idx]);
+    for (const auto* v : {&x, &y, &z, &vx, &vy, &vz, &fx, &fy, &fz, &rx, &ry, &rz}) put_value(buffer, (*v)[idx]);
+}
+
+void DomainSimulator::get_bead(const std::vector<char>& buffer, std::size_t& offset) {
+    id.push_back(get_value<int>(buffer, offset));
+    species.push_back(get_value<std::uint8_t>(buffer, offset));
+    for (auto* v : {&x, &y, &z, &vx, &vy, &vz, &fx, &fy, &fz, &rx, &ry, &rz}) v->push_back(get_value<double>(buffer, offset));
+}
+
+void DomainSimulator::write_shard(std::ofstream& shard, const long step) const {
+    // shard frame: i64 step, i32 bead count, then per bead i32 id and f64 xyz, in increasing id
+    std::vector<int> order(owned_num);
+    for (int idx = 0; idx < owned_num; ++idx) order[idx] = idx;
+    std::sort(order.begin(), order.end(), [&](const int a, const int b) { return id[a] < id[b]; });
+    std::vector<char> buffer;
+    put_value(buffer, static_cast<std::int64_t>(step));
+    put_value(buffer, static_cast<std::int32_t>(owned_num));
+    for (const int idx : order) {
+        put_value(buffer, static_cast<std::int32_t>(id[idx]));
+        put_value(buffer, x[idx]);
+        put_value(buffer, y[idx]);
+        put_value(buffer, z[idx]);
+    }
+    shard.write(buffer.data(), buffer.size());
+}
+
+void DomainSimulator::merge_shards(const int frame_num) const {
+    // one bead at a time: each shard lists its beads of a frame in increasing id, so the frame in id order (the order
+    // TrajectoryWriter takes) is a merge of the shards, and only one record per shard is held
+    struct ShardReader {
+        std::ifstream in;
+        std::int32_t left = 0;
+        std::int32_t id = -1;
+        std::array<double,3> c;
+        void next() {
+            if (left-- == 0) {
+                id = -1;
+                return;
+            }
+            in.read(reinterpret_cast<char*>(&id), sizeof(id));
+            in.read(reinterpret_cast<char*>(c.data()), sizeof(c));
+        }
+    };
+    std::vector<ShardReader> shards(rank_num);
+    for (int shard_rank = 0; shard_rank < rank_num; ++shard_rank) {
+        shards[shard_rank].in.open(shard_path(shard_rank), std::ios::binary);
+        if (!shards[shard_rank].in) {
+            std::cerr << "cannot open: " << shard_path(shard_rank) << std::endl;
+            std::exit(1);
+        }
+    }
+    const int soap_length = config.topology().bead_num();
+    const int bead_num = config.water_bead_num() + soap_length*config.simulator.soap_num;
+    {
+        TrajectoryWriter writer(config.simulator.trajectory_path, config.water_bead_num(), config.simulator.soap_num, soap_length,
+            static_cast<TrajectoryEncoding>(trajectory::ENCODING), trajectory::QUANTUM, trajectory::QUEUE_CAPACITY);
+        for (int frame_idx = 0; frame_idx < frame_num; ++frame_idx) {
+            std::int64_t step = 0;
+            for (auto& shard : shards) {
+                shard.in.read(reinterpret_cast<char*>(&step), sizeof(step));
+                shard.in.read(reinterpret_cast<char*>(&shard.left), sizeof(shard.left));
+                shard.next();
+                if (!shard.in) {
+                    std::cerr << "trajectory shard cut short at frame " << frame_idx << std::endl;
+                    std::exit(1);
+                }
+            }
+            int next_id = 0;
+            writer.write(step, [&]() {
+                for (auto& shard : shards) {
+                    if (shard.id != next_id) continue;
+                    const auto c = shard.c;
+                    shard.next();
+                    ++next_id;
+                    return c;
+                }
+                std::cerr << "trajectory shards hold no bead " << next_id << " at step " << step << std::endl;
+                std::exit(1);
+            });
+            for (const auto& shard : shards) {
+                if (shard.id != -1 || !shard.in) {
+                    std::cerr << "trajectory shards hold more than " << bead_num << " beads at step " << step << std::endl;
+                    std::exit(1);
+                }
+            }
+        }
+    }
+    shards.clear();
+    for (int shard_rank = 0; shard_rank < rank_num; ++shard_rank) {
+        std::remove(shard_path(shard_rank).c_str());
+    }
+}
+
+std::string DomainSimulator::shard_path(const int shard_rank) const {
+    return config.simulator.trajectory_path + ".rank" + std::to_string(shard_rank);
+}
+
+void DomainSimulator::print(const std::string& line) const {
+    if (rank == 0) std::cout << line + "\n" << std::flush;
+}
+} // smd
+
+#endif
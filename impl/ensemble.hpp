@@ -0,0 +1,141 @@
+#ifndef ENSEMBLE_HPP
+#define ENSEMBLE_HPP
+
+#include "./config.hpp"
+#include "./simulator.hpp"
+#include "./thread_pool.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace smd {
+// One axis of a parameter sweep: a config key and the values it takes.
+struct SweepAxis {
+    std::string key;
+    std::vector<std::string> values;
+};
+
+// Every point of the grid spanned by axes, each repeated replica_num times with seeds SEED, SEED+1, ...
+// The first axis varies slowest; the replicas of a point are adjacent.
+std::vector<Config> expand_sweep(const Config& base, const std::vector<SweepAxis>& axes, const int replica_num);
+
+// "<letter><replica_idx>", the index zero-padded to at least three digits and to the same width for all replica_num
+std::string replica_name(const char letter, const int replica_idx, const int replica_num);
+// gives every output file of config (trajectory, log, checkpoint, telemetry, micelle statistics) the name prefix
+// "<name>_" and returns the path of "<name>_config.txt" next to them
+std::string prefix_outputs(Config& config, const std::string& name);
+// the effective settings of a replica, so that it can be rerun alone
+void write_config_file(const std::string& path, const Config& config);
+
+// Independent simulations run in one process, sharing one thread pool.
+// With at least as many replicas as threads, each thread takes whole replicas one after another (a replica then
+// runs single-threaded, so there is no per-step synchronization); otherwise the replicas run in turn on the full pool.
+// Replica k writes its trajectory, log, checkpoint and telemetry with the file name prefix "r<k>_", next to them r<k>_config.txt
+// holds its effective settings, including the thread count it ran with, so that it can be rerun alone bit for bit.
+class Ensemble {
+public:
+    Ensemble(const std::vector<Config>& init_configs, const int thread_num);
+    void run(const bool restart);
+private:
+    std::vector<Config> configs;
+    std::vector<std::string> names;
+    std::vector<std::string> config_paths;
+    ThreadPool pool;
+};
+
+std::vector<Config> expand_sweep(const Config& base, const std::vector<SweepAxis>& axes, const int replica_num) {
+    std::vector<Config> points = {base};
+    for (const auto& axis : axes) {
+        std::vector<Config> next_points;
+        for (const auto& point : points) {
+            for (const auto& value : axis.values) {
+                Config config = point;
+                if (!config.set(axis.key, value)) {
+                    std::cerr << "unknown sweep key: " << axis.key << std::endl;
+                    std::exit(1);
+                }
+                next_points.push_back(config);
+            }
+        }
+        points.swap(next_points);
+    }
+    std::vector<Config> configs;
+    for (const auto& point : points) {
+        for (int replica_idx = 0; replica_idx < replica_num; ++replica_idx) {
+            Config config = point;
+            config.simulator.seed += replica_idx;
+            configs.push_back(config);
+        }
+    }
+    return configs;
+}
+
+Ensemble::Ensemble(const std::vector<Config>& init_configs, const int thread_num)
+    : configs(init_configs), pool(thread_num)
+{
+    const bool across_replicas = static_cast<int>(configs.size()) >= pool.get_thread_num();
+    for (int replica_idx = 0; replica_idx < static_cast<int>(configs.size()); ++replica_idx) {
+        const std::string name = replica_name('r', replica_idx, configs.size());
+        config_paths.push_back(prefix_outputs(configs[replica_idx], name));
+        configs[replica_idx].simulator.thread_num = across_replicas ? 1 : pool.get_thread_num();
+        configs[replica_idx].validate();
+        names.push_back(name);
+    }
+}
+
+void Ensemble::run(const bool restart) {
+    const int replica_num = configs.size();
+    for (int replica_idx = 0; replica_idx < replica_num; ++replica_idx) {
+        write_config_file(config_paths[replica_idx], configs[replica_idx]);
+    }
+    if (replica_num >= pool.get_thread_num()) {
+        std::atomic<int> next_idx(0);
+        pool.parallel_for(pool.get_thread_num(), [&](const int thread_idx, const int begin, const int end) {
+            ThreadPool serial_pool(1);
+            for (int replica_idx = next_idx++; replica_idx < replica_num; replica_idx = next_idx++) {
+                Simulator(configs[replica_idx], serial_pool, names[replica_idx]).run(restart);
+            }
+        });
+    } else {
+        for (int replica_idx = 0; replica_idx < replica_num; ++replica_idx) {
+            Simulator(configs[replica_idx], pool, names[replica_idx]).run(restart);
+        }
+    }
+}
+
+std::string replica_name(const char letter, const int replica_idx, const int replica_num) {
+    const int width = std::max<int>(3, std::to_string(replica_num-1).size());
+    const std::string idx = std::to_string(replica_idx);
+    return letter + std::string(width - idx.size(), '0') + idx;
+}
+
+std::string prefix_outputs(Config& config, const std::string& name) {
+    const auto prefixed = [&](const std::string& path) {
+        const std::filesystem::path p(path);
+        return (p.parent_path() / (name + "_" + p.filename().string())).string();
+    };
+    auto& simulator = config.simulator;
+    const auto directory = std::filesystem::path(simulator.trajectory_path).parent_path();
+    simulator.out_path = prefixed(simulator.out_path);
+    simulator.trajectory_path = prefixed(simulator.trajectory_path);
+    simulator.checkpoint_path = prefixed(simulator.checkpoint_path);
+    simulator.telemetry_path = prefixed(simulator.telemetry_path);
+    simulator.micelle_path = prefixed(simulator.micelle_path);
+    return (directory / (name + "_config.txt")).string();
+}
+
+void write_config_file(const std::string& path, const Config& config) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "cannot create: " << path << std::endl;
+        std::exit(1);
+    }
+    config.write(out);
+}
+} // smd
+
+#endif
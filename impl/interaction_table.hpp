@@ -0,0 +1,321 @@
+#ifndef INTERACTION_TABLE_HPP
+#define INTERACTION_TABLE_HPP
+
+#include "./particle_store.hpp"
+#include "./particle.hpp"
+#include "./config.hpp"
+#include "constants.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace smd {
+// Non-bonded terms of one unordered species pair; every pair also gets the excluded-volume term.
+struct PairInteraction {
+    Species a;
+    Species b;
+    double lj_epsilon;     // 0: no LJ term
+    double lj_sigma;
+    double repulsive_coef; // 0: no repulsive term
+};
+
+// a new bead type only needs its rows here (plus its weight and noise entries)
+// With implicit solvent (SOLVENT = 1) there are no Water beads; their rows stay only to fill the table. The solvent's
+// effect on the soaps moves into the head-head and tail-tail rows: heads that the water would hold apart repel each
+// other a little (IMPLICIT_HEAD_HEAD_*), and tails that the water would push together attract each other more
+// (IMPLICIT_TAIL_TAIL_EPSILON). The friction and the bath temperature take the implicit values as well
+// (IMPLICIT_GAMMA, IMPLICIT_BATH_KBT), which stand in for the water collisions.
+std::vector<PairInteraction> pair_interactions(const StepCalculatorConfig& config) {
+    const bool implicit_solvent = config.solvent == 1;
+    return {
+        {WATER, WATER, config.water_epsilon, config.water_sigma, 0.0},
+        {WATER, HEAD, config.water_head_epsilon, config.water_head_sigma, 0.0},
+        {WATER, TAIL, 0.0, 0.0, config.water_tail_coef},
+        implicit_solvent ? PairInteraction{HEAD, HEAD, config.implicit_head_head_epsilon, config.head_head_sigma, config.implicit_head_head_coef}
+                         : PairInteraction{HEAD, HEAD, config.head_head_epsilon, config.head_head_sigma, 0.0},
+        {HEAD, TAIL, 0.0, 0.0, config.head_tail_coef},
+        {TAIL, TAIL, implicit_solvent ? config.implicit_tail_tail_epsilon : config.tail_tail_epsilon, config.tail_tail_sigma, 0.0},
+    };
+}
+
+// Species-pair matrix of cubic Hermite splines in r, covering [0, config.neighbor_cutoff()) in segments of width dr.
+// A table holds the signed force magnitude m(r) along v_12 (F = m/r * v_12) with the FMAX clamp of every term
+// baked in, so a pair costs one lookup and no transcendental call. The spline is C1 wherever the force is continuous;
+// a cutoff falling on a segment boundary stays a jump. It interpolates the force and its slope at the segment
+// boundaries (within 1e-5 of the force beyond r = 0.2, 1.1e-4 in the steep core below), except around a kink where a
+// term reaches its FMAX cap: there the knot values and slopes are a least-squares fit over three segments, up to 0.32
+// off at the kink. The energy is the integral of the tabulated
+// force, zero at r_max, so the force is exactly minus its derivative.
+class InteractionTable {
+public:
+    InteractionTable(const double init_dr, const Config& config);
+    int pair_index(const int species_a, const int species_b) const;
+    // coefficient c of F = c*v_12
+    double force_coef(const int pair, const double r) const;
+    double energy(const int pair, const double r) const;
+    // analytic terms the tables are built from
+    double reference_force(const PairInteraction& interaction, const double r) const;
+    // below this distance at least one term of the pair is capped at FMAX
+    double get_clamp_r(const int pair) const;
+    int get_segment_num() const;
+    // every table is zero beyond this distance
+    double get_r_max() const;
+    double get_inv_dr() const;
+    // 4 coefficients per segment, segment_num + 1 segments per pair (the last one is zero)
+    const double* get_force_table() const;
+    // the same coefficients as float, for the SMD_MIXED_PRECISION kernels
+    const float* get_force_table_float() const;
+private:
+    void tabulate(const int pair, const PairInteraction& interaction);
+    double reference_terms(const PairInteraction& interaction, const double r, bool& clamped) const;
+    // limit of the force and of its slope at r from one side (+1: above r, -1: below r)
+    std::array<double,2> one_sided(const PairInteraction& interaction, const double r, const double side) const;
+    // solution of the linear system with the augmented matrix m
+    static std::vector<double> solve(std::vector<std::vector<double>> m);
+
+    double dr;
+    double inv_dr;
+    double r_max;
+    int segment_num;
+    ParticleConfig particle;
+    double excluded_d;
+    std::vector<double> force_table;
+    std::vector<float> force_table_float;
+    std::vector<double> energy_table;
+    std::vector<double> clamp_r;
+};
+
+InteractionTable::InteractionTable(const double init_dr, const Config& config)
+    : dr(init_dr), inv_dr(1.0/init_dr), r_max(config.neighbor_cutoff()), segment_num(static_cast<int>(std::ceil(r_max/init_dr - 1e-9))),
+      particle(config.particle), excluded_d(config.step_calculator.excluded_d)
+{
+    force_table.assign(SPECIES_NUM*SPECIES_NUM*(segment_num+1)*4, 0.0);
+    energy_table.assign(SPECIES_NUM*SPECIES_NUM*(segment_num+1), 0.0);
+    clamp_r.assign(SPECIES_NUM*SPECIES_NUM, 0.0);
+    std::vector<bool> filled(SPECIES_NUM*SPECIES_NUM, false);
+    for (const auto& interaction : pair_interactions(config.step_calculator)) {
+        for (const int pair : {pair_index(interaction.a, interaction.b), pair_index(interaction.b, interaction.a)}) {
+            tabulate(pair, interaction);
+            filled[pair] = true;
+        }
+    }
+    if (std::find(filled.begin(), filled.end(), false) != filled.end()) {
+        std::cerr << "missing species pair in pair_interactions" << std::endl;
+        std::exit(1);
+    }
+    force_table_float.assign(force_table.begin(), force_table.end());
+}
+
+int InteractionTable::pair_index(const int species_a, const int species_b) const {
+    return species_a*SPECIES_NUM + species_b;
+}
+
+double InteractionTable::force_coef(const int pair, const double r) const {
+    if (r <= 0.0) return 0.0;
+    const double s = r*inv_dr;
+    const int segment = std::min(static_cast<int>(s), segment_num);
+    const double t = s - segment;
+    const double* a = &force_table[(pair*(segment_num+1) + segment)*4];
+    return (a[0] + t*(a[1] + t*(a[2] + t*a[3])))/r;
+}
+
+double InteractionTable::energy(const int pair, const double r) const {
+    const double s = r*inv_dr;
+    const int segment = std::min(static_cast<int>(s), segment_num);
+    const double t = s - segment;
+    const double* a = &force_table[(pair*(segment_num+1) + segment)*4];
+    return energy_table[pair*(segment_num+1) + segment] - dr*t*(a[0] + t*(a[1]/2.0 + t*(a[2]/3.0 + t*(a[3]/4.0))));
+}
+
+double InteractionTable::reference_force(const PairInteraction& interaction, const double r) const {
+    bool clamped;
+    return reference_terms(interaction, r, clamped);
+}
+
+double InteractionTable::get_clamp_r(const int pair) const {
+    return clamp_r[pair];
+}
+
+double InteractionTable::reference_terms(const PairInteraction& interaction, const double r, bool& clamped) const {
+    // each term clamped like Particle::calc_force: |F| = |dU/dr|*r/(r+1e-6), capped at FMAX
+    clamped = false;
+    const auto term = [&](const double dUdr) {
+        const double m = -dUdr*(r/(r+1e-6));
+        clamped = clamped || std::abs(m) > particle.fmax;
+        return std::max(-particle.fmax, std::min(particle.fmax, m));
+    };
+    double m = term(Particle::excluded_dUdr(r, excluded_d));
+    if (interaction.lj_epsilon != 0.0) m += term(Particle::LennardJones_dUdr(r, interaction.lj_epsilon, interaction.lj_sigma, particle.lj_cutoff));
+    if (interaction.repulsive_coef != 0.0) m += term(Particle::repulsive_dUdr(r, interaction.repulsive_coef, particle.repulsive_d));
+    return m;
+}
+
+int InteractionTable::get_segment_num() const {
+    return segment_num;
+}
+
+double InteractionTable::get_r_max() const {
+    return r_max;
+}
+
+double InteractionTable::get_inv_dr() const {
+    return inv_dr;
+}
+
+const double* InteractionTable::get_force_table() const {
+    return force_table.data();
+}
+
+const float* InteractionTable::get_force_table_float() const {
+    return force_table_float.data();
+}
+
+void InteractionTable::tabulate(const int pair, const PairInteraction& interaction) {
+    // Hermite data at every segment boundary (knot): the force and its slope just below and just above it. Where the
+    // two sides agree, both segments share the exact value and one slope, so the spline is C1 across the knot; where
+    // they differ (a cutoff on the knot), each segment ends on its own side's limit. Beyond r_max the table is zero.
+    std::vector<std::array<double,2>> below(segment_num+1), above(segment_num+1);
+    std::vector<bool> shared(segment_num+1, false);
+    for (int knot = 0; knot <= segment_num; ++knot) {
+        const double r = knot*dr;
+        above[knot] = knot < segment_num ? one_sided(interaction, r, 1.0) : std::array<double,2>{0.0, 0.0};
+        below[knot] = knot > 0 ? one_sided(interaction, r, -1.0) : above[knot];
+        const double jump = std::abs(above[knot][0] - below[knot][0]);
+        if (knot > 0 && knot < segment_num && jump <= 1e-6*(1.0 + std::abs(above[knot][0]))) {
+            shared[knot] = true;
+            below[knot] = above[knot] = {reference_force(interaction, r), 0.5*(below[knot][1] + above[knot][1])};
+        }
+    }
+    double* forces = &force_table[pair*(segment_num+1)*4];
+    const auto fit = [&](const int segment) {
+        // m(t) on t in [0, 1], the slopes scaled from r to t
+        const double p0 = above[segment][0];
+        const double p1 = below[segment+1][0];
+        const double d0 = dr*above[segment][1];
+        const double d1 = dr*below[segment+1][1];
+        double* a = forces + segment*4;
+        a[0] = p0;
+        a[1] = d0;
+        a[2] = 3.0*(p1 - p0) - 2.0*d0 - d1;
+        a[3] = 2.0*(p0 - p1) + d0 + d1;
+    };
+    for (int segment = 0; segment < segment_num; ++segment) fit(segment);
+
+    // A kink inside a segment (a term reaching its FMAX cap) is not C1, and the exact values and slopes at its ends
+    // would make the cubic overshoot it. The shared values and slopes of the knots around such a segment are instead
+    // fitted by least squares to the force over it and its two neighbors.
+    const int SAMPLE_NUM = 16;
+    std::vector<int> free_knots;
+    for (int segment = 0; segment < segment_num; ++segment) {
+        bool kink = false;
+        for (const double t : {0.25, 0.5, 0.75}) {
+            const double r = (segment + t)*dr;
+            const double m = reference_force(interaction, r);
+            kink = kink || std::abs(force_coef(pair, r)*r - m) > 1e-5*(1.0 + std::abs(m));
+        }
+        if (!kink) continue;
+        for (const int knot : {segment, segment+1}) {
+            if (shared[knot] && (free_knots.empty() || free_knots.back() != knot)) free_knots.push_back(knot);
+        }
+    }
+    for (std::size_t begin = 0; begin < free_knots.size(); ) {
+        // a run of free knots at most two apart shares segments, so they are fitted together
+        std::size_t end = begin + 1;
+        while (end < free_knots.size() && free_knots[end] - free_knots[end-1] <= 2) ++end;
+        const int free_num = end - begin;
+        const int first_segment = std::max(0, free_knots[begin] - 1);
+        const int last_segment = std::min(segment_num - 1, free_knots[end-1]);
+        // normal equations of the value and slope of every free knot; the spline is linear in them
+        const int unknown_num = 2*free_num;
+        std::vector<std::vector<double>> m(unknown_num, std::vector<double>(unknown_num + 1, 0.0));
+        for (int segment = first_segment; segment <= last_segment; ++segment) {
+            for (int sample = 0; sample < SAMPLE_NUM; ++sample) {
+                const double t = (sample + 0.5)/SAMPLE_NUM;
+                // Hermite basis: value and slope at t = 0, value and slope at t = 1
+                const std::array<std::array<double,2>,2> h = {{
+                    {1.0 - 3.0*t*t + 2.0*t*t*t, dr*t*(1.0 - t)*(1.0 - t)},
+                    {3.0*t*t - 2.0*t*t*t, dr*t*t*(t - 1.0)}}};
+                std::vector<double> basis(unknown_num, 0.0);
+                double fixed = 0.0;
+                for (int end_idx = 0; end_idx < 2; ++end_idx) {
+                    const int knot = segment + end_idx;
+                    const auto found = std::find(free_knots.begin() + begin, free_knots.begin() + end, knot);
+                    if (found != free_knots.begin() + end) {
+                        const int free_idx = found - (free_knots.begin() + begin);
+                        basis[2*free_idx] += h[end_idx][0];
+                        basis[2*free_idx+1] += h[end_idx][1];
+                    } else {
+                        const auto& side = end_idx == 0 ? above[knot] : below[knot];
+                        fixed += h[end_idx][0]*side[0] + h[end_idx][1]*side[1];
+                    }
+                }
+                const double residual = reference_force(interaction, (segment + t)*dr) - fixed;
+                for (int row = 0; row < unknown_num; ++row) {
+                    for (int col = 0; col < unknown_num; ++col) m[row][col] += basis[row]*basis[col];
+                    m[row][unknown_num] += basis[row]*residual;
+                }
+            }
+        }
+        const auto x = solve(m);
+        for (int free_idx = 0; free_idx < free_num; ++free_idx) {
+            const int knot = free_knots[begin + free_idx];
+            below[knot] = above[knot] = {x[2*free_idx], x[2*free_idx+1]};
+        }
+        for (int segment = first_segment; segment <= last_segment; ++segment) fit(segment);
+        begin = end;
+    }
+
+    // the capped region starts at r = 0, so its edge is the largest capped distance
+    for (int step = segment_num*8; step > 0; --step) {
+        bool clamped;
+        reference_terms(interaction, step*(dr/8.0), clamped);
+        if (clamped) {
+            clamp_r[pair] = step*(dr/8.0);
+            break;
+        }
+    }
+    // energy at the start of each segment, integrating the cubics down from r_max
+    double* energies = &energy_table[pair*(segment_num+1)];
+    for (int segment = segment_num-1; segment >= 0; --segment) {
+        const double* a = forces + segment*4;
+        energies[segment] = energies[segment+1] + dr*(a[0] + a[1]/2.0 + a[2]/3.0 + a[3]/4.0);
+    }
+}
+
+std::array<double,2> InteractionTable::one_sided(const PairInteraction& interaction, const double r, const double side) const {
+    // quadratic through the force at r + side*h*(1, 2, 3), extrapolated to r; h is far inside the segment,
+    // so a cutoff on r is never crossed
+    const double h = 1e-4*dr;
+    const double f1 = reference_force(interaction, r + side*h);
+    const double f2 = reference_force(interaction, r + side*2.0*h);
+    const double f3 = reference_force(interaction, r + side*3.0*h);
+    return {3.0*f1 - 3.0*f2 + f3, side*(-2.5*f1 + 4.0*f2 - 1.5*f3)/h};
+}
+
+std::vector<double> InteractionTable::solve(std::vector<std::vector<double>> m) {
+    // Gaussian elimination with partial pivoting of the augmented n x (n+1) matrix m
+    const int n = m.size();
+    for (int col = 0; col < n; ++col) {
+        int pivot = col;
+        for (int row = col+1; row < n; ++row) {
+            if (std::abs(m[row][col]) > std::abs(m[pivot][col])) pivot = row;
+        }
+        std::swap(m[col], m[pivot]);
+        for (int row = col+1; row < n; ++row) {
+            const double factor = m[row][col]/m[col][col];
+            for (int k = col; k <= n; ++k) m[row][k] -= factor*m[col][k];
+        }
+    }
+    std::vector<double> x(n);
+    for (int row = n-1; row >= 0; --row) {
+        double sum = m[row][n];
+        for (int k = row+1; k < n; ++k) sum -= m[row][k]*x[k];
+        x[row] = sum/m[row][row];
+    }
+    return x;
+}
+} // smd
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef LATTICE_HPP
+#define LATTICE_HPP
+
+#include "./overload.hpp"
+#include "./particle_store.hpp"
+#include "./config.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+namespace smd {
+// site_num molecule sites inside a sphere of the given radius, on a jittered simple cubic lattice.
+// The spacing starts from the one that gives the requested number density and shrinks until enough lattice points
+// fall inside the sphere; the sites are then a random subset of them, so the density is uniform.
+// Sites stay at least min_spacing apart as long as the sphere can hold that many; otherwise a warning is printed
+// and the closest contacts are left to the minimizer. O(site_num) per spacing tried, and only a few are tried.
+// A spacing below a tenth of min_spacing (or a radius that is not positive) is an error: the sphere is far too small.
+std::vector<std::array<double,3>> lattice_sites(const int site_num, const double radius, const double min_spacing, std::mt19937& engine);
+
+// The initial state of a run: waters on the first lattice sites, each soap centered on one of the rest as a straight
+// chain with SPRING_R0 bonds in a random direction, and the initial random memory. Beads of neighboring sites stay out of the soft repulsion range whatever
+// way the soaps point. Draws from engine in a fixed order, so every caller with the same seed gets the same state.
+void init_configuration(const Config& config, ParticleStore& store, std::mt19937& engine);
+
+std::vector<std::array<double,3>> lattice_sites(const int site_num, const double radius, const double min_spacing, std::mt19937& engine) {
+    std::vector<std::array<double,3>> sites;
+    if (site_num <= 0) return sites;
+    const double volume = (4.0/3.0)*3.141592653589793*radius*radius*radius;
+    double spacing = std::cbrt(volume/site_num);
+    while (true) {
+        if (!(radius > 0.0) || spacing < 0.1*min_spacing) {
+            std::ostringstream line;
+            line << "cannot place " << site_num << " molecules in a sphere of radius " << radius << " (spacing " << spacing
+                 << ", at least " << 0.1*min_spacing << " needed)\n";
+            std::cerr << line.str() << std::flush;
+            std::exit(1);
+        }
+        // each axis moves by at most jitter, so neighbors stay min_spacing apart when spacing allows it
+        const double jitter = std::max(0.0, spacing - min_spacing)/(2.0*std::sqrt(3.0));
+        std::uniform_real_distribution<double> jitter_dist(-jitter, jitter);
+        const int n = static_cast<int>(std::floor(radius/spacing)) + 1;
+        sites.clear();
+        for (int i = -n; i <= n; ++i) {
+            for (int j = -n; j <= n; ++j) {
+                for (int k = -n; k <= n; ++k) {
+                    const std::array<double,3> site = {i*spacing + jitter_dist(engine), j*spacing + jitter_dist(engine), k*spacing + jitter_dist(engine)};
+                    if (norm(site) <= radius) sites.push_back(site);
+                }
+            }
+        }
+        if (static_cast<int>(sites.size()) >= site_num) break;
+        spacing *= 0.97;
+    }
+    if (spacing < min_spacing) {
+        // one write, so the lines of concurrent replicas or ranks do not interleave
+        std::ostringstream line;
+        line << "warning: " << site_num << " molecules do not fit in the sphere " << min_spacing << " apart; initial spacing " << spacing << "\n";
+        std::cerr << line.str() << std::flush;
+    }
+    std::shuffle(sites.begin(), sites.end(), engine);
+    sites.resize(site_num);
+    return sites;
+}
+
+void init_configuration(const Config& config, ParticleStore& store, std::mt19937& engine) {
+    // end to end length of a soap
+    const double soap_size = (store.get_topology().bead_num() - 1)*config.soap.spring_r0;
+    const double min_spacing = config.step_calculator.soft_repulsive_d + (store.get_soap_num() > 0 ? soap_size : 0.0);
+    const auto sites = lattice_sites(store.get_water_num() + store.get_soap_num(), config.simulator.sphere_size - soap_size/2.0,
+                                     min_spacing, engine);
+    std::normal_distribution<double> water_dist(0.0, config.water_std());
+    for (int water_idx = 0; water_idx < store.get_water_num(); ++water_idx) {
+        const int idx = store.water_index(water_idx);
+        store.set_coord(idx, sites[water_idx]);
+        const double rx = water_dist(engine);
+        const double ry = water_dist(engine);
+        const double rz = water_dist(engine);
+        store.set_random_memory(idx, {rx, ry, rz});
+    }
+    std::normal_distribution<double> head_dist(0.0, config.soap_head_std());
+    std::normal_distribution<double> tail_dist(0.0, config.soap_tail_std());
+    std::uniform_real_distribution<double> cos_dist(-1.0, 1.0);
+    std::uniform_real_distribution<double> phi_dist(0.0, 2.0*3.141592653589793);
+    const Topology& topology = store.get_topology();
+    for (int soap_idx = 0; soap_idx < store.get_soap_num(); ++soap_idx) {
+        const auto& site = sites[store.get_water_num() + soap_idx];
+        const double cos_theta = cos_dist(engine);
+        const double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
+        const double phi = phi_dist(engine);
+        const std::array<double,3> direction = {sin_theta*std::cos(phi), sin_theta*std::sin(phi), cos_theta};
+        for (int bead_idx = 0; bead_idx < topology.bead_num(); ++bead_idx) {
+            const int idx = store.bead_index(soap_idx, bead_idx);
+            const double offset = (bead_idx - 0.5*(topology.bead_num() - 1))*config.soap.spring_r0;
+            store.set_coord(idx, site + offset*direction);
+            // one distribution per species, so the draws of a two-bead soap are the ones it always had
+            auto& dist = topology.species(bead_idx) == HEAD ? head_dist : tail_dist;
+            const double rx = dist(engine);
+            const double ry = dist(engine);
+            const double rz = dist(engine);
+            store.set_random_memory(idx, {rx, ry, rz});
+        }
+    }
+}
+} // smd
+
+#endif
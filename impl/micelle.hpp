@@ -0,0 +1,195 @@
+#ifndef MICELLE_HPP
+#define MICELLE_HPP
+
+#include "./particle_store.hpp"
+#include "./neighbor_list.hpp"
+#include "./config.hpp"
+#include "./overload.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace smd {
+struct MicelleStats {
+    int soap_num;
+    int micelle_num;
+    double free_fraction;
+    double mean_aggregation;
+    double mean_rg;
+    // histogram[k-1]: clusters of k soaps
+    std::vector<long> histogram;
+};
+
+// Cluster analysis of the soaps. Two soaps belong to the same cluster when their tails are closer than cutoff,
+// directly or through other soaps (union-find over the tail-tail pairs of the neighbor list; the list holds every pair
+// within its cutoff, which Config::validate checks MICELLE_CUTOFF against). The histogram counts free monomers as
+// clusters of 1. A micelle is a cluster of at least min_size soaps; mean_aggregation and mean_rg (mass-weighted radius
+// of gyration over all their beads) average over micelles only, and are 0 without any.
+class MicelleAnalyzer {
+public:
+    MicelleAnalyzer(const double init_cutoff, const int init_min_size);
+    // valid until the next call
+    const MicelleStats& analyze(const ParticleStore& store, const NeighborList& neighbor_list);
+private:
+    int find(int soap_idx);
+    void unite(const int soap_a, const int soap_b);
+
+    double cutoff;
+    int min_size;
+    // union-find over soap indices, by size with path halving
+    std::vector<int> parent;
+    std::vector<int> cluster_size;
+    // per root: mass, center of mass, then mass-weighted squared distance from it
+    std::vector<double> mass;
+    std::vector<std::array<double,3>> center;
+    std::vector<double> spread;
+    MicelleStats stats;
+};
+
+// The in-situ stream of Simulator, one JSON object per analysis:
+//   {"step": S, "soaps": N, "micelles": M, "free_fraction": f, "mean_aggregation": a, "mean_rg": rg, "histogram": [h1, h2, ...]}
+// Given resume_step >= 0, an existing file is continued: lines from resume_step on are dropped first, as for
+// TrajectoryWriter.
+class MicelleLog {
+public:
+    MicelleLog(const std::string& path, const long resume_step = -1);
+    void write(const long step, const MicelleStats& stats);
+private:
+    static void truncate(const std::string& path, const long resume_step);
+
+    std::ofstream out;
+};
+
+MicelleAnalyzer::MicelleAnalyzer(const double init_cutoff, const int init_min_size)
+    : cutoff(init_cutoff), min_size(init_min_size)
+{}
+
+const MicelleStats& MicelleAnalyzer::analyze(const ParticleStore& store, const NeighborList& neighbor_list) {
+    const int soap_num = store.get_soap_num();
+    const int water_num = store.get_water_num();
+    parent.resize(soap_num);
+    cluster_size.assign(soap_num, 1);
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        parent[soap_idx] = soap_idx;
+    }
+    // soap s has the ids water_num + L*s to water_num + L*s + L-1
+    const int bead_num = store.get_topology().bead_num();
+    const auto soap_of = [&](const int idx) { return (store.id[idx] - water_num)/bead_num; };
+    const double cutoff2 = cutoff*cutoff;
+    for (int idx = 0; idx < store.size(); ++idx) {
+        if (store.species[idx] != TAIL) continue;
+        const auto c = store.coord(idx);
+        for (const int* other = neighbor_list.begin(idx); other != neighbor_list.end(idx); ++other) {
+            if (store.species[*other] != TAIL) continue;
+            const auto d = c - store.coord(*other);
+            if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] < cutoff2) unite(soap_of(idx), soap_of(*other));
+        }
+    }
+
+    // two passes over the beads: centers of mass, then the spread around them
+    mass.assign(soap_num, 0.0);
+    center.assign(soap_num, {0.0, 0.0, 0.0});
+    spread.assign(soap_num, 0.0);
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        const int root = find(soap_idx);
+        for (int bead_idx = 0; bead_idx < bead_num; ++bead_idx) {
+            const int idx = store.bead_index(soap_idx, bead_idx);
+            mass[root] += store.weight(idx);
+            center[root] += store.weight(idx)*store.coord(idx);
+        }
+    }
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        if (parent[soap_idx] == soap_idx) center[soap_idx] = (1.0/mass[soap_idx])*center[soap_idx];
+    }
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        const int root = find(soap_idx);
+        for (int bead_idx = 0; bead_idx < bead_num; ++bead_idx) {
+            const int idx = store.bead_index(soap_idx, bead_idx);
+            const auto d = store.coord(idx) - center[root];
+            spread[root] += store.weight(idx)*(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        }
+    }
+
+    stats.soap_num = soap_num;
+    stats.histogram.assign(1, 0);
+    stats.micelle_num = 0;
+    long micelle_soap_num = 0;
+    double rg_sum = 0.0;
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        if (parent[soap_idx] != soap_idx) continue;
+        const int size = cluster_size[soap_idx];
+        if (static_cast<int>(stats.histogram.size()) < size) stats.histogram.resize(size, 0);
+        ++stats.histogram[size-1];
+        if (size < min_size) continue;
+        ++stats.micelle_num;
+        micelle_soap_num += size;
+        rg_sum += std::sqrt(spread[soap_idx]/mass[soap_idx]);
+    }
+    stats.free_fraction = soap_num > 0 ? static_cast<double>(stats.histogram[0])/soap_num : 0.0;
+    stats.mean_aggregation = stats.micelle_num > 0 ? static_cast<double>(micelle_soap_num)/stats.micelle_num : 0.0;
+    stats.mean_rg = stats.micelle_num > 0 ? rg_sum/stats.micelle_num : 0.0;
+    return stats;
+}
+
+int MicelleAnalyzer::find(int soap_idx) {
+    while (parent[soap_idx] != soap_idx) {
+        parent[soap_idx] = parent[parent[soap_idx]];
+        soap_idx = parent[soap_idx];
+    }
+    return soap_idx;
+}
+
+void MicelleAnalyzer::unite(const int soap_a, const int soap_b) {
+    int root_a = find(soap_a);
+    int root_b = find(soap_b);
+    if (root_a == root_b) return;
+    if (cluster_size[root_a] < cluster_size[root_b]) std::swap(root_a, root_b);
+    parent[root_b] = root_a;
+    cluster_size[root_a] += cluster_size[root_b];
+}
+
+MicelleLog::MicelleLog(const std::string& path, const long resume_step) {
+    if (resume_step >= 0) truncate(path, resume_step);
+    out.open(path, resume_step >= 0 ? std::ios::app : std::ios::trunc);
+    if (!out) {
+        std::cerr << "cannot create: " << path << std::endl;
+        std::exit(1);
+    }
+}
+
+void MicelleLog::write(const long step, const MicelleStats& stats) {
+    // one write per line, so a reader never sees half of one
+    std::ostringstream line;
+    line.precision(6);
+    line << "{\"step\": " << step << ", \"soaps\": " << stats.soap_num << ", \"micelles\": " << stats.micelle_num
+         << ", \"free_fraction\": " << stats.free_fraction << ", \"mean_aggregation\": " << stats.mean_aggregation
+         << ", \"mean_rg\": " << stats.mean_rg << ", \"histogram\": [";
+    for (std::size_t size_idx = 0; size_idx < stats.histogram.size(); ++size_idx) {
+        line << (size_idx == 0 ? "" : ", ") << stats.histogram[size_idx];
+    }
+    line << "]}\n";
+    out << line.str() << std::flush;
+}
+
+void MicelleLog::truncate(const std::string& path, const long resume_step) {
+    std::ifstream in(path);
+    if (!in) return;
+    std::vector<std::string> kept;
+    const std::string key = "{\"step\": ";
+    for (std::string line; std::getline(in, line); ) {
+        if (line.compare(0, key.size(), key) != 0) continue;
+        if (std::atol(line.c_str() + key.size()) < resume_step) kept.push_back(line);
+    }
+    in.close();
+    std::ofstream rewritten(path, std::ios::trunc);
+    for (const auto& line : kept) rewritten << line << "\n";
+}
+} // smd
+
+#endif
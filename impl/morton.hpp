@@ -0,0 +1,55 @@
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+#include "./particle_store.hpp"
+#include "./buffer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace smd {
+// Z-order (Morton) code of a cell of a 1024^3 grid: the bits of ix, iy and iz interleaved.
+std::uint32_t morton_code(const std::uint32_t ix, const std::uint32_t iy, const std::uint32_t iz);
+
+// Indices of the particles sorted along the Z-order curve of a 1024^3 grid over [-box_size, box_size)^3, into order.
+// Particles in the same grid cell keep their current relative order, so the result only depends on the positions
+// and the current order. keys is scratch.
+void morton_order(const ParticleStore& store, const double box_size, std::vector<std::uint64_t>& keys, std::vector<int>& order, long& allocation_num);
+
+namespace morton {
+    // the 10 low bits of v spread to every third bit
+    inline std::uint32_t spread(std::uint32_t v) {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+}
+
+std::uint32_t morton_code(const std::uint32_t ix, const std::uint32_t iy, const std::uint32_t iz) {
+    return (morton::spread(ix) << 2) | (morton::spread(iy) << 1) | morton::spread(iz);
+}
+
+void morton_order(const ParticleStore& store, const double box_size, std::vector<std::uint64_t>& keys, std::vector<int>& order, long& allocation_num) {
+    const double inv_cell = 1024.0/(2.0*box_size);
+    // particles pushed outside the box are clamped into the boundary cells, as in NeighborList
+    const auto cell_axis = [&](const double x) {
+        return static_cast<std::uint32_t>(std::min(1023.0, std::max(0.0, std::floor((x + box_size)*inv_cell))));
+    };
+    fit_buffer(keys, store.size(), std::uint64_t(0), allocation_num);
+    for (int idx = 0; idx < store.size(); ++idx) {
+        const std::uint64_t code = morton_code(cell_axis(store.x[idx]), cell_axis(store.y[idx]), cell_axis(store.z[idx]));
+        keys[idx] = (code << 32) | static_cast<std::uint32_t>(idx);
+    }
+    std::sort(keys.begin(), keys.end());
+    fit_buffer(order, store.size(), 0, allocation_num);
+    for (int idx = 0; idx < store.size(); ++idx) {
+        order[idx] = static_cast<int>(keys[idx] & 0xffffffffu);
+    }
+}
+} // smd
+
+#endif
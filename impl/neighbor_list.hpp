@@ -0,0 +1,224 @@
+#ifndef NEIGHBOR_LIST_HPP
+#define NEIGHBOR_LIST_HPP
+
+#include "./particle_store.hpp"
+#include "./overload.hpp"
+#include "./buffer.hpp"
+#include "./thread_pool.hpp"
+#include "./checkpoint.hpp"
+#include "constants.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace smd {
+// Cell grid + half Verlet list over all particles (each pair is stored once, with other_idx > idx).
+// Bonded neighbors (ParticleStore's exclusions) are left out. Rows are built in parallel over the pool's static chunks, and for each
+// chunk the largest index its pairs touch is kept, so per-thread force buffers only need [begin, window_end).
+class NeighborList {
+public:
+    NeighborList(const double init_cutoff, const double init_skin, const double init_box_size);
+    void update(const ParticleStore& store, ThreadPool& pool);
+    void build(const ParticleStore& store, ThreadPool& pool);
+    bool needs_rebuild(const ParticleStore& store, ThreadPool& pool);
+    // the list is saved as the coordinates it was built from, so a restored run rebuilds the identical list
+    void save(std::ostream& out) const;
+    void load(std::istream& in, const ParticleStore& store, ThreadPool& pool);
+    const int* begin(const int idx) const;
+    const int* end(const int idx) const;
+    int get_window_end(const int thread_idx) const;
+    int get_rebuild_num() const;
+    // pairs in the list, i.e. evaluated per force calculation
+    long get_pair_num() const;
+    long get_allocation_num() const;
+private:
+    void build_from_built_coords(const ParticleStore& store, ThreadPool& pool);
+    int cell_axis(const double x) const;
+
+    double cutoff;
+    double skin;
+    double box_size;
+    double cell_size;
+    int cell_num;
+    int particle_num = 0;
+    int rebuild_num = 0;
+    long allocation_num = 0;
+    bool built = false;
+    std::vector<std::array<double,3>> built_coords;
+    std::vector<int> cell_of_particle;
+    std::vector<int> cell_start;
+    std::vector<int> cell_particles;
+    std::vector<int> cell_fill;
+    std::vector<int> neighbor_start;
+    std::vector<int> neighbors;
+    std::vector<std::vector<int>> thread_neighbors;
+    std::vector<int> window_end;
+    std::vector<char> thread_flags;
+    std::vector<long> thread_allocation_num;
+};
+
+NeighborList::NeighborList(const double init_cutoff, const double init_skin, const double init_box_size)
+    : cutoff(init_cutoff), skin(init_skin), box_size(init_box_size)
+{
+    cell_num = std::max(1, static_cast<int>(std::floor((2.0*box_size)/(cutoff+skin))));
+    cell_size = (2.0*box_size)/cell_num;
+}
+
+void NeighborList::update(const ParticleStore& store, ThreadPool& pool) {
+    if (needs_rebuild(store, pool)) build(store, pool);
+}
+
+bool NeighborList::needs_rebuild(const ParticleStore& store, ThreadPool& pool) {
+    if (!built || particle_num != store.size()) return true;
+    const double limit = (0.5*skin)*(0.5*skin);
+    fit_buffer(thread_flags, pool.get_thread_num(), char(0), allocation_num);
+    pool.parallel_for(particle_num, [&](const int thread_idx, const int begin, const int end) {
+        for (int idx = begin; idx < end; ++idx) {
+            const auto d = store.coord(idx) - built_coords[idx];
+            if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > limit) {
+                thread_flags[thread_idx] = 1;
+                return;
+            }
+        }
+    });
+    return std::find(thread_flags.begin(), thread_flags.end(), 1) != thread_flags.end();
+}
+
+void NeighborList::build(const ParticleStore& store, ThreadPool& pool) {
+    fit_buffer(built_coords, store.size(), {0.0, 0.0, 0.0}, allocation_num);
+    for (int idx = 0; idx < store.size(); ++idx) {
+        built_coords[idx] = store.coord(idx);
+    }
+    build_from_built_coords(store, pool);
+}
+
+void NeighborList::save(std::ostream& out) const {
+    write_field(out, built);
+    write_vector(out, built_coords);
+}
+
+void NeighborList::load(std::istream& in, const ParticleStore& store, ThreadPool& pool) {
+    read_field(in, built);
+    read_vector(in, built_coords);
+    if (!built) return;
+    if (static_cast<int>(built_coords.size()) != store.size()) {
+        std::cerr << "checkpoint: neighbor list does not match the particle count" << std::endl;
+        std::exit(1);
+    }
+    build_from_built_coords(store, pool);
+}
+
+void NeighborList::build_from_built_coords(const ParticleStore& store, ThreadPool& pool) {
+    particle_num = store.size();
+    const int thread_num = pool.get_thread_num();
+
+    fit_buffer(cell_of_particle, particle_num, 0, allocation_num);
+    fit_buffer(cell_start, cell_num*cell_num*cell_num + 1, 0, allocation_num);
+    for (int idx = 0; idx < particle_num; ++idx) {
+        const auto& c = built_coords[idx];
+        const int cell = (cell_axis(c[0])*cell_num + cell_axis(c[1]))*cell_num + cell_axis(c[2]);
+        cell_of_particle[idx] = cell;
+        ++cell_start[cell+1];
+    }
+    for (int cell = 0; cell < cell_num*cell_num*cell_num; ++cell) {
+        cell_start[cell+1] += cell_start[cell];
+    }
+    fit_buffer(cell_particles, particle_num, 0, allocation_num);
+    fit_buffer(cell_fill, cell_num*cell_num*cell_num, 0, allocation_num);
+    std::copy(cell_start.begin(), cell_start.end()-1, cell_fill.begin());
+    for (int idx = 0; idx < particle_num; ++idx) {
+        cell_particles[cell_fill[cell_of_particle[idx]]++] = idx;
+    }
+
+    const double list_cutoff2 = (cutoff+skin)*(cutoff+skin);
+    fit_buffer(neighbor_start, particle_num + 1, 0, allocation_num);
+    fit_buffer(window_end, thread_num, 0, allocation_num);
+    fit_buffer(thread_allocation_num, thread_num, 0L, allocation_num);
+    if (static_cast<int>(thread_neighbors.size()) != thread_num) {
+        thread_neighbors.resize(thread_num);
+        ++allocation_num;
+    }
+    pool.parallel_for(particle_num, [&](const int thread_idx, const int begin, const int end) {
+        auto& rows = thread_neighbors[thread_idx];
+        int window = end;
+        rows.clear();
+        for (int idx = begin; idx < end; ++idx) {
+            const auto& c = built_coords[idx];
+            const int cx = cell_axis(c[0]);
+            const int cy = cell_axis(c[1]);
+            const int cz = cell_axis(c[2]);
+            const int* excluded_begin = store.exclusions_begin(idx);
+            const int* excluded_end = store.exclusions_end(idx);
+            const int row_begin = rows.size();
+            for (int nx = std::max(0, cx-1); nx <= std::min(cell_num-1, cx+1); ++nx) {
+                for (int ny = std::max(0, cy-1); ny <= std::min(cell_num-1, cy+1); ++ny) {
+                    for (int nz = std::max(0, cz-1); nz <= std::min(cell_num-1, cz+1); ++nz) {
+                        const int cell = (nx*cell_num + ny)*cell_num + nz;
+                        for (int k = cell_start[cell]; k < cell_start[cell+1]; ++k) {
+                            const int other_idx = cell_particles[k];
+                            if (other_idx <= idx) continue;
+                            const auto d = built_coords[other_idx] - c;
+                            // the distance test first: it rejects most candidates, the exclusions only a few
+                            if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] < list_cutoff2
+                                && std::find(excluded_begin, excluded_end, other_idx) == excluded_end) {
+                                push_buffer(rows, other_idx, thread_allocation_num[thread_idx]);
+                                window = std::max(window, other_idx + 1);
+                            }
+                        }
+                    }
+                }
+            }
+            neighbor_start[idx+1] = rows.size() - row_begin;
+        }
+        window_end[thread_idx] = window;
+    });
+    for (int thread_idx = 0; thread_idx < thread_num; ++thread_idx) {
+        allocation_num += thread_allocation_num[thread_idx];
+    }
+    for (int idx = 0; idx < particle_num; ++idx) {
+        neighbor_start[idx+1] += neighbor_start[idx];
+    }
+
+    fit_buffer(neighbors, neighbor_start[particle_num], 0, allocation_num);
+    pool.parallel_for(particle_num, [&](const int thread_idx, const int begin, const int end) {
+        const auto& rows = thread_neighbors[thread_idx];
+        std::copy(rows.begin(), rows.end(), neighbors.begin() + neighbor_start[begin]);
+    });
+    built = true;
+    ++rebuild_num;
+}
+
+const int* NeighborList::begin(const int idx) const {
+    return neighbors.data() + neighbor_start[idx];
+}
+
+const int* NeighborList::end(const int idx) const {
+    return neighbors.data() + neighbor_start[idx+1];
+}
+
+int NeighborList::get_window_end(const int thread_idx) const {
+    return window_end[thread_idx];
+}
+
+int NeighborList::get_rebuild_num() const {
+    return rebuild_num;
+}
+
+long NeighborList::get_pair_num() const {
+    return built ? neighbor_start[particle_num] : 0;
+}
+
+long NeighborList::get_allocation_num() const {
+    return allocation_num;
+}
+
+int NeighborList::cell_axis(const double x) const {
+    // particles pushed outside the grid are clamped into the boundary cells
+    const double cell = std::floor((x + box_size)/cell_size);
+    return static_cast<int>(std::min(cell_num-1.0, std::max(0.0, cell)));
+}
+} // smd
+
+#endif
@@ -26,6 +26,13 @@ namespace smd {
         return lhs;
     }
 
+    std::array<double,3>& operator-=(std::array<double,3>& lhs, const std::array<double,3>& rhs) {
+        lhs[0] -= rhs[0];
+        lhs[1] -= rhs[1];
+        lhs[2] -= rhs[2];
+        return lhs;
+    }
+
     std::array<double,3> operator/(const std::array<double,3>& v, const double d) {
         return {v[0]/d, v[1]/d, v[2]/d};
     }
@@ -0,0 +1,322 @@
+#ifndef PAIR_KERNEL_HPP
+#define PAIR_KERNEL_HPP
+
+#include "./particle_store.hpp"
+#include "./interaction_table.hpp"
+#include "./neighbor_list.hpp"
+#include "constants.hpp"
+#include <algorithm>
+#include <cmath>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SMD_X86_SIMD
+#endif
+
+namespace smd {
+// Non-bonded forces of the neighbor-list rows [begin, end): F(i, j) is added to f*[i - offset] and subtracted from f*[j - offset].
+// The vector kernels compute r^2 once per pair and evaluate the species pair's InteractionTable segment for 4 or 8
+// pairs at a time; SMD_MIXED_PRECISION builds do so in float, 8 or 16 pairs at a time, and add each force to the double
+// accumulators f*. StepCalculator::calc_pair_force is the scalar path over the same tables.
+using PairKernel = void (*)(const ParticleStore& store, const InteractionTable& table, const NeighborList& neighbor_list, const int begin, const int end, double* fx, double* fy, double* fz, const int offset);
+
+enum class SimdLevel { SCALAR, AVX2, AVX512 };
+
+SimdLevel detect_simd_level();
+const char* simd_level_name(const SimdLevel level);
+// nullptr for SCALAR
+PairKernel select_pair_kernel(const SimdLevel level);
+
+namespace pair_kernel {
+#ifdef SMD_X86_SIMD
+// the gather intrinsics start from an undefined register, which GCC 12 reports as uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#ifndef SMD_MIXED_PRECISION
+    // the 4 cubic coefficients of 4 table segments: one contiguous load per segment, transposed into a[0..3]
+    __attribute__((target("avx2,fma")))
+    inline void load_segments_avx2(const double* coefs, const __m128i row, __m256d* a) {
+        alignas(16) int segment[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(segment), row);
+        const __m256d s0 = _mm256_loadu_pd(coefs + segment[0]*4);
+        const __m256d s1 = _mm256_loadu_pd(coefs + segment[1]*4);
+        const __m256d s2 = _mm256_loadu_pd(coefs + segment[2]*4);
+        const __m256d s3 = _mm256_loadu_pd(coefs + segment[3]*4);
+        const __m256d t0 = _mm256_unpacklo_pd(s0, s1);
+        const __m256d t1 = _mm256_unpackhi_pd(s0, s1);
+        const __m256d t2 = _mm256_unpacklo_pd(s2, s3);
+        const __m256d t3 = _mm256_unpackhi_pd(s2, s3);
+        a[0] = _mm256_permute2f128_pd(t0, t2, 0x20);
+        a[1] = _mm256_permute2f128_pd(t1, t3, 0x20);
+        a[2] = _mm256_permute2f128_pd(t0, t2, 0x31);
+        a[3] = _mm256_permute2f128_pd(t1, t3, 0x31);
+    }
+
+    // forces of `lanes` packed pairs (i[k], j[k]); unused lanes repeat a valid index and are masked out
+    __attribute__((target("avx2,fma")))
+    inline void batch_avx2(const ParticleStore& store, const InteractionTable& table, const int* i, const int* j, const int lanes, double* fx, double* fy, double* fz, const int offset) {
+        const double* x = store.x.data();
+        const double* y = store.y.data();
+        const double* z = store.z.data();
+        const __m256d dx = _mm256_sub_pd(_mm256_setr_pd(x[i[0]], x[i[1]], x[i[2]], x[i[3]]), _mm256_setr_pd(x[j[0]], x[j[1]], x[j[2]], x[j[3]]));
+        const __m256d dy = _mm256_sub_pd(_mm256_setr_pd(y[i[0]], y[i[1]], y[i[2]], y[i[3]]), _mm256_setr_pd(y[j[0]], y[j[1]], y[j[2]], y[j[3]]));
+        const __m256d dz = _mm256_sub_pd(_mm256_setr_pd(z[i[0]], z[i[1]], z[i[2]], z[i[3]]), _mm256_setr_pd(z[j[0]], z[j[1]], z[j[2]], z[j[3]]));
+        const __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+        const int valid = (1 << lanes) - 1;
+        // skin-only batches, common in dilute systems
+        if (!(_mm256_movemask_pd(_mm256_cmp_pd(r2, _mm256_set1_pd(table.get_r_max()*table.get_r_max()), _CMP_LT_OQ)) & valid)) return;
+        const __m256d r = _mm256_sqrt_pd(r2);
+
+        const __m256d s = _mm256_mul_pd(r, _mm256_set1_pd(table.get_inv_dr()));
+        const __m128i segment = _mm_min_epi32(_mm256_cvttpd_epi32(s), _mm_set1_epi32(table.get_segment_num()));
+        const __m256d t = _mm256_sub_pd(s, _mm256_cvtepi32_pd(segment));
+        const std::uint8_t* species = store.species.data();
+        const __m128i pair = _mm_setr_epi32(
+            table.pair_index(species[i[0]], species[j[0]]), table.pair_index(species[i[1]], species[j[1]]),
+            table.pair_index(species[i[2]], species[j[2]]), table.pair_index(species[i[3]], species[j[3]]));
+        const __m128i row = _mm_add_epi32(_mm_mullo_epi32(pair, _mm_set1_epi32(table.get_segment_num()+1)), segment);
+        __m256d a[4];
+        load_segments_avx2(table.get_force_table(), row, a);
+        __m256d m = _mm256_fmadd_pd(a[3], t, a[2]);
+        m = _mm256_fmadd_pd(m, t, a[1]);
+        m = _mm256_fmadd_pd(m, t, a[0]);
+        // coincident beads get no force, as in the scalar path
+        const __m256d c = _mm256_and_pd(_mm256_div_pd(m, r), _mm256_cmp_pd(r2, _mm256_setzero_pd(), _CMP_GT_OQ));
+
+        alignas(32) double f[3][4];
+        _mm256_store_pd(f[0], _mm256_mul_pd(c, dx));
+        _mm256_store_pd(f[1], _mm256_mul_pd(c, dy));
+        _mm256_store_pd(f[2], _mm256_mul_pd(c, dz));
+        // in pair order, so every particle sums its contributions in the same order as the scalar path
+        for (int k = 0; k < lanes; ++k) {
+            fx[i[k]-offset] += f[0][k];
+            fy[i[k]-offset] += f[1][k];
+            fz[i[k]-offset] += f[2][k];
+            fx[j[k]-offset] -= f[0][k];
+            fy[j[k]-offset] -= f[1][k];
+            fz[j[k]-offset] -= f[2][k];
+        }
+    }
+
+    __attribute__((target("avx512f,avx2,fma")))
+    inline void batch_avx512(const ParticleStore& store, const InteractionTable& table, const int* i, const int* j, const int lanes, double* fx, double* fy, double* fz, const int offset) {
+        const double* x = store.x.data();
+        const double* y = store.y.data();
+        const double* z = store.z.data();
+        const __m512d dx = _mm512_sub_pd(_mm512_setr_pd(x[i[0]], x[i[1]], x[i[2]], x[i[3]], x[i[4]], x[i[5]], x[i[6]], x[i[7]]), _mm512_setr_pd(x[j[0]], x[j[1]], x[j[2]], x[j[3]], x[j[4]], x[j[5]], x[j[6]], x[j[7]]));
+        const __m512d dy = _mm512_sub_pd(_mm512_setr_pd(y[i[0]], y[i[1]], y[i[2]], y[i[3]], y[i[4]], y[i[5]], y[i[6]], y[i[7]]), _mm512_setr_pd(y[j[0]], y[j[1]], y[j[2]], y[j[3]], y[j[4]], y[j[5]], y[j[6]], y[j[7]]));
+        const __m512d dz = _mm512_sub_pd(_mm512_setr_pd(z[i[0]], z[i[1]], z[i[2]], z[i[3]], z[i[4]], z[i[5]], z[i[6]], z[i[7]]), _mm512_setr_pd(z[j[0]], z[j[1]], z[j[2]], z[j[3]], z[j[4]], z[j[5]], z[j[6]], z[j[7]]));
+        const __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+        const __mmask8 valid = static_cast<__mmask8>((1 << lanes) - 1);
+        if (!(_mm512_cmp_pd_mask(r2, _mm512_set1_pd(table.get_r_max()*table.get_r_max()), _CMP_LT_OQ) & valid)) return;
+        const __m512d r = _mm512_sqrt_pd(r2);
+
+        const __m512d s = _mm512_mul_pd(r, _mm512_set1_pd(table.get_inv_dr()));
+        const __m256i segment = _mm256_min_epi32(_mm512_cvttpd_epi32(s), _mm256_set1_epi32(table.get_segment_num()));
+        const __m512d t = _mm512_sub_pd(s, _mm512_cvtepi32_pd(segment));
+        const std::uint8_t* species = store.species.data();
+        const __m256i pair = _mm256_setr_epi32(
+            table.pair_index(species[i[0]], species[j[0]]), table.pair_index(species[i[1]], species[j[1]]),
+            table.pair_index(species[i[2]], species[j[2]]), table.pair_index(species[i[3]], species[j[3]]),
+            table.pair_index(species[i[4]], species[j[4]]), table.pair_index(species[i[5]], species[j[5]]),
+            table.pair_index(species[i[6]], species[j[6]]), table.pair_index(species[i[7]], species[j[7]]));
+        const __m256i row = _mm256_add_epi32(_mm256_mullo_epi32(pair, _mm256_set1_epi32(table.get_segment_num()+1)), segment);
+        __m256d lo[4];
+        __m256d hi[4];
+        load_segments_avx2(table.get_force_table(), _mm256_castsi256_si128(row), lo);
+        load_segments_avx2(table.get_force_table(), _mm256_extracti128_si256(row, 1), hi);
+        __m512d a[4];
+        for (int k = 0; k < 4; ++k) {
+            a[k] = _mm512_insertf64x4(_mm512_castpd256_pd512(lo[k]), hi[k], 1);
+        }
+        __m512d m = _mm512_fmadd_pd(a[3], t, a[2]);
+        m = _mm512_fmadd_pd(m, t, a[1]);
+        m = _mm512_fmadd_pd(m, t, a[0]);
+        const __m512d c = _mm512_maskz_div_pd(_mm512_cmp_pd_mask(r2, _mm512_setzero_pd(), _CMP_GT_OQ), m, r);
+
+        alignas(64) double f[3][8];
+        _mm512_store_pd(f[0], _mm512_mul_pd(c, dx));
+        _mm512_store_pd(f[1], _mm512_mul_pd(c, dy));
+        _mm512_store_pd(f[2], _mm512_mul_pd(c, dz));
+        for (int k = 0; k < lanes; ++k) {
+            fx[i[k]-offset] += f[0][k];
+            fy[i[k]-offset] += f[1][k];
+            fz[i[k]-offset] += f[2][k];
+            fx[j[k]-offset] -= f[0][k];
+            fy[j[k]-offset] -= f[1][k];
+            fz[j[k]-offset] -= f[2][k];
+        }
+    }
+
+#else
+    // float variant of load_segments_avx2: the 4 coefficients of the segments row[0..3] transposed into a[0..3]
+    __attribute__((target("avx2,fma")))
+    inline void load_segments_float(const float* coefs, const int* row, __m128* a) {
+        __m128 s0 = _mm_loadu_ps(coefs + row[0]*4);
+        __m128 s1 = _mm_loadu_ps(coefs + row[1]*4);
+        __m128 s2 = _mm_loadu_ps(coefs + row[2]*4);
+        __m128 s3 = _mm_loadu_ps(coefs + row[3]*4);
+        _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+        a[0] = s0;
+        a[1] = s1;
+        a[2] = s2;
+        a[3] = s3;
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline void batch_avx2(const ParticleStore& store, const InteractionTable& table, const int* i, const int* j, const int lanes, double* fx, double* fy, double* fz, const int offset) {
+        const __m256i vi = _mm256_load_si256(reinterpret_cast<const __m256i*>(i));
+        const __m256i vj = _mm256_load_si256(reinterpret_cast<const __m256i*>(j));
+        const __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(store.x.data(), vi, 4), _mm256_i32gather_ps(store.x.data(), vj, 4));
+        const __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(store.y.data(), vi, 4), _mm256_i32gather_ps(store.y.data(), vj, 4));
+        const __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(store.z.data(), vi, 4), _mm256_i32gather_ps(store.z.data(), vj, 4));
+        const __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+        const int valid = (1 << lanes) - 1;
+        const float r_max = table.get_r_max();
+        if (!(_mm256_movemask_ps(_mm256_cmp_ps(r2, _mm256_set1_ps(r_max*r_max), _CMP_LT_OQ)) & valid)) return;
+        const __m256 r = _mm256_sqrt_ps(r2);
+
+        const __m256 s = _mm256_mul_ps(r, _mm256_set1_ps(table.get_inv_dr()));
+        const __m256i segment = _mm256_min_epi32(_mm256_cvttps_epi32(s), _mm256_set1_epi32(table.get_segment_num()));
+        const __m256 t = _mm256_sub_ps(s, _mm256_cvtepi32_ps(segment));
+        alignas(32) int row[8];
+        for (int k = 0; k < 8; ++k) {
+            row[k] = table.pair_index(store.species[i[k]], store.species[j[k]]);
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i*>(row), _mm256_add_epi32(
+            _mm256_mullo_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(row)), _mm256_set1_epi32(table.get_segment_num()+1)), segment));
+        __m128 lo[4];
+        __m128 hi[4];
+        load_segments_float(table.get_force_table_float(), row, lo);
+        load_segments_float(table.get_force_table_float(), row + 4, hi);
+        __m256 a[4];
+        for (int k = 0; k < 4; ++k) {
+            a[k] = _mm256_set_m128(hi[k], lo[k]);
+        }
+        __m256 m = _mm256_fmadd_ps(a[3], t, a[2]);
+        m = _mm256_fmadd_ps(m, t, a[1]);
+        m = _mm256_fmadd_ps(m, t, a[0]);
+        const __m256 c = _mm256_and_ps(_mm256_div_ps(m, r), _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+        alignas(32) float f[3][8];
+        _mm256_store_ps(f[0], _mm256_mul_ps(c, dx));
+        _mm256_store_ps(f[1], _mm256_mul_ps(c, dy));
+        _mm256_store_ps(f[2], _mm256_mul_ps(c, dz));
+        for (int k = 0; k < lanes; ++k) {
+            fx[i[k]-offset] += f[0][k];
+            fy[i[k]-offset] += f[1][k];
+            fz[i[k]-offset] += f[2][k];
+            fx[j[k]-offset] -= f[0][k];
+            fy[j[k]-offset] -= f[1][k];
+            fz[j[k]-offset] -= f[2][k];
+        }
+    }
+
+    __attribute__((target("avx512f,avx2,fma")))
+    inline void batch_avx512(const ParticleStore& store, const InteractionTable& table, const int* i, const int* j, const int lanes, double* fx, double* fy, double* fz, const int offset) {
+        const __m512i vi = _mm512_load_si512(i);
+        const __m512i vj = _mm512_load_si512(j);
+        const __m512 dx = _mm512_sub_ps(_mm512_i32gather_ps(vi, store.x.data(), 4), _mm512_i32gather_ps(vj, store.x.data(), 4));
+        const __m512 dy = _mm512_sub_ps(_mm512_i32gather_ps(vi, store.y.data(), 4), _mm512_i32gather_ps(vj, store.y.data(), 4));
+        const __m512 dz = _mm512_sub_ps(_mm512_i32gather_ps(vi, store.z.data(), 4), _mm512_i32gather_ps(vj, store.z.data(), 4));
+        const __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+        const __mmask16 valid = static_cast<__mmask16>((1 << lanes) - 1);
+        const float r_max = table.get_r_max();
+        if (!(_mm512_cmp_ps_mask(r2, _mm512_set1_ps(r_max*r_max), _CMP_LT_OQ) & valid)) return;
+        const __m512 r = _mm512_sqrt_ps(r2);
+
+        const __m512 s = _mm512_mul_ps(r, _mm512_set1_ps(table.get_inv_dr()));
+        const __m512i segment = _mm512_min_epi32(_mm512_cvttps_epi32(s), _mm512_set1_epi32(table.get_segment_num()));
+        const __m512 t = _mm512_sub_ps(s, _mm512_cvtepi32_ps(segment));
+        alignas(64) int row[16];
+        for (int k = 0; k < 16; ++k) {
+            row[k] = table.pair_index(store.species[i[k]], store.species[j[k]]);
+        }
+        _mm512_store_si512(row, _mm512_add_epi32(_mm512_mullo_epi32(_mm512_load_si512(row), _mm512_set1_epi32(table.get_segment_num()+1)), segment));
+        __m128 quarter[4][4];
+        for (int q = 0; q < 4; ++q) {
+            load_segments_float(table.get_force_table_float(), row + 4*q, quarter[q]);
+        }
+        __m512 a[4];
+        for (int k = 0; k < 4; ++k) {
+            a[k] = _mm512_insertf32x4(_mm512_insertf32x4(_mm512_insertf32x4(_mm512_castps128_ps512(quarter[0][k]), quarter[1][k], 1), quarter[2][k], 2), quarter[3][k], 3);
+        }
+        __m512 m = _mm512_fmadd_ps(a[3], t, a[2]);
+        m = _mm512_fmadd_ps(m, t, a[1]);
+        m = _mm512_fmadd_ps(m, t, a[0]);
+        const __m512 c = _mm512_maskz_div_ps(_mm512_cmp_ps_mask(r2, _mm512_setzero_ps(), _CMP_GT_OQ), m, r);
+
+        alignas(64) float f[3][16];
+        _mm512_store_ps(f[0], _mm512_mul_ps(c, dx));
+        _mm512_store_ps(f[1], _mm512_mul_ps(c, dy));
+        _mm512_store_ps(f[2], _mm512_mul_ps(c, dz));
+        for (int k = 0; k < lanes; ++k) {
+            fx[i[k]-offset] += f[0][k];
+            fy[i[k]-offset] += f[1][k];
+            fz[i[k]-offset] += f[2][k];
+            fx[j[k]-offset] -= f[0][k];
+            fy[j[k]-offset] -= f[1][k];
+            fz[j[k]-offset] -= f[2][k];
+        }
+    }
+#endif
+
+    // pairs of consecutive rows are packed into full vectors, since rows of dilute systems hold only a few pairs
+    template <int WIDTH, void (*BATCH)(const ParticleStore&, const InteractionTable&, const int*, const int*, const int, double*, double*, double*, const int)>
+    void chunk(const ParticleStore& store, const InteractionTable& table, const NeighborList& neighbor_list, const int begin, const int end, double* fx, double* fy, double* fz, const int offset) {
+        alignas(64) int i[WIDTH];
+        alignas(64) int j[WIDTH];
+        int lanes = 0;
+        for (int idx = begin; idx < end; ++idx) {
+            for (auto it = neighbor_list.begin(idx); it != neighbor_list.end(idx); ++it) {
+                i[lanes] = idx;
+                j[lanes] = *it;
+                if (++lanes == WIDTH) {
+                    BATCH(store, table, i, j, WIDTH, fx, fy, fz, offset);
+                    lanes = 0;
+                }
+            }
+        }
+        if (lanes == 0) return;
+        for (int k = lanes; k < WIDTH; ++k) {
+            i[k] = i[0];
+            j[k] = j[0];
+        }
+        BATCH(store, table, i, j, lanes, fx, fy, fz, offset);
+    }
+#pragma GCC diagnostic pop
+#endif
+}
+
+SimdLevel detect_simd_level() {
+#ifdef SMD_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+#endif
+    return SimdLevel::SCALAR;
+}
+
+const char* simd_level_name(const SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "avx512";
+        case SimdLevel::AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+PairKernel select_pair_kernel(const SimdLevel level) {
+#ifdef SMD_X86_SIMD
+#ifdef SMD_MIXED_PRECISION
+    if (level == SimdLevel::AVX512) return &pair_kernel::chunk<16, pair_kernel::batch_avx512>;
+    if (level == SimdLevel::AVX2) return &pair_kernel::chunk<8, pair_kernel::batch_avx2>;
+#else
+    if (level == SimdLevel::AVX512) return &pair_kernel::chunk<8, pair_kernel::batch_avx512>;
+    if (level == SimdLevel::AVX2) return &pair_kernel::chunk<4, pair_kernel::batch_avx2>;
+#endif
+#endif
+    return nullptr;
+}
+} // smd
+
+#endif
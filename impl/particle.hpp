@@ -14,22 +14,26 @@ public:
     std::array<double,3> velo;
     double weight;
     std::array<double,3> random_memory;
-    std::array<double,3> calc_spring(const Particle& other_p, const double k, const double r0) const;
-    std::array<double,3> calc_LennardJones(const Particle& other_p, const double epsilon, const double sigma) const;
-    std::array<double,3> calc_repulsive(const Particle& other_p, const double a) const;
-    std::array<double,3> calc_soft_repulsive(const Particle& other_p, const double repulsive_d) const;
-    std::array<double,3> calc_excluded(const Particle& other_p, const double excluded_d) const;
-    std::array<double,3> calc_sphere() const;
+    std::array<double,3> calc_spring(const Particle& other_p, const double k, const double r0, const double fmax) const;
+    std::array<double,3> calc_LennardJones(const Particle& other_p, const double epsilon, const double sigma, const double lj_cutoff, const double fmax) const;
+    std::array<double,3> calc_repulsive(const Particle& other_p, const double a, const double repulsive_d, const double fmax) const;
+    std::array<double,3> calc_soft_repulsive(const Particle& other_p, const double repulsive_d, const double soft_repulsive_a, const double fmax) const;
+    std::array<double,3> calc_excluded(const Particle& other_p, const double excluded_d, const double fmax) const;
+    std::array<double,3> calc_sphere(const double sphere_size) const;
+
+    static std::array<double,3> calc_force(const std::array<double,3>& v_12, const double dUdr, const double fmax);
+    static double spring_dUdr(const double r, const double k, const double r0);
+    static double LennardJones_dUdr(const double r, const double epsilon, const double sigma, const double lj_cutoff);
+    static double repulsive_dUdr(const double r, const double a, const double repulsive_d);
+    static double soft_repulsive_dUdr(const double r, const double repulsive_d, const double soft_repulsive_a);
+    static double excluded_dUdr(const double r, const double excluded_d);
+    static double sphere_dUdr(const double r, const double sphere_size);
+    // U = 0.5*angle_k*(cos(theta) - cos0)^2 of the angle at a bead with its neighbors at d_a and d_c from it: the forces
+    // on the two neighbors (the middle bead gets minus their sum); returns cos(theta)
+    static double calc_angle(const std::array<double,3>& d_a, const std::array<double,3>& d_c, const double angle_k, const double cos0,
+                             std::array<double,3>& f_a, std::array<double,3>& f_c);
 private:
-    std::array<double,3> calc_force(const Particle& other_p, const double dUdr) const;
-    double spring_dUdr(const double r, const double k, const double r0) const;
-    double LennardJones_dUdr(const double r, const double epsilon, const double sigma) const;
-    double repulsive_dUdr(const double r, const double a) const;
-    double soft_repulsive_dUdr(const double r, const double repulsive_d) const;
-    double excluded_dUdr(const double r, const double excluded_d) const;
-    double sphere_dUdr() const;
-
-    double debug = 100.0;
+    std::array<double,3> calc_force(const Particle& other_p, const double dUdr, const double fmax) const;
 };
 
 Particle::Particle(const double init_x, const double init_y, const double init_z, const double init_weight, const double init_random_x, const double init_random_y, const double init_random_z) {
@@ -39,7 +43,7 @@ Particle::Particle(const double init_x, const double init_y, const double init_z
     random_memory = {init_random_x, init_random_y, init_random_z};
 }
 
-std::array<double,3> Particle::calc_spring(const Particle& other_p, const double k, const double r0) const {
+std::array<double,3> Particle::calc_spring(const Particle& other_p, const double k, const double r0, const double fmax) const {
     const auto r = norm(coord - other_p.coord);
     const auto dUdr = spring_dUdr(r, k, r0);
     //const auto force = calc_force(other_p, dUdr);
@@ -49,12 +53,12 @@ std::array<double,3> Particle::calc_spring(const Particle& other_p, const double
     //    std::exit(1);
     //}
     //return force;
-    return calc_force(other_p, dUdr);
+    return calc_force(other_p, dUdr, fmax);
 }
 
-std::array<double,3> Particle::calc_LennardJones(const Particle& other_p, const double epsilon, const double sigma) const {
+std::array<double,3> Particle::calc_LennardJones(const Particle& other_p, const double epsilon, const double sigma, const double lj_cutoff, const double fmax) const {
     const auto r = norm(coord - other_p.coord);
-    const auto dUdr = LennardJones_dUdr(r, epsilon, sigma);
+    const auto dUdr = LennardJones_dUdr(r, epsilon, sigma, lj_cutoff);
     //const auto force = calc_force(other_p, dUdr);
     //if (norm(force) > debug) {
     //    std::cerr << r << std::endl;
@@ -62,12 +66,12 @@ std::array<double,3> Particle::calc_LennardJones(const Particle& other_p, const
     //    std::exit(1);
     //}
     //return force;
-    return calc_force(other_p, dUdr);
+    return calc_force(other_p, dUdr, fmax);
 }
 
-std::array<double,3> Particle::calc_repulsive(const Particle& other_p, const double a) const {
+std::array<double,3> Particle::calc_repulsive(const Particle& other_p, const double a, const double repulsive_d, const double fmax) const {
     const auto r = norm(coord - other_p.coord);
-    const auto dUdr = repulsive_dUdr(r, a);
+    const auto dUdr = repulsive_dUdr(r, a, repulsive_d);
     //const auto force = calc_force(other_p, dUdr);
     //if (norm(force) > debug) {
     //    std::cerr << r << std::endl;
@@ -75,12 +79,12 @@ std::array<double,3> Particle::calc_repulsive(const Particle& other_p, const dou
     //    std::exit(1);
     //}
     //return force;
-    return calc_force(other_p, dUdr);
+    return calc_force(other_p, dUdr, fmax);
 }
 
-std::array<double,3> Particle::calc_soft_repulsive(const Particle& other_p, const double repulsive_d) const {
+std::array<double,3> Particle::calc_soft_repulsive(const Particle& other_p, const double repulsive_d, const double soft_repulsive_a, const double fmax) const {
     const auto r = norm(coord - other_p.coord);
-    const auto dUdr = soft_repulsive_dUdr(r, repulsive_d);
+    const auto dUdr = soft_repulsive_dUdr(r, repulsive_d, soft_repulsive_a);
     //const auto force = calc_force(other_p, dUdr);
     //if (norm(force) > debug) {
     //    std::cerr << r << std::endl;
@@ -88,10 +92,10 @@ std::array<double,3> Particle::calc_soft_repulsive(const Particle& other_p, cons
     //    std::exit(1);
     //}
     //return force;
-    return calc_force(other_p, dUdr);
+    return calc_force(other_p, dUdr, fmax);
 }
 
-std::array<double,3> Particle::calc_excluded(const Particle& other_p, const double excluded_d) const {
+std::array<double,3> Particle::calc_excluded(const Particle& other_p, const double excluded_d, const double fmax) const {
     const auto r = norm(coord - other_p.coord);
     const auto dUdr = excluded_dUdr(r, excluded_d);
     //const auto force = calc_force(other_p, dUdr);
@@ -101,33 +105,37 @@ std::array<double,3> Particle::calc_excluded(const Particle& other_p, const doub
     //    std::exit(1);
     //}
     //return force;
-    return calc_force(other_p, dUdr);
+    return calc_force(other_p, dUdr, fmax);
 }
 
-std::array<double,3> Particle::calc_sphere() const {
+std::array<double,3> Particle::calc_sphere(const double sphere_size) const {
     const auto v = coord;
     const auto n = norm(v);
-    const auto dUdr = sphere_dUdr();
+    const auto dUdr = sphere_dUdr(n, sphere_size);
     const auto force = -dUdr*(v/n);
     return force;
 }
 
-std::array<double,3> Particle::calc_force(const Particle& other_p, const double dUdr) const {
-    const auto v_12 = coord - other_p.coord;
+std::array<double,3> Particle::calc_force(const Particle& other_p, const double dUdr, const double fmax) const {
+    return calc_force(coord - other_p.coord, dUdr, fmax);
+}
+
+std::array<double,3> Particle::calc_force(const std::array<double,3>& v_12, const double dUdr, const double fmax) {
     const auto distance = norm(v_12);
     auto force = (-dUdr*(1.0/(distance+1e-6)))*v_12;
 
     const double f_n = norm(force);
-    if (f_n > particle::FMAX) force = (particle::FMAX / f_n) * force;
+    if (f_n > fmax) force = (fmax / f_n) * force;
     return force;
 }
 
-double Particle::spring_dUdr(const double r, const double k, const double r0) const {
+double Particle::spring_dUdr(const double r, const double k, const double r0) {
     return k*(r-r0);
 }
 
-double Particle::LennardJones_dUdr(const double r, const double epsilon, const double sigma) const {
+double Particle::LennardJones_dUdr(const double r, const double epsilon, const double sigma, const double lj_cutoff) {
     //return 24.0*epsilon*(-2.0*(std::pow(sigma, 12.0)/(std::pow(r, 13.0)+1e-6)) + std::pow(sigma, 6.0)/(std::pow(r, 7.0)+1e-6));
+    if (r > lj_cutoff*sigma) return 0.0;
     double inv_r  = 1.0 / (r+1e-6);
     double sr     = sigma * inv_r;
     double sr2    = sr * sr;
@@ -137,26 +145,39 @@ double Particle::LennardJones_dUdr(const double r, const double epsilon, const d
     return dUdr;
 }
 
-double Particle::repulsive_dUdr(const double r, const double a) const {
-    if (r > particle::REPULSIVE_D) return 0.0;
+double Particle::repulsive_dUdr(const double r, const double a, const double repulsive_d) {
+    if (r > repulsive_d) return 0.0;
     return -a*(1.0/(r*r+1e-6));
 }
 
-double Particle::soft_repulsive_dUdr(const double r, const double repulsive_d) const {
+double Particle::soft_repulsive_dUdr(const double r, const double repulsive_d, const double soft_repulsive_a) {
     if (r > repulsive_d) return 0.0;
-    return -particle::SOFT_REPULSIVE_A*repulsive_d;
+    return -soft_repulsive_a*repulsive_d;
 }
 
-double Particle::excluded_dUdr(const double r, const double excluded_d) const {
+double Particle::excluded_dUdr(const double r, const double excluded_d) {
     if (r > excluded_d) return 0.0;
     return -(1.0+std::pow(std::tan(((3.1415926535/2.0)/excluded_d)*(r-excluded_d)), 2.0));
 }
 
-double Particle::sphere_dUdr() const {
-    if (norm(coord) < simulator::SPHERE_SIZE) return 0.0;
-    return 2.0*(norm(coord) - simulator::SPHERE_SIZE);
+double Particle::sphere_dUdr(const double r, const double sphere_size) {
+    if (r < sphere_size) return 0.0;
+    return 2.0*(r - sphere_size);
     //return step_calculator::SPHERE_COEF;
 }
+
+double Particle::calc_angle(const std::array<double,3>& d_a, const std::array<double,3>& d_c, const double angle_k, const double cos0,
+                            std::array<double,3>& f_a, std::array<double,3>& f_c) {
+    const double r_a = norm(d_a);
+    const double r_c = norm(d_c);
+    // beads on top of each other have no angle
+    const double inv_ac = r_a > 0.0 && r_c > 0.0 ? 1.0/(r_a*r_c) : 0.0;
+    const double cos_theta = (d_a[0]*d_c[0] + d_a[1]*d_c[1] + d_a[2]*d_c[2])*inv_ac;
+    const double coef = -angle_k*(cos_theta - cos0);
+    f_a = coef*(inv_ac*d_c - (inv_ac > 0.0 ? cos_theta/(r_a*r_a) : 0.0)*d_a);
+    f_c = coef*(inv_ac*d_a - (inv_ac > 0.0 ? cos_theta/(r_c*r_c) : 0.0)*d_c);
+    return cos_theta;
+}
 } // smd
 
 #endif
\ No newline at end of file
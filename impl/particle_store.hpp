@@ -0,0 +1,347 @@
+#ifndef PARTICLE_STORE_HPP
+#define PARTICLE_STORE_HPP
+
+#include "./particle.hpp"
+#include "./checkpoint.hpp"
+#include "./buffer.hpp"
+#include "./topology.hpp"
+#include "constants.hpp"
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace smd {
+// Storage type of positions and forces. SMD_MIXED_PRECISION builds store them as float, which halves their memory
+// traffic and lets the pair kernels run twice as many lanes; per-particle force sums, velocities, noise and energies
+// stay double in both builds.
+#ifdef SMD_MIXED_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
+// Structure-of-Arrays storage for every bead in the system.
+// Particle ids: waters are [0, water_num), bead j of soap s is water_num + L*s + j for soaps of L beads (Topology).
+// A particle's index in the arrays starts out equal to its id and changes with reorder(); water_index/bead_index map
+// ids to current indices, so code that names molecules through them does not depend on the storage order.
+class ParticleStore {
+public:
+    // init_weights: mass per species
+    ParticleStore(const int init_water_num, const int init_soap_num, const Topology& init_topology, const std::array<double,SPECIES_NUM>& init_weights);
+    int size() const;
+    int get_water_num() const;
+    int get_soap_num() const;
+    const Topology& get_topology() const;
+    int water_index(const int water_idx) const;
+    int bead_index(const int soap_idx, const int bead_idx) const;
+    // the first and the last bead of the chain
+    int head_index(const int soap_idx) const;
+    int tail_index(const int soap_idx) const;
+    // beads without non-bonded interactions with idx: its bonded neighbors
+    const int* exclusions_begin(const int idx) const;
+    const int* exclusions_end(const int idx) const;
+    double weight(const int idx) const;
+    std::array<double,3> coord(const int idx) const;
+    std::array<double,3> velo(const int idx) const;
+    std::array<double,3> random_memory(const int idx) const;
+    void set_coord(const int idx, const std::array<double,3>& c);
+    void set_velo(const int idx, const std::array<double,3>& v);
+    void set_random_memory(const int idx, const std::array<double,3>& r);
+    // frees v* for integrators without velocity state; velo() and set_velo() are invalid afterwards
+    void release_velocities();
+    // moves particle order[k] to index k in every per-particle array (the velocities only if not released) and
+    // renews the bond, angle and exclusion indices; order must be a permutation of [0, size())
+    void reorder(const std::vector<int>& order, long& allocation_num);
+    // every per-particle array, including the cached forces; load() requires the same water and soap numbers and
+    // soap length
+    void save(std::ostream& out) const;
+    void load(std::istream& in);
+
+    std::vector<real> x, y, z;
+    std::vector<double> vx, vy, vz;
+    std::vector<real> fx, fy, fz;
+    std::vector<double> rx, ry, rz;
+    std::vector<std::uint8_t> species;
+    // stable particle id; keys the per-particle noise stream
+    std::vector<int> id;
+    // current indices of the bonded terms, soap by soap: bond k joins bond_a[k] and bond_b[k] (the bead nearer the
+    // head first), angle k is the one at angle_b[k] between angle_a[k] and angle_c[k]
+    std::vector<int> bond_a, bond_b;
+    std::vector<int> angle_a, angle_b, angle_c;
+private:
+    template <typename T>
+    static void permute(std::vector<T>& v, const std::vector<int>& order, std::vector<T>& scratch, long& allocation_num);
+    void index_ids();
+    // bond, angle and exclusion indices from id_index
+    void index_bonds();
+
+    int water_num;
+    int soap_num;
+    Topology topology;
+    std::array<double,SPECIES_NUM> weights;
+    // current index of each id, the inverse of id
+    std::vector<int> id_index;
+    // bonded neighbors of each index, CSR
+    std::vector<int> exclusion_start;
+    std::vector<int> exclusions;
+    // gather targets of reorder(), swapped with the array they permute
+    std::vector<real> scratch_real;
+    std::vector<double> scratch_double;
+    std::vector<int> scratch_int;
+    std::vector<std::uint8_t> scratch_species;
+};
+
+// Handle to one bead of a ParticleStore; Water and Soap are made of these.
+class ParticleRef {
+public:
+    ParticleRef(ParticleStore& init_store, const int init_idx);
+    std::array<double,3> coord() const;
+    std::array<double,3> velo() const;
+    std::array<double,3> random_memory() const;
+    void set_coord(const std::array<double,3>& c);
+    Particle particle() const;
+    int idx;
+private:
+    ParticleStore* store;
+};
+
+ParticleStore::ParticleStore(const int init_water_num, const int init_soap_num, const Topology& init_topology, const std::array<double,SPECIES_NUM>& init_weights)
+    : water_num(init_water_num), soap_num(init_soap_num), topology(init_topology), weights(init_weights)
+{
+    const int particle_num = water_num + topology.bead_num()*soap_num;
+    for (auto* v : {&x, &y, &z, &fx, &fy, &fz}) {
+        v->assign(particle_num, 0.0);
+    }
+    for (auto* v : {&vx, &vy, &vz, &rx, &ry, &rz}) {
+        v->assign(particle_num, 0.0);
+    }
+    species.assign(particle_num, WATER);
+    id.resize(particle_num);
+    for (int idx = 0; idx < particle_num; ++idx) {
+        id[idx] = idx;
+    }
+    index_ids();
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        for (int bead_idx = 0; bead_idx < topology.bead_num(); ++bead_idx) {
+            species[bead_index(soap_idx, bead_idx)] = topology.species(bead_idx);
+        }
+    }
+    index_bonds();
+}
+
+int ParticleStore::size() const {
+    return water_num + topology.bead_num()*soap_num;
+}
+
+int ParticleStore::get_water_num() const {
+    return water_num;
+}
+
+int ParticleStore::get_soap_num() const {
+    return soap_num;
+}
+
+const Topology& ParticleStore::get_topology() const {
+    return topology;
+}
+
+int ParticleStore::water_index(const int water_idx) const {
+    return id_index[water_idx];
+}
+
+int ParticleStore::bead_index(const int soap_idx, const int bead_idx) const {
+    return id_index[water_num + topology.bead_num()*soap_idx + bead_idx];
+}
+
+int ParticleStore::head_index(const int soap_idx) const {
+    return bead_index(soap_idx, 0);
+}
+
+int ParticleStore::tail_index(const int soap_idx) const {
+    return bead_index(soap_idx, topology.bead_num() - 1);
+}
+
+const int* ParticleStore::exclusions_begin(const int idx) const {
+    return exclusions.data() + exclusion_start[idx];
+}
+
+const int* ParticleStore::exclusions_end(const int idx) const {
+    return exclusions.data() + exclusion_start[idx+1];
+}
+
+double ParticleStore::weight(const int idx) const {
+    return weights[species[idx]];
+}
+
+std::array<double,3> ParticleStore::coord(const int idx) const {
+    return {x[idx], y[idx], z[idx]};
+}
+
+std::array<double,3> ParticleStore::velo(const int idx) const {
+    return {vx[idx], vy[idx], vz[idx]};
+}
+
+std::array<double,3> ParticleStore::random_memory(const int idx) const {
+    return {rx[idx], ry[idx], rz[idx]};
+}
+
+void ParticleStore::set_coord(const int idx, const std::array<double,3>& c) {
+    x[idx] = c[0];
+    y[idx] = c[1];
+    z[idx] = c[2];
+}
+
+void ParticleStore::set_velo(const int idx, const std::array<double,3>& v) {
+    vx[idx] = v[0];
+    vy[idx] = v[1];
+    vz[idx] = v[2];
+}
+
+void ParticleStore::set_random_memory(const int idx, const std::array<double,3>& r) {
+    rx[idx] = r[0];
+    ry[idx] = r[1];
+    rz[idx] = r[2];
+}
+
+void ParticleStore::release_velocities() {
+    for (auto* v : {&vx, &vy, &vz}) {
+        std::vector<double>().swap(*v);
+    }
+}
+
+void ParticleStore::reorder(const std::vector<int>& order, long& allocation_num) {
+    for (auto* v : {&x, &y, &z, &fx, &fy, &fz}) {
+        permute(*v, order, scratch_real, allocation_num);
+    }
+    for (auto* v : {&vx, &vy, &vz, &rx, &ry, &rz}) {
+        if (!v->empty()) permute(*v, order, scratch_double, allocation_num);
+    }
+    permute(species, order, scratch_species, allocation_num);
+    permute(id, order, scratch_int, allocation_num);
+    index_ids();
+    index_bonds();
+}
+
+template <typename T>
+void ParticleStore::permute(std::vector<T>& v, const std::vector<int>& order, std::vector<T>& scratch, long& allocation_num) {
+    if (order.size() > scratch.capacity()) ++allocation_num;
+    scratch.resize(order.size());
+    for (std::size_t idx = 0; idx < order.size(); ++idx) {
+        scratch[idx] = v[order[idx]];
+    }
+    v.swap(scratch);
+}
+
+void ParticleStore::index_ids() {
+    id_index.resize(id.size());
+    for (int idx = 0; idx < static_cast<int>(id.size()); ++idx) {
+        id_index[id[idx]] = idx;
+    }
+}
+
+void ParticleStore::index_bonds() {
+    // same sizes on every call, so only the first one allocates
+    const int bond_num = topology.bond_num();
+    const int angle_num = topology.angle_num();
+    bond_a.resize(soap_num*bond_num);
+    bond_b.resize(soap_num*bond_num);
+    angle_a.resize(soap_num*angle_num);
+    angle_b.resize(soap_num*angle_num);
+    angle_c.resize(soap_num*angle_num);
+    for (int soap_idx = 0; soap_idx < soap_num; ++soap_idx) {
+        for (int bond_idx = 0; bond_idx < bond_num; ++bond_idx) {
+            bond_a[soap_idx*bond_num + bond_idx] = bead_index(soap_idx, bond_idx);
+            bond_b[soap_idx*bond_num + bond_idx] = bead_index(soap_idx, bond_idx + 1);
+        }
+        for (int angle_idx = 0; angle_idx < angle_num; ++angle_idx) {
+            angle_a[soap_idx*angle_num + angle_idx] = bead_index(soap_idx, angle_idx);
+            angle_b[soap_idx*angle_num + angle_idx] = bead_index(soap_idx, angle_idx + 1);
+            angle_c[soap_idx*angle_num + angle_idx] = bead_index(soap_idx, angle_idx + 2);
+        }
+    }
+    // counts at [idx+1], prefix sums, then filled through exclusion_start[idx] and shifted back
+    exclusion_start.assign(size() + 1, 0);
+    for (std::size_t bond_idx = 0; bond_idx < bond_a.size(); ++bond_idx) {
+        ++exclusion_start[bond_a[bond_idx] + 1];
+        ++exclusion_start[bond_b[bond_idx] + 1];
+    }
+    for (int idx = 0; idx < size(); ++idx) {
+        exclusion_start[idx+1] += exclusion_start[idx];
+    }
+    exclusions.resize(exclusion_start[size()]);
+    for (std::size_t bond_idx = 0; bond_idx < bond_a.size(); ++bond_idx) {
+        exclusions[exclusion_start[bond_a[bond_idx]]++] = bond_b[bond_idx];
+        exclusions[exclusion_start[bond_b[bond_idx]]++] = bond_a[bond_idx];
+    }
+    for (int idx = size(); idx > 0; --idx) {
+        exclusion_start[idx] = exclusion_start[idx-1];
+    }
+    exclusion_start[0] = 0;
+}
+
+void ParticleStore::save(std::ostream& out) const {
+    write_field(out, water_num);
+    write_field(out, soap_num);
+    write_field(out, topology.bead_num());
+    for (const auto* v : {&x, &y, &z}) write_vector(out, *v);
+    for (const auto* v : {&vx, &vy, &vz}) write_vector(out, *v);
+    for (const auto* v : {&fx, &fy, &fz}) write_vector(out, *v);
+    for (const auto* v : {&rx, &ry, &rz}) write_vector(out, *v);
+    write_vector(out, species);
+    write_vector(out, id);
+}
+
+void ParticleStore::load(std::istream& in) {
+    int saved_water_num;
+    int saved_soap_num;
+    int saved_bead_num;
+    read_field(in, saved_water_num);
+    read_field(in, saved_soap_num);
+    read_field(in, saved_bead_num);
+    if (saved_water_num != water_num || saved_soap_num != soap_num || saved_bead_num != topology.bead_num()) {
+        std::cerr << "checkpoint: saved for " << saved_water_num << " waters and " << saved_soap_num << " soaps of "
+                  << saved_bead_num << " beads" << std::endl;
+        std::exit(1);
+    }
+    for (auto* v : {&x, &y, &z}) read_vector(in, *v);
+    for (auto* v : {&vx, &vy, &vz}) read_vector(in, *v);
+    for (auto* v : {&fx, &fy, &fz}) read_vector(in, *v);
+    for (auto* v : {&rx, &ry, &rz}) read_vector(in, *v);
+    read_vector(in, species);
+    read_vector(in, id);
+    index_ids();
+    index_bonds();
+}
+
+ParticleRef::ParticleRef(ParticleStore& init_store, const int init_idx)
+    : idx(init_idx), store(&init_store)
+{}
+
+std::array<double,3> ParticleRef::coord() const {
+    return store->coord(idx);
+}
+
+std::array<double,3> ParticleRef::velo() const {
+    return store->velo(idx);
+}
+
+std::array<double,3> ParticleRef::random_memory() const {
+    return store->random_memory(idx);
+}
+
+void ParticleRef::set_coord(const std::array<double,3>& c) {
+    store->set_coord(idx, c);
+}
+
+Particle ParticleRef::particle() const {
+    const auto c = coord();
+    const auto r = random_memory();
+    Particle p(c[0], c[1], c[2], store->weight(idx), r[0], r[1], r[2]);
+    p.velo = velo();
+    return p;
+}
+} // smd
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef PHILOX_HPP
+#define PHILOX_HPP
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+namespace smd {
+// Counter-based Philox4x32-10 generator (Salmon et al., SC'11).
+// A draw depends only on (seed, step, id, block), so it can be taken from any thread in any order.
+class Philox {
+public:
+    explicit Philox(const std::uint64_t init_seed);
+    std::array<std::uint32_t,4> generate(const std::uint64_t step, const std::uint32_t id, const std::uint32_t block) const;
+    // standard normal draws for components 0..2 of (step, ids[idx]) into nx/ny/nz[idx], idx in [begin, end).
+    // u_scratch must hold end - begin values; the integer and transcendental parts run as separate flat loops.
+    void normals(const std::uint64_t step, const int begin, const int end, const int* ids, double* nx, double* ny, double* nz, double* u_scratch) const;
+    // one uniform draw in (0, 1] from counter (step, id)
+    double uniform(const std::uint64_t step, const std::uint32_t id) const;
+private:
+    static double to_uniform(const std::uint32_t hi, const std::uint32_t lo);
+
+    std::uint32_t key0;
+    std::uint32_t key1;
+};
+
+Philox::Philox(const std::uint64_t init_seed)
+    : key0(static_cast<std::uint32_t>(init_seed)), key1(static_cast<std::uint32_t>(init_seed >> 32))
+{}
+
+std::array<std::uint32_t,4> Philox::generate(const std::uint64_t step, const std::uint32_t id, const std::uint32_t block) const {
+    const std::uint32_t M0 = 0xD2511F53;
+    const std::uint32_t M1 = 0xCD9E8D57;
+    const std::uint32_t W0 = 0x9E3779B9;
+    const std::uint32_t W1 = 0xBB67AE85;
+    std::uint32_t c0 = static_cast<std::uint32_t>(step);
+    std::uint32_t c1 = static_cast<std::uint32_t>(step >> 32);
+    std::uint32_t c2 = id;
+    std::uint32_t c3 = block;
+    std::uint32_t k0 = key0;
+    std::uint32_t k1 = key1;
+    for (int round = 0; round < 10; ++round) {
+        const std::uint64_t p0 = static_cast<std::uint64_t>(M0)*c0;
+        const std::uint64_t p1 = static_cast<std::uint64_t>(M1)*c2;
+        const std::uint32_t hi0 = static_cast<std::uint32_t>(p0 >> 32);
+        const std::uint32_t lo0 = static_cast<std::uint32_t>(p0);
+        const std::uint32_t hi1 = static_cast<std::uint32_t>(p1 >> 32);
+        const std::uint32_t lo1 = static_cast<std::uint32_t>(p1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += W0;
+        k1 += W1;
+    }
+    return {c0, c1, c2, c3};
+}
+
+void Philox::normals(const std::uint64_t step, const int begin, const int end, const int* ids, double* nx, double* ny, double* nz, double* u_scratch) const {
+    for (int idx = begin; idx < end; ++idx) {
+        const auto a = generate(step, ids[idx], 0);
+        const auto b = generate(step, ids[idx], 1);
+        nx[idx] = to_uniform(a[0], a[1]);
+        ny[idx] = to_uniform(a[2], a[3]);
+        nz[idx] = to_uniform(b[0], b[1]);
+        u_scratch[idx-begin] = to_uniform(b[2], b[3]);
+    }
+    // Box-Muller
+    const double two_pi = 2.0*3.14159265358979323846;
+    for (int idx = begin; idx < end; ++idx) {
+        const double r_xy = std::sqrt(-2.0*std::log(nx[idx]));
+        const double r_z = std::sqrt(-2.0*std::log(nz[idx]));
+        const double theta_xy = two_pi*ny[idx];
+        const double theta_z = two_pi*u_scratch[idx-begin];
+        nx[idx] = r_xy*std::cos(theta_xy);
+        ny[idx] = r_xy*std::sin(theta_xy);
+        nz[idx] = r_z*std::cos(theta_z);
+    }
+}
+
+double Philox::uniform(const std::uint64_t step, const std::uint32_t id) const {
+    const auto r = generate(step, id, 0);
+    return to_uniform(r[0], r[1]);
+}
+
+double Philox::to_uniform(const std::uint32_t hi, const std::uint32_t lo) {
+    // 53 random bits mapped to (0, 1], so log() never sees zero
+    const std::uint64_t bits = ((static_cast<std::uint64_t>(hi) << 32) | lo) >> 11;
+    return (bits + 1)*(1.0/9007199254740992.0);
+}
+} // smd
+
+#endif
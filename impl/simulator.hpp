@@ -1,96 +1,306 @@
 #ifndef SIMULATOR_HPP
 #define SIMULATOR_HPP
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <random>
 #include "constants.hpp"
+#include "./particle_store.hpp"
 #include "./water.hpp"
 #include "./soap.hpp"
+#include "./thread_pool.hpp"
 #include "./step_calculator.hpp"
+#include "./trajectory.hpp"
+#include "./checkpoint.hpp"
+#include "./config.hpp"
+#include "./telemetry.hpp"
+#include "./lattice.hpp"
+#include "./micelle.hpp"
 
 namespace smd {
 class Simulator {
 public:
-    Simulator();
-    void run();
+    // init_name prefixes every console line, to tell replicas of an Ensemble apart
+    Simulator(const Config& init_config, ThreadPool& init_pool, const std::string& init_name = "");
+    // restart: continue from config.simulator.checkpoint_path instead of relaxing the initial configuration
+    void run(const bool restart = false);
+    // run() in pieces, for drivers that act between steps (ReplicaExchange): start() opens the outputs and relaxes or
+    // restores the system, advance() runs the steps before loop_end (output, analysis and checkpoints included),
+    // finish() closes the outputs
+    void start(const bool restart = false);
+    void advance(const int loop_end);
+    void finish();
+    // the first step advance() runs next
+    int get_loop_idx() const;
+    double potential_energy();
+    // trades configurations with other, a Simulator of the same system at another temperature (StepCalculator::exchange)
+    void exchange(Simulator& other);
 private:
     void step();
+    void write_checkpoint(const int loop_idx) const;
+    int read_checkpoint();
     void write_log(std::ofstream& out, const int loop_idx);
-    void init_waters();
-    void init_soaps();
-    std::vector<Water> waters;
-    std::vector<Soap> soaps;
+    // cuts the text log at path before its first frame of resume_step or later (MicelleLog and TrajectoryWriter do the
+    // same on a restart), so the frames written after the checkpoint are not there twice
+    static void truncate_log(const std::string& path, const int resume_step);
+    void report(const int loop_idx, const TrajectoryWriter* writer) const;
+    // one write per line, so lines of concurrent replicas do not interleave
+    void print(const std::string& line) const;
+    Config config;
+    std::string name;
+    ParticleStore store;
+    ThreadPool& pool;
     StepCalculator step_calculator;
 
+    static constexpr std::uint32_t CHECKPOINT_VERSION = 4;
     std::mt19937 random_engine;
-    std::uniform_real_distribution<double> init_coord_dist;
+
+    // state of a started run
+    int first_loop_idx = 0;
+    int loop_idx = 0;
+    std::ofstream out;
+    std::unique_ptr<TrajectoryWriter> writer;
+    MicelleAnalyzer micelle_analyzer;
+    std::unique_ptr<MicelleLog> micelle_log;
+    // only set in SMD_TELEMETRY builds
+    std::unique_ptr<Telemetry> telemetry;
 };
 
-Simulator::Simulator()
-    : random_engine(simulator::SEED), init_coord_dist(-(simulator::SPHERE_SIZE-10.0), simulator::SPHERE_SIZE-10.0)
+Simulator::Simulator(const Config& init_config, ThreadPool& init_pool, const std::string& init_name)
+    : config(init_config), name(init_name),
+      store(init_config.water_bead_num(), init_config.simulator.soap_num, init_config.topology(), {water::WEIGHT, init_config.soap.head_weight, init_config.soap.tail_weight}),
+      pool(init_pool), step_calculator(init_pool, init_config), random_engine(init_config.simulator.seed),
+      micelle_analyzer(init_config.simulator.micelle_cutoff, init_config.simulator.micelle_min_size)
 {
-    init_waters();
-    init_soaps();
+    init_configuration(config, store, random_engine);
 }
 
-void Simulator::run() {
-    std::ofstream out(simulator::OUT_PATH);
-    if (!out) {
-        std::cerr << "cannot create: " << simulator::OUT_PATH << std::endl;
-        std::exit(1);
+void Simulator::run(const bool restart) {
+    start(restart);
+    advance(config.simulator.loop_num);
+    finish();
+}
+
+void Simulator::start(const bool restart) {
+    first_loop_idx = restart ? read_checkpoint() : 0;
+    loop_idx = first_loop_idx;
+    if (config.simulator.ascii_log) {
+        if (restart) truncate_log(config.simulator.out_path, first_loop_idx);
+        out.open(config.simulator.out_path, restart ? std::ios::app : std::ios::trunc);
+        if (!out) {
+            std::cerr << "cannot create: " << config.simulator.out_path << std::endl;
+            std::exit(1);
+        }
+        if (!restart) {
+            out << "<meta>\n";
+            out << "water_num " << store.get_water_num() << "\n";
+            out << "soap_num " << store.get_soap_num() << "\n";
+            out << "</meta>\n";
+        }
+    } else {
+        writer.reset(new TrajectoryWriter(config.simulator.trajectory_path, store.get_water_num(), store.get_soap_num(), store.get_topology().bead_num(),
+            static_cast<TrajectoryEncoding>(trajectory::ENCODING), trajectory::QUANTUM, trajectory::QUEUE_CAPACITY, restart ? first_loop_idx : -1));
+    }
+    if (config.simulator.micelle_step_num > 0 && store.get_soap_num() > 0) {
+        micelle_log.reset(new MicelleLog(config.simulator.micelle_path, restart ? first_loop_idx : -1));
     }
-    out << "<meta>" << std::endl;
-    out << "water_num " << simulator::WATER_NUM << std::endl;
-    out << "soap_num " << simulator::SOAP_NUM << std::endl;
-    out << "</meta>" << std::endl;
-    for (int relax_idx = 0; relax_idx < simulator::RELAX_STEP_NUM; ++relax_idx) {
-        const auto [relaxed_waters, relaxed_soaps] = step_calculator.relax(waters, soaps);
-        waters = relaxed_waters;
-        soaps = relaxed_soaps;
+    // the trajectory depends on the thread count (the order of the pair force reduction), so it is part of the header
+    print(std::string("pair kernel: ") + simd_level_name(step_calculator.get_simd_level()) + " threads: " + std::to_string(pool.get_thread_num()));
+    SMD_TELEMETRY_ONLY(
+        telemetry.reset(new Telemetry(config.simulator.telemetry_path, config.step_dt()));
+        step_calculator.set_telemetry(telemetry.get());
+    )
+    if (!restart) {
+        SMD_TELEMETRY_SCOPE(telemetry.get(), Phase::RELAX);
+        const MinimizeResult result = step_calculator.minimize(store, config.simulator.relax_step_num);
+        std::ostringstream line;
+        line << "minimize: " << result.iteration_num << " iterations, max force " << result.max_force << ", energy " << result.energy;
+        if (!result.converged) line << " (not converged)";
+        print(line.str());
     }
-    for (int loop_idx = 0; loop_idx < simulator::LOOP_NUM; ++loop_idx) {
-        if (loop_idx % simulator::SAVE_STEP_NUM == 0) {
-            write_log(out, loop_idx);
+}
+
+void Simulator::advance(const int loop_end) {
+    for (; loop_idx < loop_end; ++loop_idx) {
+        if (loop_idx % config.simulator.save_step_num == 0) {
+            SMD_TELEMETRY_SCOPE(telemetry.get(), Phase::OUTPUT);
+            if (writer) {
+                writer->write(store, loop_idx);
+            } else {
+                write_log(out, loop_idx);
+            }
+            report(loop_idx, writer.get());
+        }
+        if (micelle_log && loop_idx % config.simulator.micelle_step_num == 0) {
+            SMD_TELEMETRY_SCOPE(telemetry.get(), Phase::ANALYSIS);
+            micelle_log->write(loop_idx, micelle_analyzer.analyze(store, step_calculator.neighbors(store)));
+        }
+        // the restart point itself is not saved again
+        const int checkpoint_step_num = config.simulator.checkpoint_step_num;
+        if (checkpoint_step_num > 0 && loop_idx % checkpoint_step_num == 0 && loop_idx != first_loop_idx) {
+            SMD_TELEMETRY_SCOPE(telemetry.get(), Phase::CHECKPOINT);
+            if (writer) writer->flush();
+            out.flush();
+            write_checkpoint(loop_idx);
         }
         step();
+        SMD_TELEMETRY_ONLY(
+            if (config.simulator.telemetry_step_num > 0 && (loop_idx+1) % config.simulator.telemetry_step_num == 0) telemetry->sample(loop_idx+1);
+        )
     }
 }
 
+void Simulator::finish() {
+    SMD_TELEMETRY_ONLY(
+        step_calculator.set_telemetry(nullptr);
+        print(telemetry->summary());
+        telemetry.reset();
+    )
+    writer.reset();
+    micelle_log.reset();
+    if (out.is_open()) out.close();
+}
+
+int Simulator::get_loop_idx() const {
+    return loop_idx;
+}
+
+double Simulator::potential_energy() {
+    return step_calculator.potential_energy(store);
+}
+
+void Simulator::exchange(Simulator& other) {
+    step_calculator.exchange(store, other.step_calculator, other.store);
+}
+
 void Simulator::step() {
-    const auto [new_waters, new_soaps] = step_calculator.calc(waters, soaps, random_engine);
-    waters = new_waters;
-    soaps = new_soaps;
+    step_calculator.calc(store);
+}
+
+void Simulator::write_checkpoint(const int loop_idx) const {
+    // checkpoint layout: "SMDCKPT\0", u32 version, u32 sizeof(real), i32 thread_num, i32 loop_idx, mt19937 state as text,
+    // then ParticleStore::save and StepCalculator::save.
+    // Written to a temporary file and renamed over the old one, so a crash mid-write keeps the previous checkpoint.
+    const std::string& path = config.simulator.checkpoint_path;
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out) {
+        std::cerr << "cannot create: " << tmp_path << std::endl;
+        std::exit(1);
+    }
+    out.write("SMDCKPT\0", 8);
+    write_field(out, CHECKPOINT_VERSION);
+    write_field(out, static_cast<std::uint32_t>(sizeof(real)));
+    write_field(out, pool.get_thread_num());
+    write_field(out, loop_idx);
+    std::ostringstream engine_state;
+    engine_state << random_engine;
+    write_string(out, engine_state.str());
+    store.save(out);
+    step_calculator.save(out);
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "cannot write: " << path << std::endl;
+        std::exit(1);
+    }
+}
+
+int Simulator::read_checkpoint() {
+    const std::string& path = config.simulator.checkpoint_path;
+    std::ifstream in(path, std::ios::binary);
+    char magic[8];
+    std::uint32_t version;
+    if (!in || !in.read(magic, 8) || std::memcmp(magic, "SMDCKPT", 8) != 0) {
+        std::cerr << "not a checkpoint: " << path << std::endl;
+        std::exit(1);
+    }
+    read_field(in, version);
+    if (version != CHECKPOINT_VERSION) {
+        std::cerr << "unsupported checkpoint version: " << version << std::endl;
+        std::exit(1);
+    }
+    std::uint32_t real_size;
+    read_field(in, real_size);
+    if (real_size != sizeof(real)) {
+        // the stored positions and forces are read as raw arrays of real
+        std::cerr << "checkpoint written with " << 8*real_size << "-bit positions, this build uses " << 8*sizeof(real) << std::endl;
+        std::exit(1);
+    }
+    int thread_num;
+    int loop_idx;
+    read_field(in, thread_num);
+    read_field(in, loop_idx);
+    if (thread_num != pool.get_thread_num()) {
+        // the noise does not depend on it, but the force reduction order does
+        std::cerr << "warning: checkpoint written with " << thread_num << " threads, running with " << pool.get_thread_num()
+                  << "; the continuation will not be bit-identical" << std::endl;
+    }
+    std::string engine_state;
+    read_string(in, engine_state);
+    std::istringstream(engine_state) >> random_engine;
+    store.load(in);
+    step_calculator.load(in, store);
+    print("restart from step: " + std::to_string(loop_idx));
+    return loop_idx;
 }
 
 void Simulator::write_log(std::ofstream& out, const int loop_idx) {
-    out << "<frame " << loop_idx << ">" << std::endl;
-    out << "<waters>" << std::endl;
-    for (const auto& water: waters) {
-        out << water.atom.coord[0] << " " << water.atom.coord[1] << " " << water.atom.coord[2] << std::endl;
+    // '\n' rather than std::endl: one flush per frame instead of one per line
+    out << "<frame " << loop_idx << ">\n";
+    out << "<waters>\n";
+    for (int water_idx = 0; water_idx < store.get_water_num(); ++water_idx) {
+        const auto c = Water(store, water_idx).atom.coord();
+        out << c[0] << " " << c[1] << " " << c[2] << "\n";
     }
-    out << "</waters>" << std::endl;
-    out << "<soaps>" << std::endl;
-    for (const auto& soap: soaps) {
-        out << soap.head.coord[0] << " " << soap.head.coord[1] << " " << soap.head.coord[2] << " " << soap.tail.coord[0] << " " << soap.tail.coord[1] << " " << soap.tail.coord[2] << std::endl;
+    out << "</waters>\n";
+    out << "<soaps>\n";
+    for (int soap_idx = 0; soap_idx < store.get_soap_num(); ++soap_idx) {
+        // one line per soap: xyz of every bead, head first
+        const Soap soap(store, soap_idx);
+        for (std::size_t bead_idx = 0; bead_idx < soap.beads.size(); ++bead_idx) {
+            const auto c = soap.beads[bead_idx].coord();
+            out << (bead_idx == 0 ? "" : " ") << c[0] << " " << c[1] << " " << c[2];
+        }
+        out << "\n";
     }
-    out << "</soaps>" << std::endl;
+    out << "</soaps>\n";
     out << "</frame>" << std::endl;
-    std::cout << "step: " << loop_idx << std::endl;
 }
 
-void Simulator::init_waters() {
-    for (int water_idx = 0; water_idx < simulator::WATER_NUM; ++water_idx) {
-        waters.push_back(Water(init_coord_dist(random_engine), init_coord_dist(random_engine), init_coord_dist(random_engine), random_engine));
+void Simulator::truncate_log(const std::string& path, const int resume_step) {
+    std::ifstream in(path);
+    if (!in) return;
+    const std::string key = "<frame ";
+    std::streamoff keep_size = -1;
+    for (std::string line; ; ) {
+        const std::streamoff offset = in.tellg();
+        if (!std::getline(in, line)) break;
+        if (line.compare(0, key.size(), key) == 0 && std::atol(line.c_str() + key.size()) >= resume_step) {
+            keep_size = offset;
+            break;
+        }
     }
+    in.close();
+    if (keep_size >= 0) std::filesystem::resize_file(path, keep_size);
 }
 
-void Simulator::init_soaps() {
-    for (int soap_idx = 0; soap_idx < simulator::SOAP_NUM; ++soap_idx) {
-        soaps.push_back(Soap(init_coord_dist(random_engine), init_coord_dist(random_engine), init_coord_dist(random_engine), random_engine));
-    }
+void Simulator::report(const int loop_idx, const TrajectoryWriter* writer) const {
+    std::ostringstream line;
+    line << "step: " << loop_idx << " allocations: " << step_calculator.get_allocation_num();
+    if (writer) line << " writer stalls: " << writer->get_stall_num();
+    print(line.str());
+}
+
+void Simulator::print(const std::string& line) const {
+    std::cout << (name.empty() ? line : "[" + name + "] " + line) + "\n" << std::flush;
 }
 
 } // smd
@@ -1,24 +1,27 @@
 #ifndef SOAP_HPP
 #define SOAP_HPP
 
-#include "./constants.hpp"
-#include "particle.hpp"
-#include <random>
+#include "./particle_store.hpp"
+#include <vector>
 
 namespace smd {
 class Soap {
 public:
-    Soap(const double init_x, const double init_y, const double init_z, std::mt19937& random_engine);
-    Particle head;
-    Particle tail;
-    std::normal_distribution<double> head_dist;
-    std::normal_distribution<double> tail_dist;
+    Soap(ParticleStore& store, const int soap_idx);
+    ParticleRef head;
+    ParticleRef tail;
+    // the whole chain, head first
+    std::vector<ParticleRef> beads;
 };
 
-Soap::Soap(const double init_x, const double init_y, const double init_z, std::mt19937& random_engine)
-    : head_dist(0.0, step_calculator::SOAP_HEAD_STD), tail_dist(0.0, step_calculator::SOAP_TAIL_STD), head(init_x-soap::SPRING_R0/2.0, init_y, init_z, soap::HEAD_WEIGHT, head_dist(random_engine), head_dist(random_engine), head_dist(random_engine)), tail(init_x+soap::SPRING_R0/2.0, init_y, init_z, soap::TAIL_WEIGHT, tail_dist(random_engine), tail_dist(random_engine), tail_dist(random_engine))
-{}
+Soap::Soap(ParticleStore& store, const int soap_idx)
+    : head(store, store.head_index(soap_idx)), tail(store, store.tail_index(soap_idx))
+{
+    for (int bead_idx = 0; bead_idx < store.get_topology().bead_num(); ++bead_idx) {
+        beads.emplace_back(store, store.bead_index(soap_idx, bead_idx));
+    }
+}
 
 } // smd
 
-#endif
\ No newline at end of file
+#endif
@@ -1,232 +1,767 @@
 #ifndef STEP_CALCULATOR_HPP
 #define STEP_CALCULATOR_HPP
 
-#include "./water.hpp"
-#include "./soap.hpp"
+#include "./particle_store.hpp"
 #include "./particle.hpp"
+#include "./neighbor_list.hpp"
+#include "./buffer.hpp"
+#include "./thread_pool.hpp"
+#include "./philox.hpp"
+#include "./interaction_table.hpp"
+#include "./pair_kernel.hpp"
+#include "./checkpoint.hpp"
+#include "./config.hpp"
+#include "./telemetry.hpp"
+#include "./morton.hpp"
 #include "constants.hpp"
-#include <tuple>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
 #include <vector>
-#include <random>
+#include <utility>
 
 namespace smd {
+enum Integrator { LANGEVIN, BROWNIAN };
+
+struct MinimizeResult {
+    int iteration_num;
+    // largest per-particle force and total energy of the soft start-up potential at the final positions
+    double max_force;
+    double energy;
+    bool converged;
+};
+
 class StepCalculator {
 public:
-    StepCalculator();
-    std::tuple<std::vector<Water>,std::vector<Soap>> calc(const std::vector<Water>& waters, const std::vector<Soap>& soaps, std::mt19937& random_engine);
-    std::tuple<std::vector<Water>,std::vector<Soap>> relax(const std::vector<Water>& waters, const std::vector<Soap>& soaps);
+    StepCalculator(ThreadPool& init_pool, const Config& init_config);
+    // one step of RESPA_STEP_NUM*DT: with RESPA_STEP_NUM > 1, the non-bonded pair forces are applied as half kicks
+    // around RESPA_STEP_NUM Langevin steps of DT under the bonded terms and the wall alone (r-RESPA, Tuckerman et al. 1992)
+    // With INTEGRATOR = BROWNIAN, one overdamped step of DT instead: the large-friction limit of the same equation
+    // of motion with the same noise, x += (DT/GAMMA)*(F/m + r). It evaluates the forces once, keeps no velocities
+    // (store.v* is released) and uses store.r* as noise scratch.
+    // With REORDER_STEP_NUM > 0, every that many steps the particles are first sorted along a Morton curve
+    // (ParticleStore::reorder) and the neighbor list is rebuilt in the new order.
+    void calc(ParticleStore& store);
+    // FIRE minimization of the soft start-up potential (soft repulsion, bonded terms, linear wall); stops when no force
+    // exceeds MINIMIZE_FTOL, when the energy change falls below MINIMIZE_ETOL, or after max_iteration_num iterations.
+    // Leaves the velocities at zero. With REORDER_STEP_NUM > 0 the particles are sorted first.
+    MinimizeResult minimize(ParticleStore& store, const int max_iteration_num);
+    void invalidate_forces();
+    // the neighbor list, brought up to date with the current positions; for in-situ analyses between steps
+    const NeighborList& neighbors(const ParticleStore& store);
+    // pair terms (as tabulated, FMAX clamp included), bonded terms and wall at the current positions
+    double potential_energy(const ParticleStore& store);
+    // replica exchange: trades the configuration in store, with its cached forces, for the one in other_store of other,
+    // a StepCalculator of the same system at another temperature. The velocities and the last noise draw of each
+    // configuration are scaled by sqrt(T_new/T_old) of the bath temperatures (Config::bath_kbt), which is also the ratio
+    // of the noise amplitudes of every species. Both neighbor lists are rebuilt.
+    void exchange(ParticleStore& store, StepCalculator& other, ParticleStore& other_store);
+    long get_allocation_num() const;
+    SimdLevel get_simd_level() const;
+    // step counter, force cache, next sort step and neighbor list; with ParticleStore::save this is the whole integrator state
+    void save(std::ostream& out) const;
+    void load(std::istream& in, const ParticleStore& store);
+    // nullptr: no recording (the hooks only exist in SMD_TELEMETRY builds)
+    void set_telemetry(Telemetry* init_telemetry);
 private:
-    std::array<double,3> calc_watar_force(const int water_idx, const std::vector<Water>& waters, const std::vector<Soap>& soaps);
-    std::array<double,3> calc_soap_head_force(const int soap_idx, const std::vector<Water>& waters, const std::vector<Soap>& soaps);
-    std::array<double,3> calc_soap_tail_force(const int soap_idx, const std::vector<Water>& waters, const std::vector<Soap>& soaps);
+    // one Langevin step of DT; new_forces() puts the forces at the moved positions into new_f*
+    template <typename NewForces>
+    void langevin_step(ParticleStore& store, const NewForces& new_forces);
+    void brownian_step(ParticleStore& store);
+    void slow_kick(ParticleStore& store, const double dt);
+    // sorts the particles along a Morton curve of the neighbor list box and rebuilds the list in the new order
+    void reorder(ParticleStore& store);
+    void update_neighbor_list(const ParticleStore& store);
+    void accumulate_nonbonded(const ParticleStore& store);
+    // all forces, the non-bonded ones only, and the per-particle ones (bonded terms and wall) only
+    void calc_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz);
+    void calc_slow_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz);
+    void calc_fast_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz);
+    // the bonded pass: every bond and angle of the flat ParticleStore arrays in one loop each, with independent
+    // iterations writing bond_f*/angle_f*, then summed per particle into bonded_f* serially in term order (and their
+    // energies into bonded_energy, given with_energy). Bond forces are capped at FMAX, and so is the spring energy
+    // (linear beyond |r - r0| = FMAX/k); the angle terms are not.
+    void calc_bonded(const ParticleStore& store, const bool with_energy);
+    // bonded_f* of the last calc_bonded and the wall
+    void add_local_forces(const ParticleStore& store, const int idx, std::array<double,3>& f) const;
+    std::array<double,3> calc_pair_force(const ParticleStore& store, const int idx, const int other_idx) const;
+    // forces of the start-up potential into new_f*; returns its energy
+    double calc_minimize_forces(ParticleStore& store);
+    bool is_clamped(const double dUdr, const double r) const;
+#ifdef SMD_TELEMETRY
+    void count_pairs(const ParticleStore& store);
+#endif
+    template <typename ChunkForce>
+    void accumulate_forces(const ParticleStore& store, const ChunkForce& chunk_force);
+    // pair_force(thread_idx, idx, other_idx) returns the force on idx
+    template <typename PairForce>
+    void accumulate_pair_forces(const ParticleStore& store, const PairForce& pair_force);
+    template <typename Extra>
+    void reduce_pair_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz, const Extra& extra);
 
-    std::normal_distribution<double> water_dist;
-    std::normal_distribution<double> soap_head_dist;
-    std::normal_distribution<double> soap_tail_dist;
+    ThreadPool& pool;
+    Config config;
+    std::array<double,SPECIES_NUM> noise_std;
+    Philox philox;
+    // Langevin noise of step n is drawn from counter (n, particle id), independent of thread count and order
+    long step_count = 0;
 
-    //const double water_std = ((2.0*step_calculator::GAMMA*step_calculator::KBT)/water::WEIGHT)/step_calculator::DT;
-    //const double soap_head_std = ((2.0*step_calculator::GAMMA*step_calculator::KBT)/soap::HEAD_WEIGHT)/step_calculator::DT;
-    //const double soap_tail_std = ((2.0*step_calculator::GAMMA*step_calculator::KBT)/soap::TAIL_WEIGHT)/step_calculator::DT;
+    NeighborList neighbor_list;
+    InteractionTable interaction_table;
+    SimdLevel simd_level;
+    PairKernel pair_kernel;
+
+    // store.f* holds the forces at the positions left by the last calc() and is reused as the old forces of the next step;
+    // new_f* is its double buffer, swapped in at the end of every step. new_r* does the same for the noise.
+    std::vector<real> new_fx, new_fy, new_fz;
+    std::vector<double> new_rx, new_ry, new_rz;
+    std::vector<double> noise_scratch;
+    // bonded pass: per bond, per angle (the forces on its two outer beads; the middle one gets minus their sum), and per particle
+    std::vector<double> bond_fx, bond_fy, bond_fz, bond_energy;
+    std::vector<double> angle_fax, angle_fay, angle_faz, angle_fcx, angle_fcy, angle_fcz, angle_energy;
+    std::vector<double> bonded_fx, bonded_fy, bonded_fz, bonded_energy;
+    // RESPA only: store.f* then holds the fast forces and slow_f* the non-bonded ones at the current positions.
+    // slow_f* is not checkpointed; it is recomputed after a restart, which gives the same bits.
+    std::vector<real> slow_fx, slow_fy, slow_fz;
+    bool slow_forces_valid = false;
+    long next_reorder_step = 0;
+    std::vector<std::uint64_t> reorder_keys;
+    std::vector<int> reorder_order;
+    // per-thread pair force accumulators covering [chunk begin, window end) of the neighbor list; double in every build
+    std::vector<std::vector<double>> thread_fx, thread_fy, thread_fz;
+    std::vector<long> thread_allocation_num;
+    // per-thread partial sums of minimize(), added in thread order
+    std::vector<std::array<double,4>> thread_sums;
+    bool forces_valid = false;
+    long allocation_num = 0;
+    Telemetry* telemetry = nullptr;
 };
 
-StepCalculator::StepCalculator()
-    : water_dist(0.0, step_calculator::WATER_STD), soap_head_dist(0.0, step_calculator::SOAP_HEAD_STD), soap_tail_dist(0.0, step_calculator::SOAP_TAIL_STD)
-    //: water_dist(0.0, ((2.0*step_calculator::GAMMA*step_calculator::KBT)/water::WEIGHT)/step_calculator::DT),
-    //    soap_head_dist(0.0, ((2.0*step_calculator::GAMMA*step_calculator::KBT)/soap::HEAD_WEIGHT)/step_calculator::DT),
-    //    soap_tail_dist(0.0, ((2.0*step_calculator::GAMMA*step_calculator::KBT)/soap::TAIL_WEIGHT)/step_calculator::DT)
+StepCalculator::StepCalculator(ThreadPool& init_pool, const Config& init_config)
+    : pool(init_pool),
+      config(init_config),
+      noise_std{init_config.water_std(), init_config.soap_head_std(), init_config.soap_tail_std()},
+      philox(init_config.simulator.seed),
+      neighbor_list(init_config.neighbor_cutoff(), init_config.step_calculator.neighbor_skin, init_config.simulator.sphere_size + init_config.neighbor_cutoff()),
+      interaction_table(interaction_table::DR, init_config),
+      simd_level(init_config.step_calculator.simd_kernel ? detect_simd_level() : SimdLevel::SCALAR),
+      pair_kernel(select_pair_kernel(simd_level))
 {}
 
-std::tuple<std::vector<Water>,std::vector<Soap>> StepCalculator::calc(const std::vector<Water>& waters, const std::vector<Soap>& soaps, std::mt19937& random_engine) {
-    const double coef = 1.0 - (step_calculator::GAMMA*step_calculator::DT)/2.0;
-    auto new_waters = waters;
-    auto new_soaps = soaps;
-
-    std::vector<std::array<double,3>> water_forces_old;
-    for (int water_idx = 0; water_idx < waters.size(); ++water_idx) {
-        const auto f = calc_watar_force(water_idx, waters, soaps);
-        water_forces_old.push_back(f);
-    }
-
-    std::vector<std::array<double,3>> soap_head_forces_old;
-    for (int soap_idx = 0; soap_idx < soaps.size(); ++soap_idx) {
-        const auto f = calc_soap_head_force(soap_idx, waters, soaps);
-        soap_head_forces_old.push_back(f);
-    }
-
-    std::vector<std::array<double,3>> soap_tail_forces_old;
-    for (int soap_idx = 0; soap_idx < soaps.size(); ++soap_idx) {
-        const auto f = calc_soap_tail_force(soap_idx, waters, soaps);
-        soap_tail_forces_old.push_back(f);
-    }
-    for (int water_idx = 0; water_idx < waters.size(); ++water_idx) {
-        //std::cout << waters[water_idx].atom.random_memory[0] << std::endl;
-        new_waters[water_idx].atom.coord += (step_calculator::DT*coef)*waters[water_idx].atom.velo + (0.5*step_calculator::DT*step_calculator::DT)*((1.0/water::WEIGHT)*water_forces_old[water_idx] + waters[water_idx].atom.random_memory);
+void StepCalculator::calc(ParticleStore& store) {
+    const int respa_step_num = config.step_calculator.respa_step_num;
+    if (config.step_calculator.reorder_step_num > 0 && step_count >= next_reorder_step) {
+        reorder(store);
     }
-
-    for (int soap_idx = 0; soap_idx < soaps.size(); ++soap_idx) {
-        new_soaps[soap_idx].head.coord += (step_calculator::DT*coef)*soaps[soap_idx].head.velo + (0.5*step_calculator::DT*step_calculator::DT)*((1.0/soap::HEAD_WEIGHT)*soap_head_forces_old[soap_idx] + soaps[soap_idx].head.random_memory);
-        new_soaps[soap_idx].tail.coord += (step_calculator::DT*coef)*soaps[soap_idx].tail.velo + (0.5*step_calculator::DT*step_calculator::DT)*((1.0/soap::TAIL_WEIGHT)*soap_tail_forces_old[soap_idx] + soaps[soap_idx].tail.random_memory);
-    }
-
-    for (int water_idx = 0; water_idx < waters.size(); ++water_idx) {
-        const std::array<double,3> new_random_memory = {water_dist(random_engine), water_dist(random_engine), water_dist(random_engine)};
-        new_waters[water_idx].atom.velo = (coef * (coef + std::pow((step_calculator::GAMMA*step_calculator::DT)/2.0, 2.0)))*waters[water_idx].atom.velo + (step_calculator::DT/2.0)*((1.0/water::WEIGHT)*water_forces_old[water_idx]+(1.0/water::WEIGHT)*calc_watar_force(water_idx, new_waters, new_soaps) + waters[water_idx].atom.random_memory + new_random_memory);
-        new_waters[water_idx].atom.random_memory = new_random_memory;
-    }
-
-    for (int soap_idx = 0; soap_idx < soaps.size(); ++soap_idx) {
-        const std::array<double,3> new_head_random_memory = {soap_head_dist(random_engine), soap_head_dist(random_engine), soap_head_dist(random_engine)};
-        const std::array<double,3> new_tail_random_memory = {soap_tail_dist(random_engine), soap_tail_dist(random_engine), soap_tail_dist(random_engine)};
-        new_soaps[soap_idx].head.velo = (coef * (coef + std::pow((step_calculator::GAMMA*step_calculator::DT)/2.0, 2.0)))*soaps[soap_idx].head.velo + (step_calculator::DT/2.0)*((1.0/soap::HEAD_WEIGHT)*soap_head_forces_old[soap_idx]+(1.0/soap::HEAD_WEIGHT)*calc_soap_head_force(soap_idx, new_waters, new_soaps) + soaps[soap_idx].head.random_memory + new_head_random_memory);
-        new_soaps[soap_idx].tail.velo = (coef * (coef + std::pow((step_calculator::GAMMA*step_calculator::DT)/2.0, 2.0)))*soaps[soap_idx].tail.velo + (step_calculator::DT/2.0)*((1.0/soap::TAIL_WEIGHT)*soap_tail_forces_old[soap_idx]+(1.0/soap::TAIL_WEIGHT)*calc_soap_tail_force(soap_idx, new_waters, new_soaps) + soaps[soap_idx].tail.random_memory + new_tail_random_memory);
-        new_soaps[soap_idx].head.random_memory = new_head_random_memory;
-        new_soaps[soap_idx].tail.random_memory = new_tail_random_memory;
+    if (config.step_calculator.integrator == BROWNIAN) {
+        brownian_step(store);
+    } else if (respa_step_num <= 1) {
+        if (!forces_valid || static_cast<int>(store.fx.size()) != store.size()) {
+            calc_forces(store, store.fx, store.fy, store.fz);
+        }
+        langevin_step(store, [&] { calc_forces(store, new_fx, new_fy, new_fz); });
+    } else {
+        if (!forces_valid || static_cast<int>(store.fx.size()) != store.size()) {
+            calc_fast_forces(store, store.fx, store.fy, store.fz);
+        }
+        if (!slow_forces_valid || static_cast<int>(slow_fx.size()) != store.size()) {
+            calc_slow_forces(store, slow_fx, slow_fy, slow_fz);
+        }
+        const double half_dt = 0.5*respa_step_num*config.step_calculator.dt;
+        slow_kick(store, half_dt);
+        for (int inner_idx = 0; inner_idx < respa_step_num; ++inner_idx) {
+            langevin_step(store, [&] { calc_fast_forces(store, new_fx, new_fy, new_fz); });
+        }
+        calc_slow_forces(store, slow_fx, slow_fy, slow_fz);
+        slow_forces_valid = true;
+        slow_kick(store, half_dt);
     }
-    //const auto diff = new_waters[0].atom.coord - waters[0].atom.coord;
-    //std::cout << norm(diff) << std::endl;
-    //const auto diff_n = norm(diff);
-    //std::cout << diff_n << std::endl;
-    //if (norm(diff) > 1.0) {
-    //    std::cerr << "diverse position diff." << std::endl;
-    //    std::exit(1);
-    //}
-    return std::make_tuple(new_waters, new_soaps);
+    SMD_TELEMETRY_ADD(telemetry, Counter::STEPS, 1);
 }
 
-std::tuple<std::vector<Water>,std::vector<Soap>> StepCalculator::relax(const std::vector<Water>& waters, const std::vector<Soap>& soaps) {
-    auto new_waters = waters;
-    auto new_soaps = soaps;
-    for (int water_idx = 0; water_idx < waters.size(); ++water_idx) {
-        std::array<double,3> force = {0.0, 0.0, 0.0};
-        for (int other_water_idx = 0; other_water_idx < waters.size(); ++other_water_idx) {
-            if (water_idx == other_water_idx) continue;
-            const auto f = waters[water_idx].atom.calc_soft_repulsive(waters[other_water_idx].atom, step_calculator::SOFT_REPULSIVE_D);
-            force += f;
+template <typename NewForces>
+void StepCalculator::langevin_step(ParticleStore& store, const NewForces& new_forces) {
+    const double dt = config.step_calculator.dt;
+    const double gamma = config.friction();
+    const double coef = 1.0 - (gamma*dt)/2.0;
+    const double velo_coef = coef * (coef + std::pow((gamma*dt)/2.0, 2.0));
+
+    {
+        SMD_TELEMETRY_SCOPE(telemetry, Phase::INTEGRATE);
+        pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+            for (int idx = begin; idx < end; ++idx) {
+                const double inv_weight = 1.0/store.weight(idx);
+                store.x[idx] += (dt*coef)*store.vx[idx] + (0.5*dt*dt)*(inv_weight*store.fx[idx] + store.rx[idx]);
+                store.y[idx] += (dt*coef)*store.vy[idx] + (0.5*dt*dt)*(inv_weight*store.fy[idx] + store.ry[idx]);
+                store.z[idx] += (dt*coef)*store.vz[idx] + (0.5*dt*dt)*(inv_weight*store.fz[idx] + store.rz[idx]);
+            }
+        });
+    }
+
+    new_forces();
+
+    fit_buffer(new_rx, store.size(), 0.0, allocation_num);
+    fit_buffer(new_ry, store.size(), 0.0, allocation_num);
+    fit_buffer(new_rz, store.size(), 0.0, allocation_num);
+    fit_buffer(noise_scratch, store.size(), 0.0, allocation_num);
+
+    // the noise draws run inside the velocity loop; thread 0's share of them is booked as the noise phase
+    SMD_TELEMETRY_ONLY(const auto velocity_start = Telemetry::Clock::now(); double noise_seconds = 0.0;)
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        SMD_TELEMETRY_ONLY(const auto noise_start = Telemetry::Clock::now();)
+        philox.normals(step_count, begin, end, store.id.data(), new_rx.data(), new_ry.data(), new_rz.data(), noise_scratch.data() + begin);
+        SMD_TELEMETRY_ONLY(if (thread_idx == 0) noise_seconds = Telemetry::seconds_since(noise_start);)
+        for (int idx = begin; idx < end; ++idx) {
+            const double inv_weight = 1.0/store.weight(idx);
+            const double std = noise_std[store.species[idx]];
+            new_rx[idx] *= std;
+            new_ry[idx] *= std;
+            new_rz[idx] *= std;
+            store.vx[idx] = velo_coef*store.vx[idx] + (dt/2.0)*(inv_weight*store.fx[idx] + inv_weight*new_fx[idx] + store.rx[idx] + new_rx[idx]);
+            store.vy[idx] = velo_coef*store.vy[idx] + (dt/2.0)*(inv_weight*store.fy[idx] + inv_weight*new_fy[idx] + store.ry[idx] + new_ry[idx]);
+            store.vz[idx] = velo_coef*store.vz[idx] + (dt/2.0)*(inv_weight*store.fz[idx] + inv_weight*new_fz[idx] + store.rz[idx] + new_rz[idx]);
         }
-        for (const auto& soap : soaps) {
-            const auto f_head = waters[water_idx].atom.calc_soft_repulsive(soap.head, step_calculator::SOFT_REPULSIVE_D);
-            const auto f_tail = waters[water_idx].atom.calc_soft_repulsive(soap.tail, step_calculator::SOFT_REPULSIVE_D);
-            force += f_head;
-            force += f_tail;
+    });
+    SMD_TELEMETRY_ONLY(if (telemetry) {
+        telemetry->add_time(Phase::NOISE, noise_seconds);
+        telemetry->add_time(Phase::INTEGRATE, Telemetry::seconds_since(velocity_start) - noise_seconds);
+    })
+
+    std::swap(store.fx, new_fx);
+    std::swap(store.fy, new_fy);
+    std::swap(store.fz, new_fz);
+    std::swap(store.rx, new_rx);
+    std::swap(store.ry, new_ry);
+    std::swap(store.rz, new_rz);
+    forces_valid = true;
+    ++step_count;
+}
+
+void StepCalculator::brownian_step(ParticleStore& store) {
+    const double dt = config.step_calculator.dt;
+    const double gamma = config.friction();
+    const double max_move = config.step_calculator.brownian_max_move;
+    if (!forces_valid || static_cast<int>(store.fx.size()) != store.size()) {
+        calc_forces(store, store.fx, store.fy, store.fz);
+    }
+    if (!store.vx.empty()) store.release_velocities();
+    fit_buffer(noise_scratch, store.size(), 0.0, allocation_num);
+
+    SMD_TELEMETRY_ONLY(const auto position_start = Telemetry::Clock::now(); double noise_seconds = 0.0;)
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        SMD_TELEMETRY_ONLY(const auto noise_start = Telemetry::Clock::now();)
+        philox.normals(step_count, begin, end, store.id.data(), store.rx.data(), store.ry.data(), store.rz.data(), noise_scratch.data() + begin);
+        SMD_TELEMETRY_ONLY(if (thread_idx == 0) noise_seconds = Telemetry::seconds_since(noise_start);)
+        for (int idx = begin; idx < end; ++idx) {
+            const double noise = (dt/gamma)*noise_std[store.species[idx]];
+            auto drift = (dt/(gamma*store.weight(idx)))*std::array<double,3>{store.fx[idx], store.fy[idx], store.fz[idx]};
+            // without inertia a capped FMAX force would move a bead dt*FMAX/(gamma*m) at once, through the excluded core
+            const double n = norm(drift);
+            if (n > max_move) drift = (max_move/n)*drift;
+            store.x[idx] += drift[0] + noise*store.rx[idx];
+            store.y[idx] += drift[1] + noise*store.ry[idx];
+            store.z[idx] += drift[2] + noise*store.rz[idx];
         }
-        //force = force / (norm(force)+1e-6);
-        if (norm(waters[water_idx].atom.coord) > simulator::SPHERE_SIZE) {
-            force += -step_calculator::SPHERE_COEF*(waters[water_idx].atom.coord/norm(waters[water_idx].atom.coord));
+    });
+    SMD_TELEMETRY_ONLY(if (telemetry) {
+        telemetry->add_time(Phase::NOISE, noise_seconds);
+        telemetry->add_time(Phase::INTEGRATE, Telemetry::seconds_since(position_start) - noise_seconds);
+    })
+
+    calc_forces(store, store.fx, store.fy, store.fz);
+    forces_valid = true;
+    ++step_count;
+}
+
+void StepCalculator::slow_kick(ParticleStore& store, const double dt) {
+    SMD_TELEMETRY_SCOPE(telemetry, Phase::INTEGRATE);
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        for (int idx = begin; idx < end; ++idx) {
+            const double inv_weight = 1.0/store.weight(idx);
+            store.vx[idx] += (dt*inv_weight)*slow_fx[idx];
+            store.vy[idx] += (dt*inv_weight)*slow_fy[idx];
+            store.vz[idx] += (dt*inv_weight)*slow_fz[idx];
         }
-        const auto diff = step_calculator::RELAX_COEF*force;
-        new_waters[water_idx].atom.coord += diff;
-    }
+    });
+}
+
+MinimizeResult StepCalculator::minimize(ParticleStore& store, const int max_iteration_num) {
+    // FIRE (Bitzek et al., PRL 97, 170201 (2006)) with unit masses and semi-implicit Euler steps;
+    // store.v* holds the FIRE velocities, new_f* the forces.
+    const int N_MIN = 5;
+    const double F_INC = 1.1;
+    const double F_DEC = 0.5;
+    const double ALPHA_START = 0.1;
+    const double F_ALPHA = 0.99;
+    const auto& cfg = config.step_calculator;
+    const int thread_num = pool.get_thread_num();
 
-    for (int soap_idx = 0; soap_idx < soaps.size(); ++soap_idx) {
-        std::array<double,3> force_head = {0.0, 0.0, 0.0};
-        std::array<double,3> force_tail = {0.0, 0.0, 0.0};
-        for (const auto& water : waters) {
-            const auto f_head = soaps[soap_idx].head.calc_soft_repulsive(water.atom, step_calculator::SOFT_REPULSIVE_D);
-            const auto f_tail = soaps[soap_idx].tail.calc_soft_repulsive(water.atom, step_calculator::SOFT_REPULSIVE_D);
-            force_head += f_head;
-            force_tail += f_tail;
+    if (cfg.reorder_step_num > 0) reorder(store);
+    invalidate_forces();
+    // assign rather than fill: the velocities may have been released by a Brownian run
+    store.vx.assign(store.size(), 0.0);
+    store.vy.assign(store.size(), 0.0);
+    store.vz.assign(store.size(), 0.0);
+    fit_buffer(thread_sums, thread_num, std::array<double,4>{}, allocation_num);
+    double dt = cfg.fire_dt;
+    double alpha = ALPHA_START;
+    int positive_num = 0;
+    double last_energy = 0.0;
+    MinimizeResult result = {0, 0.0, 0.0, false};
+    for (;; ++result.iteration_num) {
+        result.energy = calc_minimize_forces(store);
+        // sums of F.v, |F|^2 and |v|^2, and the largest |F|^2
+        pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+            std::array<double,4> sums = {0.0, 0.0, 0.0, 0.0};
+            for (int idx = begin; idx < end; ++idx) {
+                const double f2 = new_fx[idx]*new_fx[idx] + new_fy[idx]*new_fy[idx] + new_fz[idx]*new_fz[idx];
+                sums[0] += new_fx[idx]*store.vx[idx] + new_fy[idx]*store.vy[idx] + new_fz[idx]*store.vz[idx];
+                sums[1] += f2;
+                sums[2] += store.vx[idx]*store.vx[idx] + store.vy[idx]*store.vy[idx] + store.vz[idx]*store.vz[idx];
+                sums[3] = std::max(sums[3], f2);
+            }
+            thread_sums[thread_idx] = sums;
+        });
+        double power = 0.0;
+        double f2_sum = 0.0;
+        double v2_sum = 0.0;
+        double f2_max = 0.0;
+        for (const auto& sums : thread_sums) {
+            power += sums[0];
+            f2_sum += sums[1];
+            v2_sum += sums[2];
+            f2_max = std::max(f2_max, sums[3]);
         }
-        for (int other_soap_idx = 0; other_soap_idx < soaps.size(); ++other_soap_idx) {
-            if (soap_idx == other_soap_idx) continue;
-            std::array<double,3> f_head = {0.0, 0.0, 0.0};
-            std::array<double,3> f_tail = {0.0, 0.0, 0.0};
-            f_head += soaps[soap_idx].head.calc_soft_repulsive(soaps[other_soap_idx].head, step_calculator::SOFT_REPULSIVE_D);
-            f_head += soaps[soap_idx].head.calc_soft_repulsive(soaps[other_soap_idx].tail, step_calculator::SOFT_REPULSIVE_D);
-            f_tail += soaps[soap_idx].tail.calc_soft_repulsive(soaps[other_soap_idx].head, step_calculator::SOFT_REPULSIVE_D);
-            f_tail += soaps[soap_idx].tail.calc_soft_repulsive(soaps[other_soap_idx].tail, step_calculator::SOFT_REPULSIVE_D);
-            force_head += f_head;
-            force_tail += f_tail;
+        result.max_force = std::sqrt(f2_max);
+        // energy criterion as in LAMMPS: |dE| <= etol*(|E| + |E_last|)/2, checked on downhill steps only
+        const bool energy_converged = result.iteration_num > 0 && power > 0.0
+            && std::abs(result.energy - last_energy) <= cfg.minimize_etol*0.5*(std::abs(result.energy) + std::abs(last_energy) + 1e-300);
+        if (result.max_force <= cfg.minimize_ftol || energy_converged) {
+            result.converged = true;
+            break;
         }
-        //force_head = force_head / (norm(force_head)+1e-6);
-        //force_tail = force_tail / (norm(force_tail)+1e-6);
-        if (norm(soaps[soap_idx].head.coord) > simulator::SPHERE_SIZE) {
-            force_head += -step_calculator::SPHERE_COEF*(soaps[soap_idx].head.coord/norm(soaps[soap_idx].head.coord));
+        if (result.iteration_num >= max_iteration_num) break;
+        last_energy = result.energy;
+
+        double mix_v = 1.0;
+        double mix_f = 0.0;
+        if (power > 0.0) {
+            mix_v = 1.0 - alpha;
+            mix_f = f2_sum > 0.0 ? alpha*std::sqrt(v2_sum/f2_sum) : 0.0;
+            if (++positive_num > N_MIN) {
+                dt = std::min(dt*F_INC, cfg.fire_dt_max);
+                alpha *= F_ALPHA;
+            }
+        } else {
+            mix_v = 0.0;
+            dt *= F_DEC;
+            alpha = ALPHA_START;
+            positive_num = 0;
         }
-        if (norm(soaps[soap_idx].tail.coord) > simulator::SPHERE_SIZE) {
-            force_tail += -step_calculator::SPHERE_COEF*(soaps[soap_idx].tail.coord/norm(soaps[soap_idx].tail.coord));
+        pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+            for (int idx = begin; idx < end; ++idx) {
+                const std::array<double,3> f = {new_fx[idx], new_fy[idx], new_fz[idx]};
+                auto v = mix_v*store.velo(idx) + mix_f*f;
+                v += dt*f;
+                auto dx = dt*v;
+                // a capped step cannot carry a particle through a soft shell in one go
+                const double n = norm(dx);
+                if (n > cfg.fire_max_move) dx = (cfg.fire_max_move/n)*dx;
+                store.set_velo(idx, v);
+                store.set_coord(idx, store.coord(idx) + dx);
+            }
+        });
+    }
+    std::fill(store.vx.begin(), store.vx.end(), 0.0);
+    std::fill(store.vy.begin(), store.vy.end(), 0.0);
+    std::fill(store.vz.begin(), store.vz.end(), 0.0);
+    return result;
+}
+
+void StepCalculator::invalidate_forces() {
+    forces_valid = false;
+    slow_forces_valid = false;
+}
+
+long StepCalculator::get_allocation_num() const {
+    return allocation_num + neighbor_list.get_allocation_num();
+}
+
+SimdLevel StepCalculator::get_simd_level() const {
+    return simd_level;
+}
+
+void StepCalculator::save(std::ostream& out) const {
+    write_field(out, step_count);
+    write_field(out, forces_valid);
+    write_field(out, next_reorder_step);
+    neighbor_list.save(out);
+}
+
+void StepCalculator::load(std::istream& in, const ParticleStore& store) {
+    read_field(in, step_count);
+    read_field(in, forces_valid);
+    read_field(in, next_reorder_step);
+    neighbor_list.load(in, store, pool);
+}
+
+void StepCalculator::set_telemetry(Telemetry* init_telemetry) {
+    telemetry = init_telemetry;
+}
+
+double StepCalculator::calc_minimize_forces(ParticleStore& store) {
+    const double soft_d = config.step_calculator.soft_repulsive_d;
+    const double soft_a = config.particle.soft_repulsive_a;
+    const double sphere_size = config.simulator.sphere_size;
+    const double sphere_coef = config.step_calculator.sphere_coef;
+    const int thread_num = pool.get_thread_num();
+    update_neighbor_list(store);
+
+    // thread_sums[*][0] collects the pair energy here, before minimize() reuses it
+    for (auto& sums : thread_sums) sums[0] = 0.0;
+    accumulate_pair_forces(store, [&](const int thread_idx, const int idx, const int other_idx) {
+        const std::array<double,3> v_12 = {store.x[idx] - store.x[other_idx], store.y[idx] - store.y[other_idx], store.z[idx] - store.z[other_idx]};
+        const double r = norm(v_12);
+        const double dUdr = Particle::soft_repulsive_dUdr(r, soft_d, soft_a);
+        SMD_TELEMETRY_ONLY(if (is_clamped(dUdr, r)) SMD_TELEMETRY_ADD(telemetry, Counter::CLAMPED_FORCES, 1);)
+        if (r < soft_d) thread_sums[thread_idx][0] += soft_a*soft_d*(soft_d - r);
+        return Particle::calc_force(v_12, dUdr, config.particle.fmax);
+    });
+    double energy = 0.0;
+    for (int thread_idx = 0; thread_idx < thread_num; ++thread_idx) {
+        energy += thread_sums[thread_idx][0];
+    }
+    calc_bonded(store, true);
+    reduce_pair_forces(store, new_fx, new_fy, new_fz, [&](const int idx, std::array<double,3>& f) {
+        f += std::array<double,3>{bonded_fx[idx], bonded_fy[idx], bonded_fz[idx]};
+        const auto c = store.coord(idx);
+        const double n = norm(c);
+        if (n > sphere_size) {
+            f += -sphere_coef*(c/n);
         }
-        const auto diff_head = step_calculator::RELAX_COEF*force_head;
-        const auto diff_tail = step_calculator::RELAX_COEF*force_tail;
-        new_soaps[soap_idx].head.coord += diff_head;
-        new_soaps[soap_idx].tail.coord += diff_tail;
+    });
+    // the bonded and wall energies, serially so that the sum does not depend on the thread count
+    for (int idx = 0; idx < store.size(); ++idx) {
+        energy += bonded_energy[idx];
+        const double n = norm(store.coord(idx));
+        if (n > sphere_size) energy += sphere_coef*(n - sphere_size);
+    }
+    return energy;
+}
 
-        const auto spring_force_head = soaps[soap_idx].head.calc_spring(soaps[soap_idx].tail, soap::SPRING_K, soap::SPRING_R0);
-        const auto spring_force_tail = soaps[soap_idx].tail.calc_spring(soaps[soap_idx].head, soap::SPRING_K, soap::SPRING_R0);
+void StepCalculator::reorder(ParticleStore& store) {
+    SMD_TELEMETRY_SCOPE(telemetry, Phase::NEIGHBOR);
+    const double box_size = config.simulator.sphere_size + config.neighbor_cutoff();
+    morton_order(store, box_size, reorder_keys, reorder_order, allocation_num);
+    store.reorder(reorder_order, allocation_num);
+    // store.f* moved with the particles; slow_f* did not, and the old list names old indices
+    slow_forces_valid = false;
+    neighbor_list.build(store, pool);
+    next_reorder_step = step_count + config.step_calculator.reorder_step_num;
+    SMD_TELEMETRY_ADD(telemetry, Counter::NEIGHBOR_REBUILDS, 1);
+    SMD_TELEMETRY_ADD(telemetry, Counter::REORDERS, 1);
+}
 
-        const auto spring_diff_head = step_calculator::RELAX_SPRING_COEF*spring_force_head;
-        const auto spring_diff_tail = step_calculator::RELAX_SPRING_COEF*spring_force_tail;
+void StepCalculator::update_neighbor_list(const ParticleStore& store) {
+    SMD_TELEMETRY_SCOPE(telemetry, Phase::NEIGHBOR);
+    SMD_TELEMETRY_ONLY(const int rebuild_num = neighbor_list.get_rebuild_num();)
+    neighbor_list.update(store, pool);
+    SMD_TELEMETRY_ADD(telemetry, Counter::NEIGHBOR_REBUILDS, neighbor_list.get_rebuild_num() - rebuild_num);
+}
+
+const NeighborList& StepCalculator::neighbors(const ParticleStore& store) {
+    update_neighbor_list(store);
+    return neighbor_list;
+}
 
-        new_soaps[soap_idx].head.coord += spring_diff_head;
-        new_soaps[soap_idx].tail.coord += spring_diff_tail;
+double StepCalculator::potential_energy(const ParticleStore& store) {
+    update_neighbor_list(store);
+    calc_bonded(store, true);
+    const double r_max = interaction_table.get_r_max();
+    const double sphere_size = config.simulator.sphere_size;
+    double energy = 0.0;
+    for (int idx = 0; idx < store.size(); ++idx) {
+        const auto c = store.coord(idx);
+        for (const int* other = neighbor_list.begin(idx); other != neighbor_list.end(idx); ++other) {
+            const double r = norm(c - store.coord(*other));
+            if (r < r_max) energy += interaction_table.energy(interaction_table.pair_index(store.species[idx], store.species[*other]), r);
+        }
+        energy += bonded_energy[idx];
+        const double n = norm(c);
+        if (n > sphere_size) energy += (n - sphere_size)*(n - sphere_size);
     }
-    return std::make_tuple(new_waters, new_soaps);
+    return energy;
 }
 
-std::array<double,3> StepCalculator::calc_watar_force(const int water_idx, const std::vector<Water>& waters, const std::vector<Soap>& soaps) {
-    std::array<double,3> force = {0.0, 0.0, 0.0};
-    for (int other_water_idx = 0; other_water_idx < waters.size(); ++other_water_idx) {
-        if (water_idx == other_water_idx) continue;
-        force += waters[water_idx].atom.calc_LennardJones(waters[other_water_idx].atom, step_calculator::WATER_EPSILON, step_calculator::WATER_SIGMA);
-        force += waters[water_idx].atom.calc_excluded(waters[other_water_idx].atom, step_calculator::EXCLUDED_D);
+void StepCalculator::exchange(ParticleStore& store, StepCalculator& other, ParticleStore& other_store) {
+    std::swap(store, other_store);
+    std::swap(forces_valid, other.forces_valid);
+    std::swap(slow_forces_valid, other.slow_forces_valid);
+    std::swap(slow_fx, other.slow_fx);
+    std::swap(slow_fy, other.slow_fy);
+    std::swap(slow_fz, other.slow_fz);
+    // a Brownian run keeps no velocities and only uses store.r* as scratch
+    const auto rescale = [](ParticleStore& moved, const StepCalculator& to, const StepCalculator& from) {
+        const double scale = std::sqrt(to.config.bath_kbt()/from.config.bath_kbt());
+        for (int idx = 0; idx < moved.size(); ++idx) {
+            moved.vx[idx] *= scale;
+            moved.vy[idx] *= scale;
+            moved.vz[idx] *= scale;
+            moved.rx[idx] *= scale;
+            moved.ry[idx] *= scale;
+            moved.rz[idx] *= scale;
+        }
+    };
+    if (config.step_calculator.integrator == LANGEVIN) {
+        rescale(store, *this, other);
+        rescale(other_store, other, *this);
     }
+    neighbor_list.build(store, pool);
+    other.neighbor_list.build(other_store, other.pool);
+}
 
-    for (const auto& soap: soaps) {
-        force += waters[water_idx].atom.calc_LennardJones(soap.head, step_calculator::WATER_HEAD_EPSILON, step_calculator::WATER_HEAD_SIGMA);
-        force += waters[water_idx].atom.calc_repulsive(soap.tail, step_calculator::WATER_TAIL_COEF);
-        //force += waters[water_idx].atom.calc_excluded(soap.tail, step_calculator::EXCLUDED_D);
-        force += waters[water_idx].atom.calc_excluded(soap.head, step_calculator::EXCLUDED_D);
-        force += waters[water_idx].atom.calc_excluded(soap.tail, step_calculator::EXCLUDED_D);
+void StepCalculator::accumulate_nonbonded(const ParticleStore& store) {
+    SMD_TELEMETRY_ONLY(count_pairs(store);)
+    if (pair_kernel) {
+        accumulate_forces(store, [&](const int thread_idx, const int begin, const int end, double* tfx, double* tfy, double* tfz) {
+            pair_kernel(store, interaction_table, neighbor_list, begin, end, tfx, tfy, tfz, begin);
+        });
+    } else {
+        accumulate_pair_forces(store, [&](const int thread_idx, const int idx, const int other_idx) {
+            return calc_pair_force(store, idx, other_idx);
+        });
     }
+}
 
-    force += waters[water_idx].atom.calc_sphere();
+void StepCalculator::calc_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz) {
+    update_neighbor_list(store);
+    SMD_TELEMETRY_SCOPE(telemetry, Phase::FORCE);
+    accumulate_nonbonded(store);
+    calc_bonded(store, false);
+    reduce_pair_forces(store, fx, fy, fz, [&](const int idx, std::array<double,3>& f) {
+        add_local_forces(store, idx, f);
+    });
+}
 
-    return force;
+void StepCalculator::calc_slow_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz) {
+    update_neighbor_list(store);
+    SMD_TELEMETRY_SCOPE(telemetry, Phase::FORCE);
+    accumulate_nonbonded(store);
+    reduce_pair_forces(store, fx, fy, fz, [](const int idx, std::array<double,3>& f) {});
 }
 
-std::array<double,3> StepCalculator::calc_soap_head_force(const int soap_idx, const std::vector<Water>& waters, const std::vector<Soap>& soaps) {
-    std::array<double,3> force = {0.0, 0.0, 0.0};
-    for (const auto& water: waters) {
-        force += soaps[soap_idx].head.calc_LennardJones(water.atom, step_calculator::WATER_HEAD_EPSILON, step_calculator::WATER_HEAD_SIGMA);
-        force += soaps[soap_idx].head.calc_excluded(water.atom, step_calculator::EXCLUDED_D);
-    }
+void StepCalculator::calc_fast_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz) {
+    SMD_TELEMETRY_SCOPE(telemetry, Phase::FORCE);
+    fit_buffer(fx, store.size(), real(0), allocation_num);
+    fit_buffer(fy, store.size(), real(0), allocation_num);
+    fit_buffer(fz, store.size(), real(0), allocation_num);
+    calc_bonded(store, false);
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        for (int idx = begin; idx < end; ++idx) {
+            std::array<double,3> f = {0.0, 0.0, 0.0};
+            add_local_forces(store, idx, f);
+            fx[idx] = f[0];
+            fy[idx] = f[1];
+            fz[idx] = f[2];
+        }
+    });
+}
 
-    for (int other_soap_idx = 0; other_soap_idx < soaps.size(); ++other_soap_idx) {
-        if (soap_idx == other_soap_idx) continue;
-        force += soaps[soap_idx].head.calc_LennardJones(soaps[other_soap_idx].head, step_calculator::HEAD_HEAD_EPSILON, step_calculator::HEAD_HEAD_SIGMA);
-        force += soaps[soap_idx].head.calc_repulsive(soaps[other_soap_idx].tail, step_calculator::HEAD_TAIL_COEF);
-        //force += soaps[soap_idx].head.calc_excluded(soaps[other_soap_idx].tail, step_calculator::EXCLUDED_D);
-        force += soaps[soap_idx].head.calc_excluded(soaps[other_soap_idx].head, step_calculator::EXCLUDED_D);
-        force += soaps[soap_idx].head.calc_excluded(soaps[other_soap_idx].tail, step_calculator::EXCLUDED_D);
+void StepCalculator::calc_bonded(const ParticleStore& store, const bool with_energy) {
+    const double k = config.soap.spring_k;
+    const double r0 = config.soap.spring_r0;
+    const double fmax = config.particle.fmax;
+    const double angle_k = config.soap.angle_k;
+    const double cos0 = std::cos(config.soap.angle_theta0*3.141592653589793/180.0);
+    const int bond_num = store.bond_a.size();
+    const int angle_num = angle_k > 0.0 ? store.angle_a.size() : 0;
+    for (auto* v : {&bond_fx, &bond_fy, &bond_fz, &bond_energy}) {
+        fit_buffer(*v, bond_num, 0.0, allocation_num);
+    }
+    for (auto* v : {&angle_fax, &angle_fay, &angle_faz, &angle_fcx, &angle_fcy, &angle_fcz, &angle_energy}) {
+        fit_buffer(*v, angle_num, 0.0, allocation_num);
+    }
+    for (auto* v : {&bonded_fx, &bonded_fy, &bonded_fz, &bonded_energy}) {
+        fit_buffer(*v, store.size(), 0.0, allocation_num);
     }
 
-    force += soaps[soap_idx].head.calc_spring(soaps[soap_idx].tail, soap::SPRING_K, soap::SPRING_R0);
-    force += soaps[soap_idx].head.calc_sphere();
+    pool.parallel_for(bond_num, [&](const int thread_idx, const int begin, const int end) {
+        for (int bond_idx = begin; bond_idx < end; ++bond_idx) {
+            const auto v_12 = store.coord(store.bond_a[bond_idx]) - store.coord(store.bond_b[bond_idx]);
+            const double r = norm(v_12);
+            const double dUdr = Particle::spring_dUdr(r, k, r0);
+            SMD_TELEMETRY_ONLY(if (is_clamped(dUdr, r)) SMD_TELEMETRY_ADD(telemetry, Counter::CLAMPED_FORCES, 1);)
+            const auto f = Particle::calc_force(v_12, dUdr, fmax);
+            bond_fx[bond_idx] = f[0];
+            bond_fy[bond_idx] = f[1];
+            bond_fz[bond_idx] = f[2];
+            if (with_energy) {
+                const double d = std::abs(r - r0);
+                bond_energy[bond_idx] = k*d <= fmax ? 0.5*k*d*d : fmax*d - 0.5*fmax*fmax/k;
+            }
+        }
+    });
+    // U = 0.5*ANGLE_K*(cos(theta) - cos(theta0))^2, smooth also at a straight chain
+    pool.parallel_for(angle_num, [&](const int thread_idx, const int begin, const int end) {
+        for (int angle_idx = begin; angle_idx < end; ++angle_idx) {
+            const auto center = store.coord(store.angle_b[angle_idx]);
+            std::array<double,3> f_a;
+            std::array<double,3> f_c;
+            const double cos_theta = Particle::calc_angle(store.coord(store.angle_a[angle_idx]) - center,
+                store.coord(store.angle_c[angle_idx]) - center, angle_k, cos0, f_a, f_c);
+            angle_fax[angle_idx] = f_a[0];
+            angle_fay[angle_idx] = f_a[1];
+            angle_faz[angle_idx] = f_a[2];
+            angle_fcx[angle_idx] = f_c[0];
+            angle_fcy[angle_idx] = f_c[1];
+            angle_fcz[angle_idx] = f_c[2];
+            if (with_energy) angle_energy[angle_idx] = 0.5*angle_k*(cos_theta - cos0)*(cos_theta - cos0);
+        }
+    });
+
+    // scatter in term order, so the sums do not depend on the thread count; every bond's energy goes to its first bead
+    for (int bond_idx = 0; bond_idx < bond_num; ++bond_idx) {
+        const int a = store.bond_a[bond_idx];
+        const int b = store.bond_b[bond_idx];
+        bonded_fx[a] += bond_fx[bond_idx];
+        bonded_fy[a] += bond_fy[bond_idx];
+        bonded_fz[a] += bond_fz[bond_idx];
+        bonded_fx[b] -= bond_fx[bond_idx];
+        bonded_fy[b] -= bond_fy[bond_idx];
+        bonded_fz[b] -= bond_fz[bond_idx];
+        bonded_energy[a] += bond_energy[bond_idx];
+    }
+    for (int angle_idx = 0; angle_idx < angle_num; ++angle_idx) {
+        const int a = store.angle_a[angle_idx];
+        const int b = store.angle_b[angle_idx];
+        const int c = store.angle_c[angle_idx];
+        bonded_fx[a] += angle_fax[angle_idx];
+        bonded_fy[a] += angle_fay[angle_idx];
+        bonded_fz[a] += angle_faz[angle_idx];
+        bonded_fx[c] += angle_fcx[angle_idx];
+        bonded_fy[c] += angle_fcy[angle_idx];
+        bonded_fz[c] += angle_fcz[angle_idx];
+        bonded_fx[b] -= angle_fax[angle_idx] + angle_fcx[angle_idx];
+        bonded_fy[b] -= angle_fay[angle_idx] + angle_fcy[angle_idx];
+        bonded_fz[b] -= angle_faz[angle_idx] + angle_fcz[angle_idx];
+        bonded_energy[b] += angle_energy[angle_idx];
+    }
+}
 
-    return force;
+void StepCalculator::add_local_forces(const ParticleStore& store, const int idx, std::array<double,3>& f) const {
+    f += std::array<double,3>{bonded_fx[idx], bonded_fy[idx], bonded_fz[idx]};
+    const auto c = store.coord(idx);
+    const auto n = norm(c);
+    // the wall only acts outside the sphere; inside, c/n is NaN for a bead at the center (a lattice site)
+    if (n > config.simulator.sphere_size) f += -Particle::sphere_dUdr(n, config.simulator.sphere_size)*(c/n);
 }
 
-std::array<double,3> StepCalculator::calc_soap_tail_force(const int soap_idx, const std::vector<Water>& waters, const std::vector<Soap>& soaps) {
-    std::array<double,3> force = {0.0, 0.0, 0.0};
-    for (const auto& water: waters) {
-        force += soaps[soap_idx].tail.calc_repulsive(water.atom, step_calculator::WATER_TAIL_COEF);
-        //force += soaps[soap_idx].tail.calc_excluded(water.atom, step_calculator::EXCLUDED_D);
-        force += soaps[soap_idx].tail.calc_excluded(water.atom, step_calculator::EXCLUDED_D);
+template <typename ChunkForce>
+void StepCalculator::accumulate_forces(const ParticleStore& store, const ChunkForce& chunk_force) {
+    const int thread_num = pool.get_thread_num();
+    if (static_cast<int>(thread_fx.size()) != thread_num) {
+        thread_fx.resize(thread_num);
+        thread_fy.resize(thread_num);
+        thread_fz.resize(thread_num);
+        ++allocation_num;
     }
-
-    for (int other_soap_idx = 0; other_soap_idx < soaps.size(); ++other_soap_idx) {
-        if (soap_idx == other_soap_idx) continue;
-        force += soaps[soap_idx].tail.calc_repulsive(soaps[other_soap_idx].head, step_calculator::HEAD_TAIL_COEF);
-        //force += soaps[soap_idx].tail.calc_excluded(soaps[other_soap_idx].head, step_calculator::EXCLUDED_D);
-        force += soaps[soap_idx].tail.calc_LennardJones(soaps[other_soap_idx].tail, step_calculator::TAIL_TAIL_EPSILON, step_calculator::TAIL_TAIL_SIGMA);
-        force += soaps[soap_idx].tail.calc_excluded(soaps[other_soap_idx].head, step_calculator::EXCLUDED_D);
-        force += soaps[soap_idx].tail.calc_excluded(soaps[other_soap_idx].tail, step_calculator::EXCLUDED_D);
+    fit_buffer(thread_allocation_num, thread_num, 0L, allocation_num);
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        const int window = neighbor_list.get_window_end(thread_idx) - begin;
+        auto& tfx = thread_fx[thread_idx];
+        auto& tfy = thread_fy[thread_idx];
+        auto& tfz = thread_fz[thread_idx];
+        fit_buffer(tfx, window, 0.0, thread_allocation_num[thread_idx]);
+        fit_buffer(tfy, window, 0.0, thread_allocation_num[thread_idx]);
+        fit_buffer(tfz, window, 0.0, thread_allocation_num[thread_idx]);
+        chunk_force(thread_idx, begin, end, tfx.data(), tfy.data(), tfz.data());
+    });
+    for (int thread_idx = 0; thread_idx < thread_num; ++thread_idx) {
+        allocation_num += thread_allocation_num[thread_idx];
     }
+}
 
-    force += soaps[soap_idx].tail.calc_spring(soaps[soap_idx].head, soap::SPRING_K, soap::SPRING_R0);
-    force += soaps[soap_idx].tail.calc_sphere();
+template <typename PairForce>
+void StepCalculator::accumulate_pair_forces(const ParticleStore& store, const PairForce& pair_force) {
+    accumulate_forces(store, [&](const int thread_idx, const int begin, const int end, double* tfx, double* tfy, double* tfz) {
+        for (int idx = begin; idx < end; ++idx) {
+            for (auto it = neighbor_list.begin(idx); it != neighbor_list.end(idx); ++it) {
+                const auto f = pair_force(thread_idx, idx, *it);
+                tfx[idx-begin] += f[0];
+                tfy[idx-begin] += f[1];
+                tfz[idx-begin] += f[2];
+                tfx[*it-begin] -= f[0];
+                tfy[*it-begin] -= f[1];
+                tfz[*it-begin] -= f[2];
+            }
+        }
+    });
+}
 
-    return force;
+template <typename Extra>
+void StepCalculator::reduce_pair_forces(const ParticleStore& store, std::vector<real>& fx, std::vector<real>& fy, std::vector<real>& fz, const Extra& extra) {
+    const int thread_num = pool.get_thread_num();
+    fit_buffer(fx, store.size(), real(0), allocation_num);
+    fit_buffer(fy, store.size(), real(0), allocation_num);
+    fit_buffer(fz, store.size(), real(0), allocation_num);
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        for (int idx = begin; idx < end; ++idx) {
+            // fixed thread order, so the sum is reproducible for a given thread count
+            std::array<double,3> f = {0.0, 0.0, 0.0};
+            for (int other_thread_idx = 0; other_thread_idx < thread_num; ++other_thread_idx) {
+                const int other_begin = pool.chunk_begin(store.size(), other_thread_idx);
+                if (other_begin > idx) break;
+                if (idx >= neighbor_list.get_window_end(other_thread_idx)) continue;
+                f[0] += thread_fx[other_thread_idx][idx-other_begin];
+                f[1] += thread_fy[other_thread_idx][idx-other_begin];
+                f[2] += thread_fz[other_thread_idx][idx-other_begin];
+            }
+            extra(idx, f);
+            fx[idx] = f[0];
+            fy[idx] = f[1];
+            fz[idx] = f[2];
+        }
+    });
+}
+
+std::array<double,3> StepCalculator::calc_pair_force(const ParticleStore& store, const int idx, const int other_idx) const {
+    const std::array<double,3> v_12 = {store.x[idx] - store.x[other_idx], store.y[idx] - store.y[other_idx], store.z[idx] - store.z[other_idx]};
+    const int pair = interaction_table.pair_index(store.species[idx], store.species[other_idx]);
+    return interaction_table.force_coef(pair, norm(v_12))*v_12;
+}
+
+bool StepCalculator::is_clamped(const double dUdr, const double r) const {
+    // the condition under which Particle::calc_force caps the force
+    return std::abs(dUdr)*(r/(r+1e-6)) > config.particle.fmax;
+}
+
+#ifdef SMD_TELEMETRY
+void StepCalculator::count_pairs(const ParticleStore& store) {
+    // an extra pass over the list, for the pairs inside the cutoff and the ones on a capped table segment
+    const double cutoff2 = interaction_table.get_r_max()*interaction_table.get_r_max();
+    pool.parallel_for(store.size(), [&](const int thread_idx, const int begin, const int end) {
+        long in_cutoff = 0;
+        long clamped = 0;
+        for (int idx = begin; idx < end; ++idx) {
+            for (auto it = neighbor_list.begin(idx); it != neighbor_list.end(idx); ++it) {
+                const int other_idx = *it;
+                const double dx = store.x[idx] - store.x[other_idx];
+                const double dy = store.y[idx] - store.y[other_idx];
+                const double dz = store.z[idx] - store.z[other_idx];
+                const double r2 = dx*dx + dy*dy + dz*dz;
+                const double clamp_r = interaction_table.get_clamp_r(interaction_table.pair_index(store.species[idx], store.species[other_idx]));
+                in_cutoff += r2 < cutoff2;
+                clamped += r2 < clamp_r*clamp_r;
+            }
+        }
+        SMD_TELEMETRY_ADD(telemetry, Counter::PAIRS_IN_CUTOFF, in_cutoff);
+        SMD_TELEMETRY_ADD(telemetry, Counter::CLAMPED_FORCES, clamped);
+    });
+    SMD_TELEMETRY_ADD(telemetry, Counter::PAIRS, neighbor_list.get_pair_num());
 }
+#endif
 } // smd
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,172 @@
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Instrumentation hooks. They expand to nothing unless SMD_TELEMETRY is defined (cmake -DSMD_TELEMETRY=ON),
+// so a default build has no timers, counters or counting passes.
+#ifdef SMD_TELEMETRY
+#define SMD_TELEMETRY_CONCAT_(a, b) a##b
+#define SMD_TELEMETRY_CONCAT(a, b) SMD_TELEMETRY_CONCAT_(a, b)
+// times the rest of the enclosing block as phase
+#define SMD_TELEMETRY_SCOPE(telemetry, phase) const ::smd::Telemetry::Scope SMD_TELEMETRY_CONCAT(smd_telemetry_scope_, __LINE__)(telemetry, phase)
+#define SMD_TELEMETRY_ADD(telemetry, counter, n) do { if (telemetry) (telemetry)->add(counter, n); } while (0)
+#define SMD_TELEMETRY_ONLY(...) __VA_ARGS__
+#else
+#define SMD_TELEMETRY_SCOPE(telemetry, phase) do {} while (0)
+#define SMD_TELEMETRY_ADD(telemetry, counter, n) do {} while (0)
+#define SMD_TELEMETRY_ONLY(...)
+#endif
+
+namespace smd {
+enum class Phase { NEIGHBOR, FORCE, NOISE, INTEGRATE, RELAX, OUTPUT, ANALYSIS, CHECKPOINT, PHASE_NUM };
+enum class Counter { STEPS, PAIRS, PAIRS_IN_CUTOFF, CLAMPED_FORCES, NEIGHBOR_REBUILDS, REORDERS, COUNTER_NUM };
+
+// Per-phase wall times and event counters of one run. sample() appends the values accumulated since the previous
+// sample to the telemetry file: CSV if the path ends in ".csv", one JSON object per line otherwise.
+// Phase times are added from the thread driving the run; counters may be added from any pool thread.
+class Telemetry {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // dt converts steps/s into simulated time per day
+    Telemetry(const std::string& path, const double init_dt);
+    void add_time(const Phase phase, const double seconds);
+    void add(const Counter counter, const long n);
+    void sample(const long step);
+    // totals since construction, one line per phase and counter
+    std::string summary() const;
+    static double seconds_since(const Clock::time_point start);
+
+    class Scope {
+    public:
+        Scope(Telemetry* init_telemetry, const Phase init_phase);
+        ~Scope();
+    private:
+        Telemetry* telemetry;
+        Phase phase;
+        Clock::time_point start;
+    };
+private:
+    static constexpr int PHASE_NUM = static_cast<int>(Phase::PHASE_NUM);
+    static constexpr int COUNTER_NUM = static_cast<int>(Counter::COUNTER_NUM);
+    static const char* phase_name(const int phase);
+    static const char* counter_name(const int counter);
+
+    std::ofstream out;
+    bool csv;
+    double dt;
+    Clock::time_point start;
+    Clock::time_point last_time;
+    std::array<double,PHASE_NUM> phase_seconds{};
+    std::array<double,PHASE_NUM> last_phase_seconds{};
+    std::array<std::atomic<long>,COUNTER_NUM> counters{};
+    std::array<long,COUNTER_NUM> last_counters{};
+};
+
+Telemetry::Telemetry(const std::string& path, const double init_dt)
+    : out(path), csv(path.size() >= 4 && path.compare(path.size()-4, 4, ".csv") == 0), dt(init_dt), start(Clock::now()), last_time(start)
+{
+    if (!out) {
+        std::cerr << "cannot create: " << path << std::endl;
+        std::exit(1);
+    }
+    if (csv) {
+        out << "step,elapsed_s,interval_s";
+        for (int phase = 0; phase < PHASE_NUM; ++phase) out << "," << phase_name(phase) << "_s";
+        out << ",other_s";
+        for (int counter = 0; counter < COUNTER_NUM; ++counter) out << "," << counter_name(counter);
+        out << ",steps_per_s,pairs_per_s,tau_per_day\n";
+    }
+}
+
+void Telemetry::add_time(const Phase phase, const double seconds) {
+    phase_seconds[static_cast<int>(phase)] += seconds;
+}
+
+void Telemetry::add(const Counter counter, const long n) {
+    counters[static_cast<int>(counter)].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Telemetry::sample(const long step) {
+    const auto now = Clock::now();
+    const double interval = std::chrono::duration<double>(now - last_time).count();
+    std::array<double,PHASE_NUM> phases;
+    double other = interval;
+    for (int phase = 0; phase < PHASE_NUM; ++phase) {
+        phases[phase] = phase_seconds[phase] - last_phase_seconds[phase];
+        other -= phases[phase];
+    }
+    std::array<long,COUNTER_NUM> deltas;
+    for (int counter = 0; counter < COUNTER_NUM; ++counter) {
+        const long value = counters[counter].load(std::memory_order_relaxed);
+        deltas[counter] = value - last_counters[counter];
+        last_counters[counter] = value;
+    }
+    last_phase_seconds = phase_seconds;
+    last_time = now;
+
+    const double elapsed = std::chrono::duration<double>(now - start).count();
+    const double steps_per_s = interval > 0.0 ? deltas[static_cast<int>(Counter::STEPS)]/interval : 0.0;
+    const double pairs_per_s = interval > 0.0 ? deltas[static_cast<int>(Counter::PAIRS)]/interval : 0.0;
+    const double tau_per_day = steps_per_s*dt*86400.0;
+    if (csv) {
+        out << step << "," << elapsed << "," << interval;
+        for (const double seconds : phases) out << "," << seconds;
+        out << "," << other;
+        for (const long delta : deltas) out << "," << delta;
+        out << "," << steps_per_s << "," << pairs_per_s << "," << tau_per_day << "\n";
+    } else {
+        out << "{\"step\": " << step << ", \"elapsed_s\": " << elapsed << ", \"interval_s\": " << interval << ", \"phases\": {";
+        for (int phase = 0; phase < PHASE_NUM; ++phase) out << "\"" << phase_name(phase) << "\": " << phases[phase] << ", ";
+        out << "\"other\": " << other << "}, \"counters\": {";
+        for (int counter = 0; counter < COUNTER_NUM; ++counter) out << (counter ? ", " : "") << "\"" << counter_name(counter) << "\": " << deltas[counter];
+        out << "}, \"steps_per_s\": " << steps_per_s << ", \"pairs_per_s\": " << pairs_per_s << ", \"tau_per_day\": " << tau_per_day << "}\n";
+    }
+    out.flush();
+}
+
+std::string Telemetry::summary() const {
+    const double elapsed = seconds_since(start);
+    std::ostringstream text;
+    text << "telemetry: " << elapsed << " s";
+    for (int phase = 0; phase < PHASE_NUM; ++phase) {
+        text << "\n  " << phase_name(phase) << ": " << phase_seconds[phase] << " s (" << (elapsed > 0.0 ? 100.0*phase_seconds[phase]/elapsed : 0.0) << "%)";
+    }
+    for (int counter = 0; counter < COUNTER_NUM; ++counter) {
+        text << "\n  " << counter_name(counter) << ": " << counters[counter].load(std::memory_order_relaxed);
+    }
+    return text.str();
+}
+
+double Telemetry::seconds_since(const Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+const char* Telemetry::phase_name(const int phase) {
+    static const char* names[PHASE_NUM] = {"neighbor", "force", "noise", "integrate", "relax", "output", "analysis", "checkpoint"};
+    return names[phase];
+}
+
+const char* Telemetry::counter_name(const int counter) {
+    static const char* names[COUNTER_NUM] = {"steps", "pairs", "pairs_in_cutoff", "clamped_forces", "neighbor_rebuilds", "reorders"};
+    return names[counter];
+}
+
+Telemetry::Scope::Scope(Telemetry* init_telemetry, const Phase init_phase)
+    : telemetry(init_telemetry), phase(init_phase), start(Clock::now())
+{}
+
+Telemetry::Scope::~Scope() {
+    if (telemetry) telemetry->add_time(phase, seconds_since(start));
+}
+} // smd
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef TEMPERING_HPP
+#define TEMPERING_HPP
+
+#include "./config.hpp"
+#include "./ensemble.hpp"
+#include "./philox.hpp"
+#include "./simulator.hpp"
+#include "./thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace smd {
+// Replica exchange (parallel tempering) over a ladder of temperatures, in one process.
+// Replica k runs the system with seed SEED+k on a single-thread pool of its own, its noise set to hold the bath at
+// T_k = kbts[k] (step_calculator.BATH_KBT; KBT is then unused); the replicas are spread over the threads of one pool and
+// advanced EXCHANGE_STEP_NUM steps at a time. After each block the neighboring pairs of the ladder (the even ones after
+// even blocks, the odd ones after odd blocks) try to trade configurations, with the Metropolis probability
+// min(1, exp((1/T_k - 1/T_k+1)*(E_k - E_k+1))) of the potential energies E. The T are the fixed bath temperatures, the
+// same ones StepCalculator::exchange rescales the velocities of a traded configuration with, so the swaps keep every
+// replica's Boltzmann distribution. The uniform draws are keyed by (step, pair), so a restart from checkpoints taken at
+// a block boundary (CHECKPOINT_STEP_NUM a multiple of EXCHANGE_STEP_NUM) repeats the same decisions.
+// Replica k writes its output files with the name prefix "t<k>_", so every trajectory follows one temperature, and
+// t<k>_config.txt holds its settings. The acceptance rate of every pair is printed at the end.
+class ReplicaExchange {
+public:
+    // kbts: increasing, at least two
+    ReplicaExchange(const Config& base, const std::vector<double>& kbts, const int thread_num);
+    void run(const bool restart);
+private:
+    // fn(replica_idx) for every replica, whole replicas per thread
+    template <typename Fn>
+    void for_each_replica(const Fn& fn);
+    void attempt_exchanges(const int loop_idx);
+
+    std::vector<Config> configs;
+    std::vector<std::string> names;
+    std::vector<std::string> config_paths;
+    ThreadPool pool;
+    // keyed past the seeds of the replicas, so the draws are independent of their noise
+    Philox philox;
+    std::vector<std::unique_ptr<ThreadPool>> serial_pools;
+    std::vector<std::unique_ptr<Simulator>> simulators;
+    std::vector<double> energies;
+    // per pair (k, k+1)
+    std::vector<long> attempt_nums;
+    std::vector<long> accept_nums;
+};
+
+ReplicaExchange::ReplicaExchange(const Config& base, const std::vector<double>& kbts, const int thread_num)
+    : pool(thread_num), philox(base.simulator.seed + kbts.size())
+{
+    const int replica_num = kbts.size();
+    bool increasing = replica_num >= 2 && kbts[0] > 0.0;
+    for (int replica_idx = 1; replica_idx < replica_num; ++replica_idx) {
+        increasing = increasing && kbts[replica_idx] > kbts[replica_idx-1];
+    }
+    if (!increasing || base.friction() <= 0.0) {
+        std::cerr << "replica exchange needs at least two increasing temperatures above 0 and GAMMA > 0" << std::endl;
+        std::exit(1);
+    }
+    for (int replica_idx = 0; replica_idx < replica_num; ++replica_idx) {
+        Config config = base;
+        config.step_calculator.bath_kbt = kbts[replica_idx];
+        config.simulator.seed += replica_idx;
+        config.simulator.thread_num = 1;
+        const std::string name = replica_name('t', replica_idx, replica_num);
+        config_paths.push_back(prefix_outputs(config, name));
+        config.validate();
+        configs.push_back(config);
+        names.push_back(name);
+    }
+    attempt_nums.assign(replica_num - 1, 0);
+    accept_nums.assign(replica_num - 1, 0);
+}
+
+void ReplicaExchange::run(const bool restart) {
+    const int replica_num = configs.size();
+    for (int replica_idx = 0; replica_idx < replica_num; ++replica_idx) {
+        write_config_file(config_paths[replica_idx], configs[replica_idx]);
+        serial_pools.emplace_back(new ThreadPool(1));
+        simulators.emplace_back(new Simulator(configs[replica_idx], *serial_pools[replica_idx], names[replica_idx]));
+    }
+    energies.assign(replica_num, 0.0);
+    for_each_replica([&](const int replica_idx) { simulators[replica_idx]->start(restart); });
+    const int first_loop_idx = simulators[0]->get_loop_idx();
+    for (const auto& simulator : simulators) {
+        if (simulator->get_loop_idx() != first_loop_idx) {
+            std::cerr << "the checkpoints of the replicas are from different steps" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    const int loop_num = configs[0].simulator.loop_num;
+    const int exchange_step_num = configs[0].simulator.exchange_step_num;
+    for (int loop_idx = first_loop_idx; loop_idx < loop_num; ) {
+        const int loop_end = std::min(loop_num, (loop_idx/exchange_step_num + 1)*exchange_step_num);
+        const bool exchange = loop_end < loop_num;
+        for_each_replica([&](const int replica_idx) {
+            simulators[replica_idx]->advance(loop_end);
+            if (exchange) energies[replica_idx] = simulators[replica_idx]->potential_energy();
+        });
+        if (exchange) attempt_exchanges(loop_end);
+        loop_idx = loop_end;
+    }
+    for_each_replica([&](const int replica_idx) { simulators[replica_idx]->finish(); });
+
+    for (int pair_idx = 0; pair_idx + 1 < replica_num; ++pair_idx) {
+        std::ostringstream line;
+        line << "exchange T " << configs[pair_idx].bath_kbt() << " <-> " << configs[pair_idx+1].bath_kbt()
+             << ": " << accept_nums[pair_idx] << "/" << attempt_nums[pair_idx] << " accepted";
+        if (attempt_nums[pair_idx] > 0) line << " (" << 100.0*accept_nums[pair_idx]/attempt_nums[pair_idx] << "%)";
+        std::cout << line.str() + "\n" << std::flush;
+    }
+}
+
+template <typename Fn>
+void ReplicaExchange::for_each_replica(const Fn& fn) {
+    const int replica_num = configs.size();
+    std::atomic<int> next_idx(0);
+    pool.parallel_for(pool.get_thread_num(), [&](const int thread_idx, const int begin, const int end) {
+        for (int replica_idx = next_idx++; replica_idx < replica_num; replica_idx = next_idx++) {
+            fn(replica_idx);
+        }
+    });
+}
+
+void ReplicaExchange::attempt_exchanges(const int loop_idx) {
+    const int replica_num = configs.size();
+    const int parity = (loop_idx/configs[0].simulator.exchange_step_num) % 2;
+    const auto beta = [&](const int replica_idx) { return 1.0/configs[replica_idx].bath_kbt(); };
+    for (int pair_idx = parity; pair_idx + 1 < replica_num; pair_idx += 2) {
+        const double log_ratio = (beta(pair_idx) - beta(pair_idx+1))*(energies[pair_idx] - energies[pair_idx+1]);
+        ++attempt_nums[pair_idx];
+        if (log_ratio >= 0.0 || philox.uniform(loop_idx, pair_idx) < std::exp(log_ratio)) {
+            simulators[pair_idx]->exchange(*simulators[pair_idx+1]);
+            ++accept_nums[pair_idx];
+        }
+    }
+}
+} // smd
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace smd {
+// Fixed set of worker threads running static, contiguous chunks of an index range.
+// The calling thread works as thread 0. Chunk boundaries depend only on (n, thread_num),
+// so anything reduced per thread in thread order is reproducible for a given thread count.
+class ThreadPool {
+public:
+    explicit ThreadPool(const int init_thread_num);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    int get_thread_num() const;
+    int chunk_begin(const int n, const int thread_idx) const;
+    // fn(thread_idx, begin, end) is called once per thread; blocks until all chunks are done
+    template <typename F>
+    void parallel_for(const int n, const F& fn);
+private:
+    template <typename J>
+    static void invoke(const void* job, const int thread_idx);
+    void run(void (*fn)(const void*, const int), const void* ctx);
+    void work(const int thread_idx);
+
+    int thread_num;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    void (*job_fn)(const void*, const int) = nullptr;
+    const void* job_ctx = nullptr;
+    long generation = 0;
+    int running = 0;
+    bool stopping = false;
+};
+
+ThreadPool::ThreadPool(const int init_thread_num)
+    : thread_num(init_thread_num > 0 ? init_thread_num : std::max(1, static_cast<int>(std::thread::hardware_concurrency())))
+{
+    for (int thread_idx = 1; thread_idx < thread_num; ++thread_idx) {
+        workers.emplace_back(&ThreadPool::work, this, thread_idx);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cv.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+int ThreadPool::get_thread_num() const {
+    return thread_num;
+}
+
+int ThreadPool::chunk_begin(const int n, const int thread_idx) const {
+    return static_cast<int>((static_cast<long>(n)*thread_idx)/thread_num);
+}
+
+template <typename F>
+void ThreadPool::parallel_for(const int n, const F& fn) {
+    if (thread_num == 1) {
+        fn(0, 0, n);
+        return;
+    }
+    const auto job = [&](const int thread_idx) {
+        fn(thread_idx, chunk_begin(n, thread_idx), chunk_begin(n, thread_idx+1));
+    };
+    run(&invoke<decltype(job)>, &job);
+}
+
+template <typename J>
+void ThreadPool::invoke(const void* job, const int thread_idx) {
+    (*static_cast<const J*>(job))(thread_idx);
+}
+
+void ThreadPool::run(void (*fn)(const void*, const int), const void* ctx) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job_fn = fn;
+        job_ctx = ctx;
+        running = thread_num - 1;
+        ++generation;
+    }
+    start_cv.notify_all();
+    fn(ctx, 0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this] { return running == 0; });
+}
+
+void ThreadPool::work(const int thread_idx) {
+    long seen = 0;
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        start_cv.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+        const auto fn = job_fn;
+        const auto ctx = job_ctx;
+        lock.unlock();
+        fn(ctx, thread_idx);
+        lock.lock();
+        if (--running == 0) done_cv.notify_one();
+    }
+}
+} // smd
+
+#endif
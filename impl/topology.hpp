@@ -0,0 +1,71 @@
+#ifndef TOPOLOGY_HPP
+#define TOPOLOGY_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace smd {
+enum Species : std::uint8_t { WATER, HEAD, TAIL, SPECIES_NUM };
+
+// A soap molecule as a linear chain of beads, written as a sequence of bead types from one end: 'H' a head bead,
+// 'T' a tail bead. "HT" is the two-bead soap; "HTTT" has a three-bead tail. Bead j is bonded to bead j+1 by the
+// SPRING_K/SPRING_R0 spring, and beads j, j+1, j+2 form an angle term around bead j+1. ParticleStore lays the bonds
+// and angles of every soap out as flat index arrays, and bonded beads (1-2 pairs) have no non-bonded interaction.
+class Topology {
+public:
+    explicit Topology(const std::string& init_sequence);
+    // at least two beads, all of them 'H' or 'T'
+    static bool is_valid(const std::string& sequence);
+    const std::string& get_sequence() const;
+    int bead_num() const;
+    int bond_num() const;
+    int angle_num() const;
+    Species species(const int bead_idx) const;
+    // beads of the given species per molecule
+    int count(const Species s) const;
+private:
+    std::string sequence;
+};
+
+Topology::Topology(const std::string& init_sequence)
+    : sequence(init_sequence)
+{}
+
+bool Topology::is_valid(const std::string& sequence) {
+    if (sequence.size() < 2) return false;
+    for (const char type : sequence) {
+        if (type != 'H' && type != 'T') return false;
+    }
+    return true;
+}
+
+const std::string& Topology::get_sequence() const {
+    return sequence;
+}
+
+int Topology::bead_num() const {
+    return sequence.size();
+}
+
+int Topology::bond_num() const {
+    return bead_num() - 1;
+}
+
+int Topology::angle_num() const {
+    return bead_num() > 2 ? bead_num() - 2 : 0;
+}
+
+Species Topology::species(const int bead_idx) const {
+    return sequence[bead_idx] == 'H' ? HEAD : TAIL;
+}
+
+int Topology::count(const Species s) const {
+    int num = 0;
+    for (int bead_idx = 0; bead_idx < bead_num(); ++bead_idx) {
+        num += species(bead_idx) == s;
+    }
+    return num;
+}
+} // smd
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef TRAJECTORY_HPP
+#define TRAJECTORY_HPP
+
+#include "./particle_store.hpp"
+#include "constants.hpp"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace smd {
+enum TrajectoryEncoding : std::uint32_t { FLOAT64, FLOAT32, INT16 };
+
+// Binary trajectory, little-endian:
+//   header (64 bytes): "SMDTRAJ\0", u32 version, u32 encoding, u32 water_num, u32 soap_num,
+//                      f64 quantum, u64 frame_size, u64 frame_num, u64 index_offset, u32 soap_length, u32 reserved
+//   frames (frame_size bytes each): i64 step, then waters xyz and soaps (xyz of their soap_length beads, head first)
+//                      in the encoding (f64, f32, or i16 = round(x/quantum)), zero-padded to 8 bytes
+//   index at index_offset: frame_num x (u64 offset, i64 step)
+// frame_num and index_offset are filled in on close; a file cut short by a crash is still readable frame by frame,
+// since frame k always starts at 64 + k*frame_size.
+// Given resume_step >= 0, an existing file is continued instead: frames from resume_step on (written after the
+// checkpoint being restarted from) are cut off and new frames are appended.
+// Version 1 files had no soap_length (the field was reserved, 0) and always two beads per soap.
+//
+// Frames are encoded on the calling thread into one of queue_capacity preallocated buffers and written by a
+// background thread, so the compute loop only waits when every buffer is still queued.
+class TrajectoryWriter {
+public:
+    TrajectoryWriter(const std::string& path, const int water_num, const int soap_num, const int soap_length, const TrajectoryEncoding init_encoding, const double init_quantum, const int queue_capacity, const long resume_step = -1);
+    // blocks until every queued frame is on disk, so a checkpoint taken now never refers to frames still in memory
+    void flush();
+    ~TrajectoryWriter();
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+    void write(const ParticleStore& store, const long step);
+    // the same for a caller without a ParticleStore: next_coord() returns the position of every bead in turn, in the
+    // frame order (waters, then the soaps bead by bead from the head), which is the order of the ids
+    template <typename NextCoord>
+    void write(const long step, const NextCoord& next_coord);
+    long get_stall_num() const;
+
+    static constexpr std::size_t HEADER_SIZE = 64;
+    static constexpr std::uint32_t VERSION = 2;
+private:
+    void work();
+    template <typename NextCoord>
+    void encode(const long step, const NextCoord& next_coord, std::vector<char>& buffer) const;
+    void write_header(const std::uint64_t frame_num, const std::uint64_t index_offset);
+    void resume(const std::string& path, const long resume_step);
+    template <typename T>
+    static void put(char* dst, const T value);
+
+    std::ofstream out;
+    TrajectoryEncoding encoding;
+    double quantum;
+    int water_num;
+    int soap_num;
+    int soap_length;
+    std::size_t frame_size;
+
+    std::vector<std::vector<char>> buffers;
+    // rings of buffer indices: pending is [pending_head, pending_head + pending_num), free_buffers is a stack
+    std::vector<int> pending;
+    int pending_head = 0;
+    int pending_num = 0;
+    std::vector<int> free_buffers;
+    std::vector<std::uint64_t> index;
+    std::mutex mutex;
+    std::condition_variable pending_cv;
+    std::condition_variable free_cv;
+    bool stopping = false;
+    long stall_num = 0;
+    std::thread writer;
+};
+
+TrajectoryWriter::TrajectoryWriter(const std::string& path, const int init_water_num, const int init_soap_num, const int init_soap_length, const TrajectoryEncoding init_encoding, const double init_quantum, const int queue_capacity, const long resume_step)
+    : encoding(init_encoding), quantum(init_quantum), water_num(init_water_num), soap_num(init_soap_num), soap_length(init_soap_length)
+{
+    if (encoding > INT16 || (encoding == INT16 && !(quantum > 0.0)) || queue_capacity < 1) {
+        std::cerr << "invalid trajectory settings" << std::endl;
+        std::exit(1);
+    }
+    const std::size_t value_size = encoding == FLOAT64 ? 8 : encoding == FLOAT32 ? 4 : 2;
+    const std::size_t value_num = 3*(static_cast<std::size_t>(water_num) + static_cast<std::size_t>(soap_length)*soap_num);
+    frame_size = (8 + value_num*value_size + 7)/8*8;
+    if (resume_step >= 0) {
+        resume(path, resume_step);
+    } else {
+        out.open(path, std::ios::binary);
+        if (!out) {
+            std::cerr << "cannot create: " << path << std::endl;
+            std::exit(1);
+        }
+    }
+    // frame_num 0 marks the file as open until the destructor writes the index
+    write_header(0, 0);
+
+    buffers.assign(queue_capacity, std::vector<char>(frame_size, 0));
+    pending.assign(queue_capacity, 0);
+    for (int buffer_idx = queue_capacity-1; buffer_idx >= 0; --buffer_idx) {
+        free_buffers.push_back(buffer_idx);
+    }
+    writer = std::thread(&TrajectoryWriter::work, this);
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    pending_cv.notify_one();
+    writer.join();
+
+    const std::uint64_t frame_num = index.size()/2;
+    const std::uint64_t index_offset = HEADER_SIZE + frame_num*frame_size;
+    std::vector<char> bytes(index.size()*8);
+    for (std::size_t k = 0; k < index.size(); ++k) {
+        put(&bytes[k*8], index[k]);
+    }
+    out.write(bytes.data(), bytes.size());
+    write_header(frame_num, index_offset);
+    out.close();
+}
+
+void TrajectoryWriter::write(const ParticleStore& store, const long step) {
+    int water_idx = 0;
+    int soap_idx = 0;
+    int bead_idx = 0;
+    write(step, [&]() {
+        if (water_idx < water_num) return store.coord(store.water_index(water_idx++));
+        const int idx = store.bead_index(soap_idx, bead_idx);
+        if (++bead_idx == soap_length) {
+            bead_idx = 0;
+            ++soap_idx;
+        }
+        return store.coord(idx);
+    });
+}
+
+template <typename NextCoord>
+void TrajectoryWriter::write(const long step, const NextCoord& next_coord) {
+    int buffer_idx;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (free_buffers.empty()) ++stall_num;
+        free_cv.wait(lock, [this] { return !free_buffers.empty(); });
+        buffer_idx = free_buffers.back();
+        free_buffers.pop_back();
+    }
+    encode(step, next_coord, buffers[buffer_idx]);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[(pending_head + pending_num) % pending.size()] = buffer_idx;
+        ++pending_num;
+    }
+    pending_cv.notify_one();
+}
+
+void TrajectoryWriter::flush() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        free_cv.wait(lock, [this] { return free_buffers.size() == buffers.size(); });
+    }
+    // the writer thread is idle once every buffer is back
+    out.flush();
+}
+
+long TrajectoryWriter::get_stall_num() const {
+    return stall_num;
+}
+
+void TrajectoryWriter::work() {
+    while (true) {
+        int buffer_idx;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pending_cv.wait(lock, [this] { return stopping || pending_num > 0; });
+            if (pending_num == 0) return;
+            buffer_idx = pending[pending_head];
+            pending_head = (pending_head + 1) % pending.size();
+            --pending_num;
+        }
+        const auto& buffer = buffers[buffer_idx];
+        std::int64_t step;
+        std::memcpy(&step, buffer.data(), 8);
+        index.push_back(HEADER_SIZE + (index.size()/2)*frame_size);
+        index.push_back(static_cast<std::uint64_t>(step));
+        out.write(buffer.data(), frame_size);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_buffers.push_back(buffer_idx);
+        }
+        free_cv.notify_one();
+    }
+}
+
+template <typename NextCoord>
+void TrajectoryWriter::encode(const long step, const NextCoord& next_coord, std::vector<char>& buffer) const {
+    put(buffer.data(), static_cast<std::int64_t>(step));
+    char* dst = buffer.data() + 8;
+    const long bead_num = water_num + static_cast<long>(soap_length)*soap_num;
+    for (long bead = 0; bead < bead_num; ++bead) {
+        for (const double v : next_coord()) {
+            if (encoding == FLOAT64) {
+                put(dst, v);
+                dst += 8;
+            } else if (encoding == FLOAT32) {
+                put(dst, static_cast<float>(v));
+                dst += 4;
+            } else {
+                // saturates outside +-32767*quantum
+                const double q = std::max(-32767.0, std::min(32767.0, std::round(v/quantum)));
+                put(dst, static_cast<std::int16_t>(q));
+                dst += 2;
+            }
+        }
+    }
+}
+
+void TrajectoryWriter::write_header(const std::uint64_t frame_num, const std::uint64_t index_offset) {
+    char header[HEADER_SIZE] = {'S', 'M', 'D', 'T', 'R', 'A', 'J', '\0'};
+    put(header + 8, VERSION);
+    put(header + 12, static_cast<std::uint32_t>(encoding));
+    put(header + 16, static_cast<std::uint32_t>(water_num));
+    put(header + 20, static_cast<std::uint32_t>(soap_num));
+    put(header + 24, encoding == INT16 ? quantum : 0.0);
+    put(header + 32, static_cast<std::uint64_t>(frame_size));
+    put(header + 40, frame_num);
+    put(header + 48, index_offset);
+    put(header + 56, static_cast<std::uint32_t>(soap_length));
+    const auto end = out.tellp();
+    out.seekp(0);
+    out.write(header, HEADER_SIZE);
+    if (end > static_cast<std::streamoff>(HEADER_SIZE)) out.seekp(end);
+}
+
+void TrajectoryWriter::resume(const std::string& path, const long resume_step) {
+    std::ifstream in(path, std::ios::binary);
+    char header[HEADER_SIZE];
+    if (!in || !in.read(header, HEADER_SIZE) || std::memcmp(header, "SMDTRAJ", 8) != 0) {
+        std::cerr << "cannot resume trajectory: " << path << std::endl;
+        std::exit(1);
+    }
+    std::uint32_t saved[4];
+    std::uint64_t saved_frame_size;
+    std::uint64_t saved_frame_num;
+    std::uint32_t saved_soap_length;
+    std::memcpy(saved, header + 8, 16);
+    std::memcpy(&saved_frame_size, header + 32, 8);
+    std::memcpy(&saved_frame_num, header + 40, 8);
+    std::memcpy(&saved_soap_length, header + 56, 4);
+    if (saved[0] != VERSION || saved[1] != encoding || saved[2] != static_cast<std::uint32_t>(water_num)
+        || saved[3] != static_cast<std::uint32_t>(soap_num) || saved_soap_length != static_cast<std::uint32_t>(soap_length)
+        || saved_frame_size != frame_size) {
+        std::cerr << "trajectory settings differ from: " << path << std::endl;
+        std::exit(1);
+    }
+    // without an index (the run was killed) every whole frame after the header counts
+    in.seekg(0, std::ios::end);
+    const std::uint64_t frame_num = saved_frame_num > 0 ? saved_frame_num : (static_cast<std::uint64_t>(in.tellg()) - HEADER_SIZE)/frame_size;
+    for (std::uint64_t frame_idx = 0; frame_idx < frame_num; ++frame_idx) {
+        std::int64_t step;
+        in.seekg(HEADER_SIZE + frame_idx*frame_size);
+        in.read(reinterpret_cast<char*>(&step), 8);
+        if (step >= resume_step) break;
+        index.push_back(HEADER_SIZE + frame_idx*frame_size);
+        index.push_back(static_cast<std::uint64_t>(step));
+    }
+    in.close();
+
+    std::filesystem::resize_file(path, HEADER_SIZE + (index.size()/2)*frame_size);
+    out.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!out) {
+        std::cerr << "cannot resume trajectory: " << path << std::endl;
+        std::exit(1);
+    }
+    out.seekp(0, std::ios::end);
+}
+
+template <typename T>
+void TrajectoryWriter::put(char* dst, const T value) {
+    // x86/ARM hosts are little-endian, which is the file's byte order
+    std::memcpy(dst, &value, sizeof(T));
+}
+} // smd
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#ifdef SMD_MPI
+#include <mpi.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace smd {
+// Message passing between the ranks of a domain-decomposed run (impl/domain.hpp).
+// Default builds run every rank on this machine: the constructor forks rank_num - 1 child processes, connected to each
+// other and to the parent by a mesh of Unix socket pairs, and every process returns from it with its own rank.
+// It must be constructed before any thread is started. SMD_MPI builds take the ranks from the MPI launcher
+// (mpirun -n rank_num), which also spans several nodes.
+// Every call is collective: all ranks make the same calls in the same order.
+class Transport {
+public:
+    Transport(int& argc, char**& argv, const int init_rank_num);
+    ~Transport();
+    Transport(const Transport&) = delete;
+    Transport& operator=(const Transport&) = delete;
+    int get_rank() const;
+    int get_rank_num() const;
+    // all-to-all: sends outgoing[q] to every rank q and receives what rank q sent this rank into incoming[q];
+    // the own entry is copied
+    void exchange(const std::vector<std::vector<char>>& outgoing, std::vector<std::vector<char>>& incoming);
+    double max(const double value);
+    long sum(const long value);
+    // rank 0: waits for the other ranks and returns status, or 1 if any of them failed; the other ranks exit with status
+    int finish(const int status);
+private:
+    int rank = 0;
+    int rank_num = 1;
+#ifndef SMD_MPI
+    void send_receive(const std::vector<std::vector<char>>& outgoing, std::vector<std::vector<char>>& incoming);
+    [[noreturn]] void lost(const int other_rank) const;
+
+    // socket to every other rank, -1 for this one
+    std::vector<int> sockets;
+    std::vector<pid_t> children;
+#endif
+};
+
+template <typename T>
+void put_value(std::vector<char>& buffer, const T value) {
+    const std::size_t offset = buffer.size();
+    buffer.resize(offset + sizeof(T));
+    std::memcpy(buffer.data() + offset, &value, sizeof(T));
+}
+
+// reads the value at offset and advances offset past it
+template <typename T>
+T get_value(const std::vector<char>& buffer, std::size_t& offset) {
+    T value;
+    std::memcpy(&value, buffer.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+int Transport::get_rank() const {
+    return rank;
+}
+
+int Transport::get_rank_num() const {
+    return rank_num;
+}
+
+double Transport::max(const double value) {
+    std::vector<std::vector<char>> outgoing(rank_num);
+    for (auto& buffer : outgoing) put_value(buffer, value);
+    std::vector<std::vector<char>> incoming;
+    exchange(outgoing, incoming);
+    double result = value;
+    for (const auto& buffer : incoming) {
+        std::size_t offset = 0;
+        result = std::max(result, get_value<double>(buffer, offset));
+    }
+    return result;
+}
+
+long Transport::sum(const long value) {
+    std::vector<std::vector<char>> outgoing(rank_num);
+    for (auto& buffer : outgoing) put_value(buffer, value);
+    std::vector<std::vector<char>> incoming;
+    exchange(outgoing, incoming);
+    long result = 0;
+    // in rank order, so every rank gets the same bits
+    for (const auto& buffer : incoming) {
+        std::size_t offset = 0;
+        result += get_value<long>(buffer, offset);
+    }
+    return result;
+}
+
+#ifdef SMD_MPI
+Transport::Transport(int& argc, char**& argv, const int init_rank_num) {
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &rank_num);
+    if (rank_num != init_rank_num) {
+        if (rank == 0) std::cerr << "transport: started with " << rank_num << " MPI ranks, --ranks asks for " << init_rank_num << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+Transport::~Transport() {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if (!finalized) MPI_Finalize();
+}
+
+void Transport::exchange(const std::vector<std::vector<char>>& outgoing, std::vector<std::vector<char>>& incoming) {
+    std::vector<int> send_counts(rank_num), send_offsets(rank_num), receive_counts(rank_num), receive_offsets(rank_num);
+    std::vector<char> send_buffer;
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        send_counts[other_rank] = static_cast<int>(outgoing[other_rank].size());
+        send_offsets[other_rank] = static_cast<int>(send_buffer.size());
+        send_buffer.insert(send_buffer.end(), outgoing[other_rank].begin(), outgoing[other_rank].end());
+    }
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, receive_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    int receive_size = 0;
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        receive_offsets[other_rank] = receive_size;
+        receive_size += receive_counts[other_rank];
+    }
+    std::vector<char> receive_buffer(receive_size);
+    MPI_Alltoallv(send_buffer.data(), send_counts.data(), send_offsets.data(), MPI_BYTE,
+                  receive_buffer.data(), receive_counts.data(), receive_offsets.data(), MPI_BYTE, MPI_COMM_WORLD);
+    incoming.resize(rank_num);
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        const auto begin = receive_buffer.begin() + receive_offsets[other_rank];
+        incoming[other_rank].assign(begin, begin + receive_counts[other_rank]);
+    }
+}
+
+int Transport::finish(const int status) {
+    int failed = status != 0;
+    int any_failed = 0;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Finalize();
+    if (rank != 0) std::exit(status);
+    return any_failed ? 1 : 0;
+}
+#else
+Transport::Transport(int&, char**&, const int init_rank_num)
+    : rank_num(init_rank_num)
+{
+    // pair_sockets[a][b] is the end rank a uses to talk to rank b
+    std::vector<std::vector<int>> pair_sockets(rank_num, std::vector<int>(rank_num, -1));
+    for (int rank_a = 0; rank_a < rank_num; ++rank_a) {
+        for (int rank_b = rank_a + 1; rank_b < rank_num; ++rank_b) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+                std::cerr << "transport: socketpair failed: " << std::strerror(errno) << std::endl;
+                std::exit(1);
+            }
+            pair_sockets[rank_a][rank_b] = pair[0];
+            pair_sockets[rank_b][rank_a] = pair[1];
+        }
+    }
+    // output buffered so far would be flushed once by every process
+    std::cout << std::flush;
+    for (int child_rank = 1; child_rank < rank_num; ++child_rank) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "transport: fork failed: " << std::strerror(errno) << std::endl;
+            std::exit(1);
+        }
+        if (pid == 0) {
+            rank = child_rank;
+            children.clear();
+            break;
+        }
+        children.push_back(pid);
+    }
+    sockets = pair_sockets[rank];
+    for (int rank_a = 0; rank_a < rank_num; ++rank_a) {
+        if (rank_a == rank) continue;
+        for (const int socket : pair_sockets[rank_a]) {
+            if (socket >= 0) close(socket);
+        }
+    }
+    for (const int socket : sockets) {
+        if (socket >= 0) fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+Transport::~Transport() {
+    for (const int socket : sockets) {
+        if (socket >= 0) close(socket);
+    }
+}
+
+void Transport::exchange(const std::vector<std::vector<char>>& outgoing, std::vector<std::vector<char>>& incoming) {
+    incoming.resize(rank_num);
+    incoming[rank] = outgoing[rank];
+    if (rank_num > 1) send_receive(outgoing, incoming);
+}
+
+void Transport::send_receive(const std::vector<std::vector<char>>& outgoing, std::vector<std::vector<char>>& incoming) {
+    // every message is a u64 length and the bytes; all of them are sent and received at once through nonblocking
+    // sockets, so no rank waits on a peer that is itself blocked sending
+    std::vector<std::uint64_t> send_sizes(rank_num), receive_sizes(rank_num);
+    std::vector<std::size_t> sent(rank_num, 0), received(rank_num, 0);
+    int open_num = 0;
+    for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+        if (other_rank == rank) continue;
+        send_sizes[other_rank] = outgoing[other_rank].size();
+        incoming[other_rank].clear();
+        open_num += 2;
+    }
+    const std::size_t size_bytes = sizeof(std::uint64_t);
+    std::vector<pollfd> fds;
+    std::vector<int> fd_ranks;
+    while (open_num > 0) {
+        fds.clear();
+        fd_ranks.clear();
+        for (int other_rank = 0; other_rank < rank_num; ++other_rank) {
+            if (other_rank == rank) continue;
+            short events = 0;
+            if (sent[other_rank] < size_bytes + send_sizes[other_rank]) events |= POLLOUT;
+            if (received[other_rank] < size_bytes || received[other_rank] < size_bytes + receive_sizes[other_rank]) events |= POLLIN;
+            if (events == 0) continue;
+            fds.push_back({sockets[other_rank], events, 0});
+            fd_ranks.push_back(other_rank);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "transport: poll failed: " << std::strerror(errno) << std::endl;
+            std::exit(1);
+        }
+        for (std::size_t fd_idx = 0; fd_idx < fds.size(); ++fd_idx) {
+            const int other_rank = fd_ranks[fd_idx];
+            const int socket = fds[fd_idx].fd;
+            if (fds[fd_idx].revents & POLLOUT) {
+                // the length prefix, then the payload
+                std::size_t& done = sent[other_rank];
+                const char* data = done < size_bytes ? reinterpret_cast<const char*>(&send_sizes[other_rank]) + done
+                                                     : outgoing[other_rank].data() + (done - size_bytes);
+                const std::size_t left = done < size_bytes ? size_bytes - done : size_bytes + send_sizes[other_rank] - done;
+                const ssize_t n = send(socket, data, left, MSG_NOSIGNAL);
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) lost(other_rank);
+                if (n > 0) {
+                    done += n;
+                    if (done == size_bytes + send_sizes[other_rank]) --open_num;
+                }
+            }
+            if (fds[fd_idx].revents & (POLLIN | POLLHUP | POLLERR)) {
+                std::size_t& done = received[other_rank];
+                char* data;
+                std::size_t left;
+                if (done < size_bytes) {
+                    data = reinterpret_cast<char*>(&receive_sizes[other_rank]) + done;
+                    left = size_bytes - done;
+                } else {
+                    data = incoming[other_rank].data() + (done - size_bytes);
+                    left = size_bytes + receive_sizes[other_rank] - done;
+                }
+                const ssize_t n = recv(socket, data, left, 0);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) lost(other_rank);
+                if (n > 0) {
+                    done += n;
+                    if (done == size_bytes) incoming[other_rank].resize(receive_sizes[other_rank]);
+                    if (done == size_bytes + receive_sizes[other_rank]) --open_num;
+                }
+            }
+        }
+    }
+}
+
+void Transport::lost(const int other_rank) const {
+    std::cerr << "transport: rank " << rank << " lost the connection to rank " << other_rank << std::endl;
+    std::exit(1);
+}
+
+int Transport::finish(const int status) {
+    if (rank != 0) {
+        std::cout << std::flush;
+        std::exit(status);
+    }
+    int result = status;
+    for (const pid_t child : children) {
+        int child_status = 0;
+        if (waitpid(child, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) result = 1;
+    }
+    return result;
+}
+#endif
+} // smd
+
+#endif
@@ -1,6 +1,100 @@
+#include "./impl/config.hpp"
+#include "./impl/domain.hpp"
+#include "./impl/ensemble.hpp"
 #include "./impl/simulator.hpp"
+#include "./impl/tempering.hpp"
+#include "./impl/thread_pool.hpp"
+#include "./impl/transport.hpp"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
 
-int main() {
-    smd::Simulator simulator;
-    simulator.run();
-}
\ No newline at end of file
+namespace {
+void usage(const char* program) {
+    std::cerr << "usage: " << program << " [--config FILE] [KEY=VALUE ...] [--sweep KEY=V1,V2,...] [--replicas N] [--temperatures T1,T2,...] [--ranks N] [--print-config] [--restart]\n"
+              << "  settings apply left to right; keys are <namespace>.<CONSTANT> from constants.hpp, e.g. step_calculator.KBT=2.0\n"
+              << "  --sweep and --replicas run every grid point x replica in this process (see impl/ensemble.hpp)\n"
+              << "  --temperatures runs replica exchange over the given ladder of bath temperatures, step_calculator.BATH_KBT (see impl/tempering.hpp)\n"
+              << "  --ranks splits the sphere over N processes (see impl/domain.hpp); SMD_MPI builds run under mpirun -n N" << std::endl;
+    std::exit(1);
+}
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    for (std::size_t begin = 0; begin <= text.size(); ) {
+        const auto comma = std::min(text.find(',', begin), text.size());
+        items.push_back(text.substr(begin, comma - begin));
+        begin = comma + 1;
+    }
+    return items;
+}
+}
+
+int main(int argc, char** argv) {
+    smd::Config config;
+    std::vector<smd::SweepAxis> axes;
+    int replica_num = 1;
+    int rank_num = 0;
+    std::vector<double> kbts;
+    bool restart = false;
+    bool print_config = false;
+    for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+        const std::string arg = argv[arg_idx];
+        const bool has_value = arg_idx + 1 < argc;
+        if (arg == "--restart") {
+            restart = true;
+        } else if (arg == "--print-config") {
+            print_config = true;
+        } else if (arg == "--config" && has_value) {
+            config.load(argv[++arg_idx]);
+        } else if (arg == "--replicas" && has_value) {
+            replica_num = std::atoi(argv[++arg_idx]);
+            if (replica_num < 1) usage(argv[0]);
+        } else if (arg == "--ranks" && has_value) {
+            rank_num = std::atoi(argv[++arg_idx]);
+            if (rank_num < 1) usage(argv[0]);
+        } else if (arg == "--sweep" && has_value) {
+            const std::string sweep = argv[++arg_idx];
+            const auto eq = sweep.find('=');
+            if (eq == std::string::npos) usage(argv[0]);
+            axes.push_back({sweep.substr(0, eq), split_list(sweep.substr(eq+1))});
+        } else if (arg == "--temperatures" && has_value) {
+            for (const auto& item : split_list(argv[++arg_idx])) {
+                char* end;
+                kbts.push_back(std::strtod(item.c_str(), &end));
+                if (item.empty() || *end != '\0') usage(argv[0]);
+            }
+        } else if (arg.find('=') != std::string::npos && arg[0] != '-') {
+            config.set_assignment(arg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    config.validate();
+    if (print_config) {
+        config.write(std::cout);
+        return 0;
+    }
+
+    if (rank_num > 0) {
+        if (!axes.empty() || replica_num != 1 || !kbts.empty() || restart) usage(argv[0]);
+        // before any thread is started: the socket transport forks
+        smd::Transport transport(argc, argv, rank_num);
+        smd::DomainSimulator simulator(config, transport);
+        simulator.run();
+        return transport.finish(0);
+    }
+    if (!kbts.empty()) {
+        if (!axes.empty() || replica_num != 1) usage(argv[0]);
+        smd::ReplicaExchange replica_exchange(config, kbts, config.simulator.thread_num);
+        replica_exchange.run(restart);
+    } else if (axes.empty() && replica_num == 1) {
+        smd::ThreadPool pool(config.simulator.thread_num);
+        smd::Simulator simulator(config, pool);
+        simulator.run(restart);
+    } else {
+        smd::Ensemble ensemble(smd::expand_sweep(config, axes, replica_num), config.simulator.thread_num);
+        ensemble.run(restart);
+    }
+}
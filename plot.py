@@ -1,4 +1,7 @@
+import os
 import re
+import struct
+import sys
 import numpy as np
 import matplotlib.pyplot as plt
 
@@ -38,9 +41,10 @@ def parse_frame_attr(attr_text: str) -> dict:
 def load_log_frames(path):
     """
     return: frames = [
-      {"id": int|None, "waters": (N,3), "soaps": (M,6)},
+      {"id": int|None, "waters": (N,3), "soaps": (M,3L)},
       ...
     ]
+    L はソープ1分子のビーズ数 (soap.SEQUENCE の長さ)。行は先頭ビーズ(head)から順に xyz。
     """
     frames = []
     mode = None            # None / "waters" / "soaps"
@@ -120,8 +124,8 @@ def load_log_frames(path):
                 #        print("error")
                 cur["waters"].append([float(v) for v in vals])
             elif mode == "soaps":
-                if len(vals) != 6:
-                    raise ValueError(f"soaps は6列(head xyz tail xyz)のはず: {line}")
+                if len(vals) < 6 or len(vals) % 3 != 0:
+                    raise ValueError(f"soaps は3L列(ビーズごとの xyz)のはず: {line}")
                 #for v in vals:
                 #    if abs(float(v)) > 300:
                 #        print("error")
@@ -137,6 +141,66 @@ def load_log_frames(path):
     return frames
 
 
+# バイナリトラジェクトリ (impl/trajectory.hpp の形式)
+TRAJ_HEADER = struct.Struct("<8sIIIIdQQQII")
+TRAJ_DTYPES = {0: "<f8", 1: "<f4", 2: "<i2"}
+
+
+class TrajFile:
+    """
+    .traj を mmap で開き、任意のフレームをランダムアクセスで読む。
+      traj = TrajFile("exe.traj")
+      len(traj), traj.steps, traj.frame(k) -> {"id": step, "waters": (N,3), "soaps": (M,3L)}
+    version 1 のファイルは soap_length を持たず、常に L = 2。
+    クラッシュで index が書かれていないファイルは、固定長フレームとして先頭から数える。
+    """
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            header = f.read(TRAJ_HEADER.size)
+        (magic, version, encoding, water_num, soap_num, quantum,
+         frame_size, frame_num, index_offset, soap_length, _) = TRAJ_HEADER.unpack(header)
+        if magic != b"SMDTRAJ\0" or version not in (1, 2):
+            raise ValueError(f"not a trajectory file: {path}")
+        self.water_num = water_num
+        self.soap_num = soap_num
+        self.soap_length = soap_length if version >= 2 else 2
+        self.scale = quantum if encoding == 2 else 1.0
+        if index_offset == 0:
+            frame_num = (os.path.getsize(path) - TRAJ_HEADER.size) // frame_size
+
+        value_num = 3 * (water_num + self.soap_length * soap_num)
+        value_dtype = np.dtype(TRAJ_DTYPES[encoding])
+        pad = frame_size - 8 - value_num * value_dtype.itemsize
+        fields = [("step", "<i8"), ("coords", value_dtype, (value_num,))]
+        if pad:
+            fields.append(("pad", f"V{pad}"))
+        self.frames = np.memmap(path, dtype=np.dtype(fields), mode="r",
+                                offset=TRAJ_HEADER.size, shape=(frame_num,))
+        if index_offset:
+            index = np.memmap(path, dtype="<u8", mode="r", offset=index_offset, shape=(frame_num, 2))
+            self.steps = index[:, 1].astype(np.int64)
+        else:
+            self.steps = np.asarray(self.frames["step"])
+
+    def __len__(self):
+        return len(self.frames)
+
+    def frame(self, k):
+        coords = np.asarray(self.frames[k]["coords"], dtype=float) * self.scale
+        n = 3 * self.water_num
+        return {
+            "id": int(self.steps[k]),
+            "waters": coords[:n].reshape(self.water_num, 3),
+            "soaps": coords[n:].reshape(self.soap_num, 3 * self.soap_length),
+        }
+
+
+def load_traj_frames(path):
+    traj = TrajFile(path)
+    return [traj.frame(k) for k in range(len(traj))]
+
+
 def set_equal(ax):
     lims = np.array([ax.get_xlim3d(), ax.get_ylim3d(), ax.get_zlim3d()], dtype=float)
     c = lims.mean(axis=1)
@@ -147,7 +211,8 @@ def set_equal(ax):
 
 
 # --- 実行部 ---
-frames = load_log_frames("./debug_500x500_for_stb.log")
+path = sys.argv[1] if len(sys.argv) > 1 else "./exe.traj"
+frames = load_traj_frames(path) if path.endswith(".traj") else load_log_frames(path)
 print(f"loaded frames: {len(frames)}")
 if len(frames) == 0:
     raise SystemExit("frame が0件。タグ形式を確認して。")
@@ -160,8 +225,7 @@ for fr in frames:
     if w.size:
         all_pts.append(w)
     if s.size:
-        all_pts.append(s[:, 0:3])  # head
-        all_pts.append(s[:, 3:6])  # tail
+        all_pts.append(s.reshape(-1, 3))  # 全ビーズ
 all_pts = np.vstack(all_pts) if all_pts else np.zeros((0,3))
 
 mins = all_pts.min(axis=0) if all_pts.size else np.array([-1,-1,-1], float)
@@ -189,14 +253,16 @@ def draw_frame(idx: int):
 
     # soaps
     if s.size:
-        H = s[:, 0:3]
-        T = s[:, 3:6]
+        # 先頭ビーズ (head) と残り (tail) で色分け
+        chains = s.reshape(len(s), -1, 3)
+        H = chains[:, 0]
+        T = chains[:, 1:].reshape(-1, 3)
         ax.scatter(H[:,0], H[:,1], H[:,2], s=16)
         ax.scatter(T[:,0], T[:,1], T[:,2], s=16)
 
-        # head-tail bond
-        for h, t in zip(H, T):
-            ax.plot([h[0], t[0]], [h[1], t[1]], [h[2], t[2]], linewidth=1.0)
+        # 結合 (鎖に沿った折れ線)
+        for chain in chains:
+            ax.plot(chain[:,0], chain[:,1], chain[:,2], linewidth=1.0)
 
     fid = fr["id"]
     ax.set_title(f"frame {idx}" + (f" (id={fid})" if fid is not None else ""))